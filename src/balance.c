@@ -65,6 +65,21 @@ typedef struct {
     LIST_ENTRY list_entry;
 } data_reloc_ref;
 
+typedef struct {
+    UINT8* data;
+    write_data_context wtc;
+    chunk* c;
+    UINT64 lockaddr;
+    UINT64 locklen;
+    BOOL pending;
+} reloc_write;
+
+#define RELOC_BUFFER_SIZE 0x100000
+
+#define THROTTLE_BACKOFF    10 // ms per multiple of the latency target
+#define THROTTLE_MAX_WAIT   1000 // ms
+#define THROTTLE_SLICE      100 // ms
+
 #ifndef _MSC_VER // not in mingw yet
 #define DEVICE_DSM_FLAG_TRIM_NOT_FS_ALLOCATED 0x80000000
 #endif
@@ -96,6 +111,8 @@ static NTSTATUS add_metadata_reloc(device_extension* Vcb, LIST_ENTRY* items, tra
         return Status;
     }
     
+    invalidate_extent_cache(Vcb, mr->address);
+    
     if (!c)
         c = get_chunk_from_address(Vcb, tp->item->key.obj_id);
         
@@ -1145,6 +1162,8 @@ static NTSTATUS balance_metadata_chunk(device_extension* Vcb, chunk* c, BOOL* ch
         goto end;
     }
     
+    Vcb->balance.bytes_moved += loaded * Vcb->superblock.node_size;
+    
     Status = STATUS_SUCCESS;
     
     Vcb->need_write = TRUE;
@@ -1197,6 +1216,8 @@ static NTSTATUS add_data_reloc(device_extension* Vcb, LIST_ENTRY* items, LIST_EN
         return Status;
     }
     
+    invalidate_extent_cache(Vcb, dr->address);
+    
     if (!c)
         c = get_chunk_from_address(Vcb, tp->item->key.obj_id);
         
@@ -1562,6 +1583,83 @@ static NTSTATUS add_data_reloc_extent_item(device_extension* Vcb, data_reloc* dr
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS start_reloc_write(device_extension* Vcb, reloc_write* rw, UINT64 address, UINT32 length, chunk* c) {
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    
+    KeInitializeEvent(&rw->wtc.Event, NotificationEvent, FALSE);
+    InitializeListHead(&rw->wtc.stripes);
+    rw->wtc.tree = FALSE;
+    rw->wtc.stripes_left = 0;
+    rw->wtc.parity1 = rw->wtc.parity2 = rw->wtc.scratch = NULL;
+    rw->wtc.mdl = rw->wtc.parity1_mdl = rw->wtc.parity2_mdl = NULL;
+    rw->c = c;
+    
+    if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        get_raid56_lock_range(c, address, length, &rw->lockaddr, &rw->locklen);
+        chunk_lock_range(Vcb, c, rw->lockaddr, rw->locklen);
+    }
+    
+    Status = write_data(Vcb, address, rw->data, length, &rw->wtc, NULL, c, FALSE, 0);
+    if (!NT_SUCCESS(Status)) {
+        ERR("write_data returned %08x\n", Status);
+        
+        if (c->chunk_item->type & BLOCK_FLAG_RAID5 || c->chunk_item->type & BLOCK_FLAG_RAID6)
+            chunk_unlock_range(Vcb, c, rw->lockaddr, rw->locklen);
+        
+        free_write_data_stripes(&rw->wtc);
+        return Status;
+    }
+    
+    le = rw->wtc.stripes.Flink;
+    while (le != &rw->wtc.stripes) {
+        write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+        
+        if (stripe->status != WriteDataStatus_Ignore)
+            IoCallDriver(stripe->device->devobj, stripe->Irp);
+        
+        le = le->Flink;
+    }
+    
+    rw->pending = TRUE;
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS finish_reloc_write(device_extension* Vcb, reloc_write* rw) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    
+    if (!rw->pending)
+        return STATUS_SUCCESS;
+    
+    if (rw->wtc.stripes.Flink != &rw->wtc.stripes) {
+        LIST_ENTRY* le;
+        
+        KeWaitForSingleObject(&rw->wtc.Event, Executive, KernelMode, FALSE, NULL);
+        
+        le = rw->wtc.stripes.Flink;
+        while (le != &rw->wtc.stripes) {
+            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+            
+            if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
+                Status = stripe->iosb.Status;
+                break;
+            }
+            
+            le = le->Flink;
+        }
+    }
+    
+    free_write_data_stripes(&rw->wtc);
+    
+    if (rw->c->chunk_item->type & BLOCK_FLAG_RAID5 || rw->c->chunk_item->type & BLOCK_FLAG_RAID6)
+        chunk_unlock_range(Vcb, rw->c, rw->lockaddr, rw->locklen);
+    
+    rw->pending = FALSE;
+    
+    return Status;
+}
+
 static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* changed) {
     KEY searchkey;
     traverse_ptr tp;
@@ -1570,7 +1668,9 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     LIST_ENTRY items, metadata_items, rollback, *le;
     UINT64 loaded = 0, num_loaded = 0;
     chunk* newchunk = NULL;
-    UINT8* data = NULL;
+    reloc_write rw[2];
+    int cur = 0;
+    LARGE_INTEGER time1, time2, freq;
     
     TRACE("chunk %llx\n", c->offset);
     
@@ -1578,6 +1678,8 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     InitializeListHead(&items);
     InitializeListHead(&metadata_items);
     
+    RtlZeroMemory(rw, sizeof(rw));
+    
     ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
     
     searchkey.obj_id = c->offset;
@@ -1635,12 +1737,23 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     } else
         *changed = TRUE;
     
-    data = ExAllocatePoolWithTag(PagedPool, 0x100000, ALLOC_TAG);
-    if (!data) {
+    // Double-buffer the copy, so that each read is issued while the previous write is still in flight.
+    
+    rw[0].data = ExAllocatePoolWithTag(PagedPool, RELOC_BUFFER_SIZE, ALLOC_TAG);
+    if (!rw[0].data) {
         ERR("out of memory\n");
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
+    
+    rw[1].data = ExAllocatePoolWithTag(PagedPool, RELOC_BUFFER_SIZE, ALLOC_TAG);
+    if (!rw[1].data) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+    
+    time1 = KeQueryPerformanceCounter(&freq);
 
     le = items.Flink;
     while (le != &items) {
@@ -1739,28 +1852,58 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
         off = 0;
         
         while (off < dr->size) {
-            ULONG ds = min(dr->size - off, 0x100000);
+            ULONG ds = min(dr->size - off, RELOC_BUFFER_SIZE);
             
-            Status = read_data(Vcb, dr->address + off, ds, NULL, FALSE, data, c, NULL, NULL, 0, FALSE, 0);
+            Status = finish_reloc_write(Vcb, &rw[cur]);
+            if (!NT_SUCCESS(Status)) {
+                ERR("finish_reloc_write returned %08x\n", Status);
+                goto end;
+            }
+            
+            Status = read_data(Vcb, dr->address + off, ds, NULL, FALSE, rw[cur].data, c, NULL, NULL, 0, FALSE, 0);
             if (!NT_SUCCESS(Status)) {
                 ERR("read_data returned %08x\n", Status);
                 goto end;
             }
             
-            Status = write_data_complete(Vcb, dr->new_address + off, data, ds, NULL, newchunk, FALSE, 0);
+            // RAID5/6 writes take a range lock on their stripes, which the other write may overlap
+            if (newchunk->chunk_item->type & BLOCK_FLAG_RAID5 || newchunk->chunk_item->type & BLOCK_FLAG_RAID6) {
+                Status = finish_reloc_write(Vcb, &rw[1 - cur]);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("finish_reloc_write returned %08x\n", Status);
+                    goto end;
+                }
+            }
+            
+            Status = start_reloc_write(Vcb, &rw[cur], dr->new_address + off, ds, newchunk);
             if (!NT_SUCCESS(Status)) {
-                ERR("write_data_complete returned %08x\n", Status);
+                ERR("start_reloc_write returned %08x\n", Status);
                 goto end;
             }
             
+            cur = 1 - cur;
             off += ds;
         }
+        
+        InterlockedExchangeAdd64(&Vcb->counters.balance_data_relocated, dr->size);
+        Vcb->balance.bytes_moved += dr->size;
 
         le = le->Flink;
     }
     
-    ExFreePool(data);
-    data = NULL;
+    for (cur = 0; cur < 2; cur++) {
+        Status = finish_reloc_write(Vcb, &rw[cur]);
+        if (!NT_SUCCESS(Status)) {
+            ERR("finish_reloc_write returned %08x\n", Status);
+            goto end;
+        }
+        
+        ExFreePool(rw[cur].data);
+        rw[cur].data = NULL;
+    }
+    
+    time2 = KeQueryPerformanceCounter(NULL);
+    InterlockedExchangeAdd64(&Vcb->counters.balance_reloc_time, (time2.QuadPart - time1.QuadPart) * 1000000 / freq.QuadPart);
     
     Status = write_metadata_items(Vcb, &metadata_items, &items, NULL, &rollback);
     if (!NT_SUCCESS(Status)) {
@@ -1795,7 +1938,7 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
             if (ce->address == dr->address) {
                 ce->address = dr->new_address;
                 RemoveEntryList(&ce->list_entry);
-                InsertTailList(&dr->newchunk->changed_extents, &ce->list_entry);
+                insert_changed_extent(dr->newchunk, ce);
                 break;
             }
             
@@ -1856,6 +1999,11 @@ static NTSTATUS balance_data_chunk(device_extension* Vcb, chunk* c, BOOL* change
     Vcb->need_write = TRUE;
     
 end:
+    // make sure nothing is still writing into space we're about to roll back
+    for (cur = 0; cur < 2; cur++) {
+        finish_reloc_write(Vcb, &rw[cur]);
+    }
+    
     if (NT_SUCCESS(Status))
         clear_rollback(Vcb, &rollback);
     else
@@ -1863,8 +2011,10 @@ end:
     
     ExReleaseResourceLite(&Vcb->tree_lock);
     
-    if (data)
-        ExFreePool(data);
+    for (cur = 0; cur < 2; cur++) {
+        if (rw[cur].data)
+            ExFreePool(rw[cur].data);
+    }
     
     while (!IsListEmpty(&items)) {
         data_reloc* dr = CONTAINING_RECORD(RemoveHeadList(&items), data_reloc, list_entry);
@@ -2637,6 +2787,25 @@ static void balance_thread(void* context) {
     
     KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
     
+    if (Vcb->balance.stopping)
+        goto end;
+    
+    // Relocation can't cope with the trees of half-dropped subvols, so finish dropping them first.
+    while (!IsListEmpty(&Vcb->drop_roots) && !Vcb->readonly && !Vcb->balance.stopping) {
+        ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+        
+        Status = do_write(Vcb, NULL);
+        
+        free_trees(Vcb);
+        
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write returned %08x\n", Status);
+            goto end;
+        }
+    }
+    
     if (Vcb->balance.stopping)
         goto end;
     
@@ -2720,6 +2889,9 @@ static void balance_thread(void* context) {
                     goto end;
                 }
                 
+                throttle_background_io(Vcb, Vcb->balance.bytes_moved, &Vcb->balance.stopping);
+                Vcb->balance.bytes_moved = 0;
+                
                 KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
                 
                 if (Vcb->balance.stopping)
@@ -2789,6 +2961,9 @@ static void balance_thread(void* context) {
                     goto end;
                 }
                 
+                throttle_background_io(Vcb, Vcb->balance.bytes_moved, &Vcb->balance.stopping);
+                Vcb->balance.bytes_moved = 0;
+                
                 KeWaitForSingleObject(&Vcb->balance.event, Executive, KernelMode, FALSE, NULL);
                 
                 if (Vcb->balance.stopping)
@@ -3163,6 +3338,134 @@ NTSTATUS stop_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
     return STATUS_SUCCESS;
 }
 
+NTSTATUS set_throttle(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
+    btrfs_throttle* bt = (btrfs_throttle*)data;
+    
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+    
+    if (length < sizeof(btrfs_throttle) || !data)
+        return STATUS_INVALID_PARAMETER;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->throttle.lock, TRUE);
+    
+    Vcb->throttle.rate = bt->rate;
+    Vcb->throttle.latency_target = bt->latency_target;
+    Vcb->throttle.tokens = 0;
+    Vcb->throttle.refill_time = KeQueryPerformanceCounter(NULL);
+    
+    ExReleaseResourceLite(&Vcb->throttle.lock);
+    
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS query_throttle(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_throttle* bt = (btrfs_throttle*)data;
+    
+    if (length < sizeof(btrfs_throttle) || !data)
+        return STATUS_BUFFER_OVERFLOW;
+    
+    ExAcquireResourceSharedLite(&Vcb->throttle.lock, TRUE);
+    
+    bt->rate = Vcb->throttle.rate;
+    bt->latency_target = Vcb->throttle.latency_target;
+    bt->foreground_latency = Vcb->throttle.fg_latency;
+    
+    ExReleaseResourceLite(&Vcb->throttle.lock);
+    
+    return STATUS_SUCCESS;
+}
+
+void update_foreground_latency(device_extension* Vcb, LARGE_INTEGER time1, LARGE_INTEGER freq) {
+    LARGE_INTEGER time2;
+    UINT32 latency;
+    
+    time2 = KeQueryPerformanceCounter(NULL);
+    latency = (UINT32)min((time2.QuadPart - time1.QuadPart) * 1000000 / freq.QuadPart, 0xffffffff);
+    
+    // Unlocked on purpose - this is only ever used as a hint, and we don't want to slow down user I/O.
+    Vcb->throttle.fg_latency = (UINT32)(((UINT64)Vcb->throttle.fg_latency * 7 + latency) / 8);
+    KeQuerySystemTime(&Vcb->throttle.fg_time);
+}
+
+// Called with throttle.lock held. Returns how long in ms it will take to pay off the bucket's debt.
+static UINT64 refill_throttle_bucket(device_extension* Vcb) {
+    LARGE_INTEGER time, freq;
+    LONGLONG elapsed;
+    
+    if (Vcb->throttle.rate == 0)
+        return 0;
+    
+    time = KeQueryPerformanceCounter(&freq);
+    
+    // refill the bucket, allowing bursts of up to one second's worth
+    elapsed = min(time.QuadPart - Vcb->throttle.refill_time.QuadPart, freq.QuadPart);
+    Vcb->throttle.tokens += (elapsed * 1000 / freq.QuadPart) * Vcb->throttle.rate / 1000;
+    Vcb->throttle.refill_time = time;
+    
+    if (Vcb->throttle.tokens > (LONGLONG)Vcb->throttle.rate)
+        Vcb->throttle.tokens = Vcb->throttle.rate;
+    
+    if (Vcb->throttle.tokens >= 0)
+        return 0;
+    
+    // round up, so we don't spin on a debt of less than a millisecond
+    return ((UINT64)-Vcb->throttle.tokens * 1000 + Vcb->throttle.rate - 1) / Vcb->throttle.rate;
+}
+
+void throttle_background_io(device_extension* Vcb, UINT64 length, BOOL* stopping) {
+    LARGE_INTEGER time, delay;
+    UINT64 wait = 0, waited = 0;
+    
+    if (length == 0)
+        return;
+    
+    InterlockedExchangeAdd64(&Vcb->counters.background_bytes, length);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->throttle.lock, TRUE);
+    
+    if (Vcb->throttle.rate > 0) {
+        refill_throttle_bucket(Vcb);
+        Vcb->throttle.tokens -= length;
+    }
+    
+    if (Vcb->throttle.latency_target > 0 && Vcb->throttle.fg_latency > Vcb->throttle.latency_target) {
+        KeQuerySystemTime(&time);
+        
+        // ignore the average once the foreground has gone quiet for a second, or we'd never speed up again
+        if (time.QuadPart - Vcb->throttle.fg_time.QuadPart < 10000000)
+            wait = min(THROTTLE_BACKOFF * Vcb->throttle.fg_latency / Vcb->throttle.latency_target, THROTTLE_MAX_WAIT);
+    }
+    
+    ExReleaseResourceLite(&Vcb->throttle.lock);
+    
+    // Sleep in slices, so that stopping the balance or scrub isn't held up. A batch can be many
+    // seconds' worth of the rate limit, so we keep going until the whole of the debt is paid off.
+    while (!*stopping) {
+        UINT64 slice;
+        
+        ExAcquireResourceExclusiveLite(&Vcb->throttle.lock, TRUE);
+        slice = refill_throttle_bucket(Vcb);
+        ExReleaseResourceLite(&Vcb->throttle.lock);
+        
+        if (waited < wait)
+            slice = max(slice, wait - waited);
+        
+        if (slice == 0)
+            break;
+        
+        slice = min(slice, THROTTLE_SLICE);
+        
+        delay.QuadPart = -(LONGLONG)slice * 10000;
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+        
+        waited += slice;
+    }
+    
+    if (waited > 0)
+        InterlockedExchangeAdd64(&Vcb->counters.throttle_time, waited * 1000);
+}
+
 NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode) {
     UINT64 devid;
     LIST_ENTRY* le;
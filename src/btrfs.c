@@ -47,7 +47,7 @@
 #define INCOMPAT_SUPPORTED (BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF | BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL | BTRFS_INCOMPAT_FLAGS_MIXED_GROUPS | \
                             BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO | BTRFS_INCOMPAT_FLAGS_BIG_METADATA | BTRFS_INCOMPAT_FLAGS_RAID56 | \
                             BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF | BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA | BTRFS_INCOMPAT_FLAGS_NO_HOLES)
-#define COMPAT_RO_SUPPORTED 0
+#define COMPAT_RO_SUPPORTED (BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE | BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE_VALID)
 
 static WCHAR device_name[] = {'\\','B','t','r','f','s',0};
 static WCHAR dosdevice_name[] = {'\\','D','o','s','D','e','v','i','c','e','s','\\','B','t','r','f','s',0};
@@ -57,6 +57,7 @@ PDEVICE_OBJECT devobj;
 BOOL have_sse42 = FALSE, have_sse2 = FALSE;
 UINT64 num_reads = 0;
 LIST_ENTRY uid_map_list;
+LIST_ENTRY gid_map_list;
 LIST_ENTRY VcbList;
 ERESOURCE global_loading_lock;
 UINT32 debug_log_level = 0;
@@ -70,6 +71,7 @@ UINT32 mount_skip_balance = 0;
 UINT32 mount_no_barrier = 0;
 UINT32 mount_no_trim = 0;
 UINT32 mount_clear_cache = 0;
+UINT32 mount_delalloc = 0;
 BOOL log_started = FALSE;
 UNICODE_STRING log_device, log_file, registry_path;
 tPsUpdateDiskCounters PsUpdateDiskCounters;
@@ -301,6 +303,15 @@ static void STDCALL DriverUnload(PDRIVER_OBJECT DriverObject) {
         ExFreePool(um);
     }
     
+    while (!IsListEmpty(&gid_map_list)) {
+        LIST_ENTRY* le = RemoveHeadList(&gid_map_list);
+        gid_map* gm = CONTAINING_RECORD(le, gid_map, listentry);
+        
+        ExFreePool(gm->sid);
+
+        ExFreePool(gm);
+    }
+    
     // FIXME - free volumes and their devpaths
     
 #ifdef _DEBUG
@@ -519,6 +530,19 @@ static NTSTATUS STDCALL drv_flush_buffers(IN PDEVICE_OBJECT DeviceObject, IN PIR
             ExReleaseResourceLite(fcb->Header.PagingIoResource);
         }
         
+        // the lazy writer may only have given the data to the delayed allocator
+        if (NT_SUCCESS(Irp->IoStatus.Status) && !IsListEmpty(&fcb->delalloc)) {
+            ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+            ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+            
+            Irp->IoStatus.Status = flush_delalloc(fcb, Irp);
+            if (!NT_SUCCESS(Irp->IoStatus.Status))
+                ERR("flush_delalloc returned %08x\n", Irp->IoStatus.Status);
+            
+            ExReleaseResourceLite(fcb->Header.Resource);
+            ExReleaseResourceLite(&Vcb->tree_lock);
+        }
+        
         Status = Irp->IoStatus.Status;
     }
     
@@ -911,11 +935,12 @@ NTSTATUS create_root(device_extension* Vcb, UINT64 id, root** rootptr, BOOL no_t
         t->new_address = 0;
         t->has_new_address = FALSE;
         t->updated_extents = FALSE;
+        t->write = FALSE;
         
         InsertTailList(&Vcb->trees, &t->list_entry);
         t->list_entry_hash.Flink = NULL;
         
-        t->write = TRUE;
+        mark_tree_dirty(t);
         Vcb->need_write = TRUE;
     }
     
@@ -1360,10 +1385,11 @@ void free_fcb(fcb* fcb) {
     ExDeleteResourceLite(&fcb->nonpaged->resource);
     ExDeleteResourceLite(&fcb->nonpaged->paging_resource);
     ExDeleteResourceLite(&fcb->nonpaged->dir_children_lock);
+    ExDeleteResourceLite(&fcb->nonpaged->delalloc_lock);
     ExFreePool(fcb->nonpaged);
     
     if (fcb->sd)
-        ExFreePool(fcb->sd);
+        free_sd(fcb->Vcb, fcb->sd, fcb->sd_shared);
     
     if (fcb->adsxattr.Buffer)
         ExFreePool(fcb->adsxattr.Buffer);
@@ -1390,6 +1416,22 @@ void free_fcb(fcb* fcb) {
         ExFreePool(ext);
     }
     
+    // only happens if we're being torn down without a final flush
+    if (fcb->list_entry_delalloc.Flink) {
+        ExAcquireResourceExclusiveLite(&fcb->Vcb->delalloc_lock, TRUE);
+        RemoveEntryList(&fcb->list_entry_delalloc);
+        fcb->Vcb->delalloc_size -= fcb->delalloc_size;
+        ExReleaseResourceLite(&fcb->Vcb->delalloc_lock);
+    }
+    
+    while (!IsListEmpty(&fcb->delalloc)) {
+        LIST_ENTRY* le = RemoveHeadList(&fcb->delalloc);
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        ExFreePool(dr->data);
+        ExFreePool(dr);
+    }
+    
     while (!IsListEmpty(&fcb->hardlinks)) {
         LIST_ENTRY* le = RemoveHeadList(&fcb->hardlinks);
         hardlink* hl = CONTAINING_RECORD(le, hardlink, list_entry);
@@ -1587,6 +1629,17 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         KeWaitForSingleObject(&Vcb->scrub.finished, Executive, KernelMode, FALSE, NULL);
     }
     
+    if (Vcb->space_thread) {
+        KeWaitForSingleObject(&Vcb->space_thread_finished, Executive, KernelMode, FALSE, NULL);
+        ZwClose(Vcb->space_thread);
+    }
+    
+    if (Vcb->drop_thread) {
+        KeSetEvent(&Vcb->drop_thread_event, 0, FALSE);
+        KeWaitForSingleObject(&Vcb->drop_thread_finished, Executive, KernelMode, FALSE, NULL);
+        ZwClose(Vcb->drop_thread);
+    }
+    
     Status = registry_mark_volume_unmounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status) && Status != STATUS_TOO_LATE)
         WARN("registry_mark_volume_unmounted returned %08x\n", Status);
@@ -1620,6 +1673,8 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     ExDeleteResourceLite(&Vcb->calcthreads.lock);
     ExFreePool(Vcb->calcthreads.threads);
     
+    free_alloc_clusters(Vcb);
+    
     time.QuadPart = 0;
     KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, FALSE, NULL);
@@ -1650,6 +1705,16 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         ExFreePool(r);
     }
     
+    // deleted subvols we haven't finished dropping yet - we pick these up again on the next mount
+    while (!IsListEmpty(&Vcb->drop_roots)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->drop_roots);
+        root* r = CONTAINING_RECORD(le, root, list_entry);
+
+        ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
+        ExFreePool(r->nonpaged);
+        ExFreePool(r);
+    }
+    
     while (!IsListEmpty(&Vcb->chunks)) {
         chunk* c;
         
@@ -1676,6 +1741,9 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         if (c->cache)
             free_fcb(c->cache);
         
+        if (c->cache_image)
+            ExFreePool(c->cache_image);
+        
         ExDeleteResourceLite(&c->range_locks_lock);
         ExDeleteResourceLite(&c->lock);
         ExDeleteResourceLite(&c->changed_extents_lock);
@@ -1706,6 +1774,12 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
         
         ExFreePool(err);
     }
+    
+    while (!IsListEmpty(&Vcb->scrub.devices)) {
+        scrub_device_stats* sds = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.devices), scrub_device_stats, list_entry);
+        
+        ExFreePool(sds);
+    }
     ExReleaseResourceLite(&Vcb->scrub.stats_lock);
     
     ExDeleteResourceLite(&Vcb->fcb_lock);
@@ -1714,7 +1788,13 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     ExDeleteResourceLite(&Vcb->chunk_lock);
     ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
     ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
+    ExDeleteResourceLite(&Vcb->delalloc_lock);
     ExDeleteResourceLite(&Vcb->scrub.stats_lock);
+    ExDeleteResourceLite(&Vcb->throttle.lock);
+    ExDeleteResourceLite(&Vcb->sd_cache_lock);
+    
+    clear_extent_cache(Vcb);
+    ExDeleteResourceLite(&Vcb->extent_cache_lock);
     
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
     ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
@@ -2319,6 +2399,12 @@ static NTSTATUS STDCALL add_root(device_extension* Vcb, UINT64 id, UINT64 addr,
         RtlCopyMemory(&r->root_item, tp->item->data, min(sizeof(ROOT_ITEM), tp->item->size));
         if (tp->item->size < sizeof(ROOT_ITEM))
             RtlZeroMemory(((UINT8*)&r->root_item) + tp->item->size, sizeof(ROOT_ITEM) - tp->item->size);
+        
+        // deleted subvol that hasn't been completely dropped yet - the drop thread will carry on where it left off
+        if (r->id >= 0x100 && !(r->id & 0xf000000000000000) && r->root_item.num_references == 0) {
+            InsertTailList(&Vcb->drop_roots, &r->list_entry);
+            return STATUS_SUCCESS;
+        }
     }
     
     if (!Vcb->readonly && (r->id == BTRFS_ROOT_ROOT || r->id == BTRFS_ROOT_FSTREE || (r->id >= 0x100 && !(r->id & 0xf000000000000000)))) { // FS tree root
@@ -2356,6 +2442,10 @@ static NTSTATUS STDCALL add_root(device_extension* Vcb, UINT64 id, UINT64 addr,
             Vcb->uuid_root = r;
             break;
             
+        case BTRFS_ROOT_FREE_SPACE:
+            Vcb->space_root = r;
+            break;
+            
         case BTRFS_ROOT_DATA_RELOC:
             Vcb->data_reloc_root = r;
     }
@@ -2882,6 +2972,9 @@ static NTSTATUS STDCALL load_chunk_root(device_extension* Vcb, PIRP Irp) {
                 c->offset = tp.item->key.offset;
                 c->used = c->oldused = 0;
                 c->cache = c->old_cache = NULL;
+                c->cache_image = NULL;
+                c->cache_image_len = 0;
+                c->cache_image_inode = 0;
                 c->created = FALSE;
                 c->readonly = FALSE;
                 c->reloc = FALSE;
@@ -2940,7 +3033,8 @@ static NTSTATUS STDCALL load_chunk_root(device_extension* Vcb, PIRP Irp) {
                 ExInitializeResourceLite(&c->changed_extents_lock);
                 
                 InitializeListHead(&c->space);
-                InitializeListHead(&c->space_size);
+                c->space_tree.root = NULL;
+                c->space_tree.root_size = NULL;
                 InitializeListHead(&c->deleting);
                 InitializeListHead(&c->changed_extents);
                 
@@ -3334,6 +3428,9 @@ static NTSTATUS create_calc_threads(PDEVICE_OBJECT DeviceObject) {
     }
     
     InitializeListHead(&Vcb->calcthreads.job_list);
+    InitializeListHead(&Vcb->calcthreads.flush_list);
+    InitializeListHead(&Vcb->calcthreads.tree_list);
+    InitializeListHead(&Vcb->calcthreads.scrub_list);
     ExInitializeResourceLite(&Vcb->calcthreads.lock);
     KeInitializeEvent(&Vcb->calcthreads.event, NotificationEvent, FALSE);
     
@@ -3582,13 +3679,14 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     device_extension* Vcb = NULL;
     LIST_ENTRY *le, batchlist;
     KEY searchkey;
-    traverse_ptr tp;
+    traverse_ptr tp, next_tp;
     fcb* root_fcb = NULL;
     ccb* root_ccb = NULL;
-    BOOL init_lookaside = FALSE;
+    BOOL init_lookaside = FALSE, atts_set = FALSE, sd_set = FALSE;
     device* dev;
     volume_device_extension* vde;
     volume_child* vc;
+    UINT8 i;
     
     TRACE("(%p, %p)\n", DeviceObject, Irp);
     
@@ -3679,7 +3777,12 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     ExInitializeResourceLite(&Vcb->chunk_lock);
     ExInitializeResourceLite(&Vcb->dirty_fcbs_lock);
     ExInitializeResourceLite(&Vcb->dirty_filerefs_lock);
+    ExInitializeResourceLite(&Vcb->delalloc_lock);
     ExInitializeResourceLite(&Vcb->scrub.stats_lock);
+    ExInitializeResourceLite(&Vcb->throttle.lock);
+    
+    init_sd_cache(Vcb);
+    init_extent_cache(Vcb);
 
     ExInitializeResourceLite(&Vcb->load_lock);
     ExAcquireResourceExclusiveLite(&Vcb->load_lock, TRUE);
@@ -3752,6 +3855,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     
     InitializeListHead(&Vcb->roots);
     InitializeListHead(&Vcb->drop_roots);
+    KeInitializeEvent(&Vcb->drop_thread_event, SynchronizationEvent, FALSE);
     
     Vcb->log_to_phys_loaded = FALSE;
     
@@ -3774,12 +3878,19 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     InitializeListHead(&Vcb->chunks_changed);
     InitializeListHead(&Vcb->trees);
     InitializeListHead(&Vcb->trees_hash);
+    
+    for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+        InitializeListHead(&Vcb->dirty_trees[i]);
+    }
+    
     InitializeListHead(&Vcb->all_fcbs);
     InitializeListHead(&Vcb->dirty_fcbs);
     InitializeListHead(&Vcb->dirty_filerefs);
+    InitializeListHead(&Vcb->delalloc_fcbs);
     
     InitializeListHead(&Vcb->DirNotifyList);
     InitializeListHead(&Vcb->scrub.errors);
+    InitializeListHead(&Vcb->scrub.devices);
 
     FsRtlNotifyInitializeSync(&Vcb->NotifySync);
     
@@ -3850,6 +3961,15 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         goto exit;
     }
     
+    if (Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE) {
+        if (Vcb->space_root && Vcb->superblock.compat_ro_flags & BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE_VALID)
+            Vcb->free_space_tree = TRUE;
+        else {
+            WARN("mounting read-only because free space tree is missing or not valid\n");
+            Vcb->readonly = TRUE;
+        }
+    }
+    
     Status = find_chunk_usage(Vcb, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("find_chunk_usage returned %08x\n", Status);
@@ -3934,9 +4054,24 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (tp.item->size > 0)
         RtlCopyMemory(&root_fcb->inode_item, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
     
-    fcb_get_sd(root_fcb, NULL, TRUE, Irp);
+    // the xattrs follow the INODE_ITEM, so load them in the same walk
+    while (find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
+        tp = next_tp;
+        
+        if (tp.item->key.obj_id > root_fcb->inode || tp.item->key.obj_type > TYPE_XATTR_ITEM)
+            break;
+        
+        if (tp.item->key.obj_type == TYPE_XATTR_ITEM)
+            fcb_load_xattr(root_fcb, tp.item, &atts_set, &sd_set);
+    }
     
-    root_fcb->atts = get_file_attributes(Vcb, root_fcb->subvol, root_fcb->inode, root_fcb->type, FALSE, FALSE, Irp);
+    if (!sd_set)
+        fcb_get_sd(root_fcb, NULL, FALSE, Irp);
+    
+    fcb_share_sd(root_fcb);
+    
+    if (!atts_set)
+        root_fcb->atts = get_file_attributes(Vcb, root_fcb->subvol, root_fcb->inode, root_fcb->type, FALSE, TRUE, Irp);
     
     Vcb->root_fileref = create_fileref();
     if (!Vcb->root_fileref) {
@@ -4011,6 +4146,12 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         goto exit;
     }
     
+    Status = init_alloc_clusters(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("init_alloc_clusters returned %08x\n", Status);
+        goto exit;
+    }
+    
     Status = registry_mark_volume_mounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08x\n", Status);
@@ -4019,6 +4160,28 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND)
         WARN("look_for_balance_item returned %08x\n", Status);
     
+    if (!Vcb->readonly) {
+        KeInitializeEvent(&Vcb->space_thread_finished, NotificationEvent, FALSE);
+        
+        Vcb->space_thread_running = TRUE;
+        
+        Status = PsCreateSystemThread(&Vcb->space_thread, 0, NULL, NULL, NULL, space_loader_thread, NewDeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08x\n", Status);
+            Vcb->space_thread = NULL;
+            Vcb->space_thread_running = FALSE;
+        }
+        
+        KeInitializeEvent(&Vcb->drop_thread_finished, NotificationEvent, FALSE);
+        
+        Status = PsCreateSystemThread(&Vcb->drop_thread, 0, NULL, NULL, NULL, drop_thread, NewDeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            WARN("PsCreateSystemThread returned %08x\n", Status);
+            Vcb->drop_thread = NULL;
+        } else if (!IsListEmpty(&Vcb->drop_roots))
+            KeSetEvent(&Vcb->drop_thread_event, 0, FALSE);
+    }
+    
     Status = STATUS_SUCCESS;
     
     vde->mounted_device = NewDeviceObject;
@@ -4057,7 +4220,13 @@ exit2:
             ExDeleteResourceLite(&Vcb->chunk_lock);
             ExDeleteResourceLite(&Vcb->dirty_fcbs_lock);
             ExDeleteResourceLite(&Vcb->dirty_filerefs_lock);
+            ExDeleteResourceLite(&Vcb->delalloc_lock);
             ExDeleteResourceLite(&Vcb->scrub.stats_lock);
+            ExDeleteResourceLite(&Vcb->throttle.lock);
+            ExDeleteResourceLite(&Vcb->sd_cache_lock);
+
+            clear_extent_cache(Vcb);
+            ExDeleteResourceLite(&Vcb->extent_cache_lock);
 
             if (Vcb->devices.Flink) {
                 while (!IsListEmpty(&Vcb->devices)) {
@@ -4628,7 +4797,7 @@ NTSTATUS STDCALL DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING Regist
     UNICODE_STRING dosdevice_nameW;
     control_device_extension* cde;
     
-    InitializeListHead(&uid_map_list);
+    init_mappings();
     
     log_device.Buffer = NULL;
     log_device.Length = log_device.MaximumLength = 0;
@@ -14,11 +14,13 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define BTRFS_MAGIC         0x4d5f53665248425f
 #define MAX_LABEL_SIZE      0x100
 #define SUBVOL_ROOT_INODE   0x100
+#define BTRFS_MAX_LEVEL     8
 
 #define TYPE_INODE_ITEM        0x01
 #define TYPE_INODE_REF         0x0C
 #define TYPE_INODE_EXTREF      0x0D
 #define TYPE_XATTR_ITEM        0x18
+#define TYPE_ORPHAN_ITEM       0x30
 #define TYPE_DIR_ITEM          0x54
 #define TYPE_DIR_INDEX         0x60
 #define TYPE_EXTENT_DATA       0x6C
@@ -34,6 +36,9 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define TYPE_SHARED_BLOCK_REF  0xB6
 #define TYPE_SHARED_DATA_REF   0xB8
 #define TYPE_BLOCK_GROUP_ITEM  0xC0
+#define TYPE_FREE_SPACE_INFO   0xC6
+#define TYPE_FREE_SPACE_EXTENT 0xC7
+#define TYPE_FREE_SPACE_BITMAP 0xC8
 #define TYPE_DEV_EXTENT        0xCC
 #define TYPE_DEV_ITEM          0xD8
 #define TYPE_CHUNK_ITEM        0xE4
@@ -48,6 +53,7 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 #define BTRFS_ROOT_FSTREE       5
 #define BTRFS_ROOT_CHECKSUM     7
 #define BTRFS_ROOT_UUID         9
+#define BTRFS_ROOT_FREE_SPACE   0xa
 #define BTRFS_ROOT_DATA_RELOC   0xFFFFFFFFFFFFFFF7
 
 #define BTRFS_COMPRESSION_NONE  0
@@ -74,6 +80,7 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 
 #define FREE_SPACE_CACHE_ID     0xFFFFFFFFFFFFFFF5
 #define EXTENT_CSUM_ID          0xFFFFFFFFFFFFFFF6
+#define ORPHAN_ID               0xFFFFFFFFFFFFFFFB
 #define BALANCE_ITEM_ID         0xFFFFFFFFFFFFFFFC
 
 #define BTRFS_INODE_NODATASUM   0x001
@@ -91,7 +98,8 @@ static const UINT64 superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0x4
 
 #define BTRFS_SUBVOL_READONLY   0x1
 
-#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE  0x1
+#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE          0x1
+#define BTRFS_COMPAT_RO_FLAGS_FREE_SPACE_CACHE_VALID    0x2
 
 #define BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF      0x0001
 #define BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL     0x0002
@@ -424,6 +432,13 @@ typedef struct {
     UINT64 num_bitmaps;
 } FREE_SPACE_ITEM;
 
+#define FREE_SPACE_USING_BITMAPS 1
+
+typedef struct {
+    UINT32 count;
+    UINT32 flags;
+} FREE_SPACE_INFO;
+
 typedef struct {
     UINT64 dir;
     UINT64 index;
@@ -72,6 +72,8 @@
 #define EA_PROP_COMPRESSION_HASH 0x20ccdf69
 
 #define MAX_EXTENT_SIZE 0x8000000 // 128 MB
+#define ALLOC_CLUSTER_SIZE 0x800000 // 8 MB
+#define DELALLOC_LIMIT 0x4000000 // 64 MB
 #define COMPRESSED_EXTENT_SIZE 0x20000 // 128 KB
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
@@ -98,6 +100,7 @@ typedef struct _fcb_nonpaged {
     ERESOURCE resource;
     ERESOURCE paging_resource;
     ERESOURCE dir_children_lock;
+    ERESOURCE delalloc_lock;
 } fcb_nonpaged;
 
 struct _root;
@@ -115,6 +118,14 @@ typedef struct {
     EXTENT_DATA extent_data;
 } extent;
 
+typedef struct {
+    UINT64 start;
+    UINT64 length;
+    UINT8* data;
+    
+    LIST_ENTRY list_entry;
+} delalloc_range;
+
 typedef struct {
     UINT64 parent;
     UINT64 index;
@@ -156,6 +167,7 @@ typedef struct _fcb {
     UINT8 type;
     INODE_ITEM inode_item;
     SECURITY_DESCRIPTOR* sd;
+    BOOL sd_shared;
     FILE_LOCK lock;
     BOOL deleted;
     PKTHREAD lazy_writer_thread;
@@ -164,6 +176,8 @@ typedef struct _fcb {
     WCHAR* debug_desc;
     BOOL csum_loaded;
     LIST_ENTRY extents;
+    LIST_ENTRY delalloc;
+    UINT64 delalloc_size;
     UINT64 last_dir_index;
     ANSI_STRING reparse_xattr;
     ANSI_STRING ea_xattr;
@@ -196,6 +210,7 @@ typedef struct _fcb {
     
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_all;
+    LIST_ENTRY list_entry_delalloc;
 } fcb;
 
 typedef struct {
@@ -294,6 +309,7 @@ typedef struct _tree {
     LIST_ENTRY itemlist;
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_dirty;
     UINT64 new_address;
     BOOL has_new_address;
     BOOL updated_extents;
@@ -355,13 +371,27 @@ typedef struct _root_cache {
     struct _root_cache* next;
 } root_cache;
 
+typedef struct _space_node {
+    struct _space_node* left;
+    struct _space_node* right;
+    int height;
+} space_node;
+
 typedef struct {
     UINT64 address;
     UINT64 size;
     LIST_ENTRY list_entry;
-    LIST_ENTRY list_entry_size;
+    space_node node;
+    space_node node_size;
+    UINT64 tree_address; // address and size as of when the entry was put in the trees
+    UINT64 tree_size;
 } space;
 
+typedef struct {
+    space_node* root; // by address
+    space_node* root_size; // by size, then address
+} space_tree;
+
 typedef struct {
     PDEVICE_OBJECT devobj;
     DEV_ITEM devitem;
@@ -397,8 +427,12 @@ typedef struct {
     device** devices;
     fcb* cache;
     fcb* old_cache;
+    UINT8* cache_image; // what we last wrote to or read from the cache inode, up to its final non-zero sector
+    ULONG cache_image_len;
+    UINT64 cache_image_inode;
+    UINT64 cache_image_size;
     LIST_ENTRY space;
-    LIST_ENTRY space_size;
+    space_tree space_tree;
     LIST_ENTRY deleting;
     LIST_ENTRY changed_extents;
     LIST_ENTRY range_locks;
@@ -460,6 +494,36 @@ typedef struct {
     LIST_ENTRY list_entry;
 } calc_job;
 
+typedef struct {
+    tree** trees;
+    UINT8** data;
+    ULONG num_trees;
+    LONG pos, done;
+    KEVENT event;
+    LONG refcount;
+    LIST_ENTRY list_entry;
+} tree_write_job;
+
+typedef struct {
+    chunk* c;
+    void* context;
+    UINT64 stripe_start;
+    UINT64 bit_start;
+    ULONG num_stripes;
+    LONG pos, done;
+    KEVENT event;
+    LONG refcount;
+    LIST_ENTRY list_entry;
+} scrub_parity_job;
+
+typedef struct {
+    LIST_ENTRY fcbs;
+    LIST_ENTRY batchlist;
+    NTSTATUS Status;
+    KEVENT event;
+    LIST_ENTRY list_entry;
+} flush_fcb_job;
+
 typedef struct {
     PDEVICE_OBJECT DeviceObject;
     HANDLE handle;
@@ -470,11 +534,21 @@ typedef struct {
 typedef struct {
     ULONG num_threads;
     LIST_ENTRY job_list;
+    LIST_ENTRY flush_list;
+    LIST_ENTRY tree_list;
+    LIST_ENTRY scrub_list;
     ERESOURCE lock;
     drv_calc_thread* threads;
     KEVENT event;
 } drv_calc_threads;
 
+typedef struct {
+    ERESOURCE lock;
+    chunk* c;
+    UINT64 address;
+    UINT64 length;
+} alloc_cluster;
+
 typedef struct {
     BOOL ignore;
     BOOL compress;
@@ -489,8 +563,54 @@ typedef struct {
     BOOL no_barrier;
     BOOL no_trim;
     BOOL clear_cache;
+    BOOL delalloc;
 } mount_options;
 
+#define SD_CACHE_BUCKETS 256
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    UINT32 hash;
+    ULONG length;
+    LONG refcount;
+    UINT8 data[1];
+} sd_cache_entry;
+
+#define EXTENT_CACHE_BUCKETS 1024
+#define EXTENT_CACHE_MAX_ENTRIES 65536
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    UINT64 address;
+    UINT64 size;
+    UINT64 refcount;
+    UINT64 flags;
+    BOOL unique_known;
+    BOOL unique;
+} extent_cache_entry;
+
+typedef struct {
+    LONGLONG sd_cache_hits;
+    LONGLONG sd_cache_misses;
+    LONGLONG sd_cache_entries;
+    LONGLONG sd_cache_size;
+    LONGLONG sd_cache_saved;
+    LONGLONG space_cache_written;
+    LONGLONG space_cache_skipped;
+    LONGLONG space_cache_loaded;
+    LONGLONG space_cache_loaded_bg;
+    LONGLONG space_cache_load_time;
+    LONGLONG balance_data_relocated;
+    LONGLONG balance_reloc_time;
+    LONGLONG background_bytes;
+    LONGLONG throttle_time;
+    LONGLONG extent_cache_hits;
+    LONGLONG extent_cache_misses;
+    LONGLONG extent_cache_invalidations;
+    LONGLONG extent_refs_applied;
+    LONGLONG extent_refs_collapsed;
+} fs_counters;
+
 #define VCB_TYPE_FS         1
 #define VCB_TYPE_CONTROL    2
 #define VCB_TYPE_VOLUME     3
@@ -530,6 +650,7 @@ typedef struct {
     NTSTATUS status;
     KEVENT event;
     KEVENT finished;
+    UINT64 bytes_moved;
 } balance_info;
 
 typedef struct {
@@ -556,6 +677,14 @@ typedef struct {
     };
 } scrub_error;
 
+typedef struct {
+    UINT64 dev_id;
+    UINT64 data_scrubbed;
+    UINT64 read_time;
+    UINT64 num_reads;
+    LIST_ENTRY list_entry;
+} scrub_device_stats;
+
 typedef struct {
     HANDLE thread;
     ERESOURCE stats_lock;
@@ -573,8 +702,19 @@ typedef struct {
     NTSTATUS error;
     ULONG num_errors;
     LIST_ENTRY errors;
+    LIST_ENTRY devices;
 } scrub_info;
 
+typedef struct {
+    ERESOURCE lock;
+    UINT64 rate;
+    UINT32 latency_target;
+    LONGLONG tokens;
+    LARGE_INTEGER refill_time;
+    UINT32 fg_latency;
+    LARGE_INTEGER fg_time;
+} throttle_info;
+
 struct _volume_device_extension;
 
 typedef struct _device_extension {
@@ -586,6 +726,7 @@ typedef struct _device_extension {
 #ifdef DEBUG_STATS
     debug_stats stats;
 #endif
+    fs_counters counters;
     UINT64 devices_loaded;
     superblock superblock;
     BOOL readonly;
@@ -594,6 +735,7 @@ typedef struct _device_extension {
     BOOL lock_paused_balance;
     BOOL disallow_dismount;
     BOOL trim;
+    BOOL free_space_tree;
     PFILE_OBJECT locked_fileobj;
     fcb* volume_fcb;
     file_ref* root_fileref;
@@ -617,6 +759,7 @@ typedef struct _device_extension {
     root* dev_root;
     root* uuid_root;
     root* data_reloc_root;
+    root* space_root;
     BOOL log_to_phys_loaded;
     LIST_ENTRY sys_chunks;
     LIST_ENTRY chunks;
@@ -624,18 +767,36 @@ typedef struct _device_extension {
     LIST_ENTRY trees;
     LIST_ENTRY trees_hash;
     LIST_ENTRY* trees_ptrs[256];
+    LIST_ENTRY dirty_trees[BTRFS_MAX_LEVEL];
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     ERESOURCE dirty_fcbs_lock;
     LIST_ENTRY dirty_filerefs;
     ERESOURCE dirty_filerefs_lock;
+    LIST_ENTRY delalloc_fcbs;
+    ERESOURCE delalloc_lock;
+    UINT64 delalloc_size;
+    LIST_ENTRY sd_cache[SD_CACHE_BUCKETS];
+    ERESOURCE sd_cache_lock;
+    LIST_ENTRY extent_cache[EXTENT_CACHE_BUCKETS];
+    ULONG extent_cache_entries;
+    ERESOURCE extent_cache_lock;
     ERESOURCE chunk_lock;
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
     KEVENT flush_thread_finished;
+    HANDLE space_thread;
+    KEVENT space_thread_finished;
+    BOOL space_thread_running;
+    HANDLE drop_thread;
+    KEVENT drop_thread_event;
+    KEVENT drop_thread_finished;
     drv_calc_threads calcthreads;
+    alloc_cluster* clusters;
+    ULONG num_clusters;
     balance_info balance;
     scrub_info scrub;
+    throttle_info throttle;
     PFILE_OBJECT root_file;
     PAGED_LOOKASIDE_LIST tree_data_lookaside;
     PAGED_LOOKASIDE_LIST traverse_ptr_lookaside;
@@ -682,12 +843,26 @@ typedef struct _volume_device_extension {
     LIST_ENTRY list_entry;
 } volume_device_extension;
 
+#define MAPPING_HASH_BUCKETS 1024
+
 typedef struct {
     LIST_ENTRY listentry;
+    LIST_ENTRY listentry_sid;
+    LIST_ENTRY listentry_id;
     PSID sid;
+    UINT32 sid_hash;
     UINT32 uid;
 } uid_map;
 
+typedef struct {
+    LIST_ENTRY listentry;
+    LIST_ENTRY listentry_sid;
+    LIST_ENTRY listentry_id;
+    PSID sid;
+    UINT32 sid_hash;
+    UINT32 gid;
+} gid_map;
+
 enum write_data_status {
     WriteDataStatus_Pending,
     WriteDataStatus_Success,
@@ -826,6 +1001,7 @@ extern UINT32 mount_skip_balance;
 extern UINT32 mount_no_barrier;
 extern UINT32 mount_no_trim;
 extern UINT32 mount_clear_cache;
+extern UINT32 mount_delalloc;
 
 #ifdef _DEBUG
 
@@ -873,7 +1049,7 @@ UINT32 STDCALL calc_crc32c(UINT32 seed, UINT8* msg, ULONG msglen);
 
 typedef struct {
     LIST_ENTRY* list;
-    LIST_ENTRY* list_size;
+    space_tree* tree;
     UINT64 address;
     UINT64 length;
     chunk* chunk;
@@ -911,6 +1087,9 @@ NTSTATUS STDCALL do_load_tree(device_extension* Vcb, tree_holder* th, root* r, t
 void clear_rollback(device_extension* Vcb, LIST_ENTRY* rollback);
 void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback);
 void free_trees_root(device_extension* Vcb, root* r);
+void mark_tree_dirty(tree* t);
+void set_tree_level(tree* t, UINT8 level);
+void clear_dirty_trees(device_extension* Vcb);
 void add_rollback(LIST_ENTRY* rollback, enum rollback_type type, void* ptr);
 void commit_batch_list(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp);
 void clear_batch_list(device_extension* Vcb, LIST_ENTRY* batchlist);
@@ -949,6 +1128,14 @@ NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* da
 BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address);
 void get_raid56_lock_range(chunk* c, UINT64 address, UINT64 length, UINT64* lockaddr, UINT64* locklen);
 NTSTATUS calc_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum);
+NTSTATUS init_alloc_clusters(device_extension* Vcb);
+void release_alloc_clusters(device_extension* Vcb);
+void free_alloc_clusters(device_extension* Vcb);
+NTSTATUS flush_delalloc(fcb* fcb, PIRP Irp);
+NTSTATUS flush_all_delalloc(device_extension* Vcb, PIRP Irp);
+void read_delalloc(fcb* fcb, UINT8* data, UINT64 start, UINT64 length);
+BOOL insert_extent_cluster(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data, PIRP Irp, LIST_ENTRY* rollback,
+                           UINT8 compression, UINT64 decoded_size, BOOL file_write, UINT32 irp_offset);
 
 // in dirctrl.c
 NTSTATUS STDCALL drv_directory_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
@@ -959,10 +1146,15 @@ NTSTATUS STDCALL drv_query_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 NTSTATUS STDCALL drv_set_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 BOOL get_sd_from_xattr(fcb* fcb, ULONG buflen);
 void fcb_get_sd(fcb* fcb, struct _fcb* parent, BOOL look_for_xattr, PIRP Irp);
+void init_mappings();
 void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid);
+void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 gid);
 UINT32 sid_to_uid(PSID sid);
 void uid_to_sid(UINT32 uid, PSID* sid);
 NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as);
+void init_sd_cache(device_extension* Vcb);
+void fcb_share_sd(fcb* fcb);
+void free_sd(device_extension* Vcb, SECURITY_DESCRIPTOR* sd, BOOL shared);
 
 // in fileinfo.c
 NTSTATUS STDCALL drv_set_information(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
@@ -985,6 +1177,7 @@ NTSTATUS delete_reparse_point(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 NTSTATUS STDCALL drv_create(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnus, file_ref* related, BOOL parent, USHORT* parsed, ULONG* fn_offset,
                       POOL_TYPE pooltype, BOOL case_sensitive, PIRP Irp);
+void fcb_load_xattr(fcb* fcb, tree_data* item, BOOL* atts_set, BOOL* sd_set);
 NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type, PANSI_STRING utf8, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
 NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI_STRING* xattr, UINT32 streamhash, fcb* parent, fcb** pfcb, PIRP Irp);
 void insert_fileref_child(file_ref* parent, file_ref* child, BOOL do_lock);
@@ -1001,12 +1194,15 @@ void trim_whole_device(device* dev);
 
 // in flushthread.c
 void STDCALL flush_thread(void* context);
+void STDCALL drop_thread(void* context);
 NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp);
 NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp);
+void do_flush_fcb_job(flush_fcb_job* job);
 NTSTATUS STDCALL write_data_phys(PDEVICE_OBJECT device, UINT64 address, void* data, UINT32 length, BOOL fua);
 BOOL is_tree_unique(device_extension* Vcb, tree* t, PIRP Irp);
 NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp);
+void write_tree_node(device_extension* Vcb, tree* t, UINT8* data);
 void add_checksum_entry(device_extension* Vcb, UINT64 address, ULONG length, UINT32* csum, PIRP Irp);
 BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* address);
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, UINT64 address, UINT64 size);
@@ -1026,19 +1222,25 @@ NTSTATUS pnp_query_remove_device(PDEVICE_OBJECT DeviceObject, PIRP Irp);
 
 // in free-space.c
 NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp);
+void STDCALL space_loader_thread(void* context);
 NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp);
 NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS remove_free_space_tree_chunk(device_extension* Vcb, chunk* c, PIRP Irp);
 NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size);
+NTSTATUS add_space_entry(LIST_ENTRY* list, space_tree* tree, UINT64 offset, UINT64 size);
+void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c);
+void space_tree_insert(space_tree* tree, space* s);
+space* space_tree_find_address(space_tree* tree, UINT64 address);
+space* space_tree_find_size(space_tree* tree, UINT64 length);
 void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func);
-void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
 void _space_list_subtract(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func);
-void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
 
 #define space_list_add(Vcb, c, deleting, address, length, rollback) _space_list_add(Vcb, c, deleting, address, length, rollback, funcname)
-#define space_list_add2(Vcb, list, list_size, address, length, rollback) _space_list_add2(Vcb, list, list_size, address, length, NULL, rollback, funcname)
+#define space_list_add2(Vcb, list, tree, address, length, rollback) _space_list_add2(Vcb, list, tree, address, length, NULL, rollback, funcname)
 #define space_list_subtract(Vcb, c, deleting, address, length, rollback) _space_list_subtract(Vcb, c, deleting, address, length, rollback, funcname)
-#define space_list_subtract2(Vcb, list, list_size, address, length, rollback) _space_list_subtract2(Vcb, list, list_size, address, length, NULL, rollback, funcname)
+#define space_list_subtract2(Vcb, list, tree, address, length, rollback) _space_list_subtract2(Vcb, list, tree, address, length, NULL, rollback, funcname)
 
 // in extent-tree.c
 NTSTATUS increase_extent_refcount_data(device_extension* Vcb, UINT64 address, UINT64 size, UINT64 root, UINT64 inode, UINT64 offset, UINT32 refcount, PIRP Irp);
@@ -1053,11 +1255,15 @@ void update_extent_flags(device_extension* Vcb, UINT64 address, UINT64 flags, PI
 NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset,
                                    signed long long count, BOOL no_csum, BOOL superseded, PIRP Irp);
 void add_changed_extent_ref(chunk* c, UINT64 address, UINT64 size, UINT64 root, UINT64 objid, UINT64 offset, UINT32 count, BOOL no_csum);
+void insert_changed_extent(chunk* c, changed_extent* ce);
 UINT64 find_extent_shared_tree_refcount(device_extension* Vcb, UINT64 address, UINT64 parent, PIRP Irp);
 UINT64 find_extent_shared_data_refcount(device_extension* Vcb, UINT64 address, UINT64 parent, PIRP Irp);
 NTSTATUS decrease_extent_refcount(device_extension* Vcb, UINT64 address, UINT64 size, UINT8 type, void* data, KEY* firstitem,
                                   UINT8 level, UINT64 parent, BOOL superseded, PIRP Irp);
 UINT64 get_extent_data_ref_hash2(UINT64 root, UINT64 objid, UINT64 offset);
+void init_extent_cache(device_extension* Vcb);
+void invalidate_extent_cache(device_extension* Vcb, UINT64 address);
+void clear_extent_cache(device_extension* Vcb);
 
 // in worker-thread.c
 void do_read_job(PIRP Irp);
@@ -1088,6 +1294,11 @@ NTSTATUS STDCALL drv_device_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 void calc_thread(void* context);
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj);
 void free_calc_job(calc_job* cj);
+NTSTATUS add_tree_write_job(device_extension* Vcb, tree** trees, UINT8** data, ULONG num_trees, tree_write_job** ptwj);
+void free_tree_write_job(tree_write_job* twj);
+NTSTATUS add_scrub_parity_job(device_extension* Vcb, chunk* c, void* context, UINT64 stripe_start, UINT64 bit_start, ULONG num_stripes,
+                              scrub_parity_job** pspj);
+void free_scrub_parity_job(scrub_parity_job* spj);
 
 // in balance.c
 NTSTATUS start_balance(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
@@ -1097,6 +1308,10 @@ NTSTATUS resume_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS stop_balance(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS look_for_balance_item(device_extension* Vcb);
 NTSTATUS remove_device(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
+NTSTATUS set_throttle(device_extension* Vcb, void* data, ULONG length, KPROCESSOR_MODE processor_mode);
+NTSTATUS query_throttle(device_extension* Vcb, void* data, ULONG length);
+void throttle_background_io(device_extension* Vcb, UINT64 length, BOOL* stopping);
+void update_foreground_latency(device_extension* Vcb, LARGE_INTEGER time1, LARGE_INTEGER freq);
 
 // in volume.c
 NTSTATUS STDCALL vol_create(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
@@ -1126,9 +1341,11 @@ NTSTATUS pnp_removal(PVOID NotificationStructure, PVOID Context);
 // in scrub.c
 NTSTATUS start_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS query_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length);
+NTSTATUS query_scrub_devices(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length);
 NTSTATUS pause_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS resume_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
 NTSTATUS stop_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode);
+void scrub_parity_stripe(device_extension* Vcb, scrub_parity_job* spj, ULONG num);
 
 #define fast_io_possible(fcb) (!FsRtlAreThereCurrentFileLocks(&fcb->lock) && !fcb->Vcb->readonly ? FastIoIsPossible : FastIoIsQuestionable)
 
@@ -24,6 +24,10 @@
 #define FSCTL_BTRFS_PAUSE_SCRUB CTL_CODE(FILE_DEVICE_UNKNOWN, 0x83b, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_RESUME_SCRUB CTL_CODE(FILE_DEVICE_UNKNOWN, 0x83c, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_STOP_SCRUB CTL_CODE(FILE_DEVICE_UNKNOWN, 0x83d, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x83e, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_SET_THROTTLE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x83f, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_QUERY_THROTTLE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x840, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_QUERY_SCRUB_DEVICES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x841, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 
 typedef struct {
     UINT64 subvol;
@@ -185,6 +189,13 @@ typedef struct {
     };
 } btrfs_scrub_error;
 
+typedef struct {
+    UINT64 dev_id;
+    UINT64 data_scrubbed;
+    UINT64 duration;
+    UINT64 num_reads;
+} btrfs_scrub_device;
+
 typedef struct {
     UINT32 status;
     LARGE_INTEGER start_time;
@@ -198,4 +209,37 @@ typedef struct {
     btrfs_scrub_error errors;
 } btrfs_query_scrub;
 
+typedef struct {
+    UINT32 num_devices;
+    btrfs_scrub_device devices[1];
+} btrfs_query_scrub_devices;
+
+typedef struct {
+    UINT64 rate; // bytes per second of balance and scrub I/O, or 0 for no limit
+    UINT32 latency_target; // in microseconds, or 0 to ignore foreground latency
+    UINT32 foreground_latency; // query only
+} btrfs_throttle;
+
+typedef struct {
+    UINT64 sd_cache_hits;
+    UINT64 sd_cache_misses;
+    UINT64 sd_cache_entries;
+    UINT64 sd_cache_size;
+    UINT64 sd_cache_saved;
+    UINT64 space_cache_written;
+    UINT64 space_cache_skipped;
+    UINT64 space_cache_loaded;
+    UINT64 space_cache_loaded_bg;
+    UINT64 space_cache_load_time;
+    UINT64 balance_data_relocated;
+    UINT64 balance_reloc_time;
+    UINT64 background_bytes;
+    UINT64 throttle_time;
+    UINT64 extent_cache_hits;
+    UINT64 extent_cache_misses;
+    UINT64 extent_cache_invalidations;
+    UINT64 extent_refs_applied;
+    UINT64 extent_refs_collapsed;
+} btrfs_stats;
+
 #endif
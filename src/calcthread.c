@@ -18,6 +18,7 @@
 #include "btrfs_drv.h"
 
 #define SECTOR_BLOCK 16
+#define TREE_BLOCK 8
 
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj) {
     calc_job* cj;
@@ -55,6 +56,131 @@ void free_calc_job(calc_job* cj) {
         ExFreePool(cj);
 }
 
+NTSTATUS add_tree_write_job(device_extension* Vcb, tree** trees, UINT8** data, ULONG num_trees, tree_write_job** ptwj) {
+    tree_write_job* twj;
+    
+    twj = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_write_job), ALLOC_TAG);
+    if (!twj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    twj->trees = trees;
+    twj->data = data;
+    twj->num_trees = num_trees;
+    twj->pos = 0;
+    twj->done = 0;
+    twj->refcount = 1;
+    KeInitializeEvent(&twj->event, NotificationEvent, FALSE);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+    InsertTailList(&Vcb->calcthreads.tree_list, &twj->list_entry);
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    
+    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
+    KeClearEvent(&Vcb->calcthreads.event);
+    
+    *ptwj = twj;
+    
+    return STATUS_SUCCESS;
+}
+
+void free_tree_write_job(tree_write_job* twj) {
+    LONG rc = InterlockedDecrement(&twj->refcount);
+    
+    if (rc == 0)
+        ExFreePool(twj);
+}
+
+static BOOL do_tree_write(device_extension* Vcb, tree_write_job* twj) {
+    LONG pos, done;
+    ULONG blocksize, i;
+    
+    pos = InterlockedIncrement(&twj->pos) - 1;
+    
+    if (pos * TREE_BLOCK >= twj->num_trees)
+        return FALSE;
+    
+    blocksize = min(TREE_BLOCK, twj->num_trees - (pos * TREE_BLOCK));
+    for (i = 0; i < blocksize; i++) {
+        write_tree_node(Vcb, twj->trees[(pos * TREE_BLOCK) + i], twj->data[(pos * TREE_BLOCK) + i]);
+    }
+    
+    done = InterlockedIncrement(&twj->done);
+    
+    if (done * TREE_BLOCK >= twj->num_trees) {
+        ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+        RemoveEntryList(&twj->list_entry);
+        ExReleaseResourceLite(&Vcb->calcthreads.lock);
+        
+        KeSetEvent(&twj->event, 0, FALSE);
+    }
+    
+    return TRUE;
+}
+
+NTSTATUS add_scrub_parity_job(device_extension* Vcb, chunk* c, void* context, UINT64 stripe_start, UINT64 bit_start, ULONG num_stripes,
+                              scrub_parity_job** pspj) {
+    scrub_parity_job* spj;
+    
+    spj = ExAllocatePoolWithTag(NonPagedPool, sizeof(scrub_parity_job), ALLOC_TAG);
+    if (!spj) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    spj->c = c;
+    spj->context = context;
+    spj->stripe_start = stripe_start;
+    spj->bit_start = bit_start;
+    spj->num_stripes = num_stripes;
+    spj->pos = 0;
+    spj->done = 0;
+    spj->refcount = 1;
+    KeInitializeEvent(&spj->event, NotificationEvent, FALSE);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+    InsertTailList(&Vcb->calcthreads.scrub_list, &spj->list_entry);
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    
+    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
+    KeClearEvent(&Vcb->calcthreads.event);
+    
+    *pspj = spj;
+    
+    return STATUS_SUCCESS;
+}
+
+void free_scrub_parity_job(scrub_parity_job* spj) {
+    LONG rc = InterlockedDecrement(&spj->refcount);
+    
+    if (rc == 0)
+        ExFreePool(spj);
+}
+
+static BOOL do_scrub_parity(device_extension* Vcb, scrub_parity_job* spj) {
+    LONG pos, done;
+    
+    pos = InterlockedIncrement(&spj->pos) - 1;
+    
+    if ((ULONG)pos >= spj->num_stripes)
+        return FALSE;
+    
+    scrub_parity_stripe(Vcb, spj, pos);
+    
+    done = InterlockedIncrement(&spj->done);
+    
+    if ((ULONG)done >= spj->num_stripes) {
+        ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+        RemoveEntryList(&spj->list_entry);
+        ExReleaseResourceLite(&Vcb->calcthreads.lock);
+        
+        KeSetEvent(&spj->event, 0, FALSE);
+    }
+    
+    return TRUE;
+}
+
 static BOOL do_calc(device_extension* Vcb, calc_job* cj) {
     LONG pos, done;
     UINT32* csum;
@@ -106,6 +232,47 @@ void calc_thread(void* context) {
             
             ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
             
+            if (!IsListEmpty(&Vcb->calcthreads.flush_list)) {
+                flush_fcb_job* ffj = CONTAINING_RECORD(RemoveHeadList(&Vcb->calcthreads.flush_list), flush_fcb_job, list_entry);
+                
+                ExReleaseResourceLite(&Vcb->calcthreads.lock);
+                
+                do_flush_fcb_job(ffj);
+                continue;
+            }
+            
+            if (!IsListEmpty(&Vcb->calcthreads.tree_list)) {
+                tree_write_job* twj = CONTAINING_RECORD(Vcb->calcthreads.tree_list.Flink, tree_write_job, list_entry);
+                twj->refcount++;
+                
+                ExReleaseResourceLite(&Vcb->calcthreads.lock);
+                
+                b = do_tree_write(Vcb, twj);
+                
+                free_tree_write_job(twj);
+                
+                if (!b)
+                    break;
+                
+                continue;
+            }
+            
+            if (!IsListEmpty(&Vcb->calcthreads.scrub_list)) {
+                scrub_parity_job* spj = CONTAINING_RECORD(Vcb->calcthreads.scrub_list.Flink, scrub_parity_job, list_entry);
+                spj->refcount++;
+                
+                ExReleaseResourceLite(&Vcb->calcthreads.lock);
+                
+                b = do_scrub_parity(Vcb, spj);
+                
+                free_scrub_parity_job(spj);
+                
+                if (!b)
+                    break;
+                
+                continue;
+            }
+            
             if (IsListEmpty(&Vcb->calcthreads.job_list)) {
                 ExReleaseResourceLite(&Vcb->calcthreads.lock);
                 break;
@@ -363,6 +363,7 @@ static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
     chunk* c;
     z_stream c_stream;
     int ret;
+    BOOL skip_unloaded;
     
     comp_data = ExAllocatePoolWithTag(PagedPool, end_data - start_data, ALLOC_TAG);
     if (!comp_data) {
@@ -434,13 +435,22 @@ static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
         *compressed = TRUE;
     }
     
+    if (insert_extent_cluster(fcb->Vcb, fcb, start_data, comp_length, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
+        if (compression != BTRFS_COMPRESSION_NONE)
+            ExFreePool(comp_data);
+        
+        return STATUS_SUCCESS;
+    }
+    
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
     
+    skip_unloaded = fcb->Vcb->space_thread_running;
+    
     le = fcb->Vcb->chunks.Flink;
     while (le != &fcb->Vcb->chunks) {
         c = CONTAINING_RECORD(le, chunk, list_entry);
         
-        if (!c->readonly && !c->reloc) {
+        if (!c->readonly && !c->reloc && (c->cache_loaded || !skip_unloaded)) {
             ExAcquireResourceExclusiveLite(&c->lock, TRUE);
             
             if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
@@ -458,6 +468,11 @@ static NTSTATUS zlib_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 en
         }
 
         le = le->Flink;
+        
+        if (le == &fcb->Vcb->chunks && skip_unloaded) {
+            skip_unloaded = FALSE;
+            le = fcb->Vcb->chunks.Flink;
+        }
     }
     
     ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
@@ -734,7 +749,7 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
     UINT64 comp_length;
     ULONG comp_data_len, num_pages, i;
     UINT8* comp_data;
-    BOOL skip_compression = FALSE;
+    BOOL skip_compression = FALSE, skip_unloaded;
     lzo_stream stream;
     UINT32* out_size;
     LIST_ENTRY* le;
@@ -819,13 +834,22 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         *compressed = TRUE;
     }
     
+    if (insert_extent_cluster(fcb->Vcb, fcb, start_data, comp_length, comp_data, Irp, rollback, compression, end_data - start_data, FALSE, 0)) {
+        if (compression != BTRFS_COMPRESSION_NONE)
+            ExFreePool(comp_data);
+        
+        return STATUS_SUCCESS;
+    }
+    
     ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
     
+    skip_unloaded = fcb->Vcb->space_thread_running;
+    
     le = fcb->Vcb->chunks.Flink;
     while (le != &fcb->Vcb->chunks) {
         c = CONTAINING_RECORD(le, chunk, list_entry);
         
-        if (!c->readonly && !c->reloc) {
+        if (!c->readonly && !c->reloc && (c->cache_loaded || !skip_unloaded)) {
             ExAcquireResourceExclusiveLite(&c->lock, TRUE);
             
             if (c->chunk_item->type == fcb->Vcb->data_flags && (c->chunk_item->size - c->used) >= comp_length) {
@@ -843,6 +867,11 @@ static NTSTATUS lzo_write_compressed_bit(fcb* fcb, UINT64 start_data, UINT64 end
         }
 
         le = le->Flink;
+        
+        if (le == &fcb->Vcb->chunks && skip_unloaded) {
+            skip_unloaded = FALSE;
+            le = fcb->Vcb->chunks.Flink;
+        }
     }
     
     ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
@@ -63,10 +63,12 @@ fcb* create_fcb(POOL_TYPE pool_type) {
     fcb->Header.Resource = &fcb->nonpaged->resource;
     
     ExInitializeResourceLite(&fcb->nonpaged->dir_children_lock);
+    ExInitializeResourceLite(&fcb->nonpaged->delalloc_lock);
     
     FsRtlInitializeFileLock(&fcb->lock, NULL, NULL);
     
     InitializeListHead(&fcb->extents);
+    InitializeListHead(&fcb->delalloc);
     InitializeListHead(&fcb->hardlinks);
     
     InitializeListHead(&fcb->dir_children_index);
@@ -809,6 +811,106 @@ cont:
     return STATUS_SUCCESS;
 }
 
+// Dispatches an XATTR_ITEM met while walking an inode's items to the relevant fcb field, so that
+// open_fcb and the mount code don't have to look each xattr up separately.
+void fcb_load_xattr(fcb* fcb, tree_data* item, BOOL* atts_set, BOOL* sd_set) {
+    if (item->size < sizeof(DIR_ITEM)) {
+        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", item->key.obj_id, item->key.obj_type, item->key.offset, item->size, sizeof(DIR_ITEM));
+        return;
+    }
+    
+    if (item->key.offset == EA_REPARSE_HASH) {
+        UINT8* xattrdata;
+        UINT16 xattrlen;
+        
+        if (extract_xattr(item->data, item->size, EA_REPARSE, &xattrdata, &xattrlen)) {
+            fcb->reparse_xattr.Buffer = (char*)xattrdata;
+            fcb->reparse_xattr.Length = fcb->reparse_xattr.MaximumLength = xattrlen;
+        }
+    } else if (item->key.offset == EA_EA_HASH) {
+        UINT8* eadata;
+        UINT16 ealen;
+        
+        if (extract_xattr(item->data, item->size, EA_EA, &eadata, &ealen)) {
+            NTSTATUS Status;
+            ULONG offset;
+            
+            Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, ealen, &offset);
+            
+            if (!NT_SUCCESS(Status)) {
+                WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+                ExFreePool(eadata);
+            } else {
+                FILE_FULL_EA_INFORMATION* eainfo;
+                fcb->ea_xattr.Buffer = (char*)eadata;
+                fcb->ea_xattr.Length = fcb->ea_xattr.MaximumLength = ealen;
+                
+                fcb->ealen = 4;
+                
+                // calculate ealen
+                eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
+                do {
+                    fcb->ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+                    
+                    if (eainfo->NextEntryOffset == 0)
+                        break;
+                    
+                    eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
+                } while (TRUE);
+            }
+        }
+    } else if (item->key.offset == EA_DOSATTRIB_HASH) {
+        UINT8* xattrdata;
+        UINT16 xattrlen;
+        
+        if (extract_xattr(item->data, item->size, EA_DOSATTRIB, &xattrdata, &xattrlen)) {
+            if (get_file_attributes_from_xattr((char*)xattrdata, xattrlen, &fcb->atts)) {
+                *atts_set = TRUE;
+                
+                if (fcb->type == BTRFS_TYPE_DIRECTORY)
+                    fcb->atts |= FILE_ATTRIBUTE_DIRECTORY;
+                else if (fcb->type == BTRFS_TYPE_SYMLINK)
+                    fcb->atts |= FILE_ATTRIBUTE_REPARSE_POINT;
+                
+                if (fcb->inode == SUBVOL_ROOT_INODE) {
+                    if (fcb->subvol->root_item.flags & BTRFS_SUBVOL_READONLY)
+                        fcb->atts |= FILE_ATTRIBUTE_READONLY;
+                    else
+                        fcb->atts &= ~FILE_ATTRIBUTE_READONLY;
+                }
+            }
+            
+            ExFreePool(xattrdata);
+        }
+    } else if (item->key.offset == EA_NTACL_HASH) {
+        UINT16 buflen;
+        
+        if (extract_xattr(item->data, item->size, EA_NTACL, (UINT8**)&fcb->sd, &buflen)) {
+            if (get_sd_from_xattr(fcb, buflen)) {
+                *sd_set = TRUE;
+            } else
+                ExFreePool(fcb->sd);
+        }
+    } else if (item->key.offset == EA_PROP_COMPRESSION_HASH) {
+        UINT8* propdata;
+        UINT16 proplen;
+        
+        if (extract_xattr(item->data, item->size, EA_PROP_COMPRESSION, &propdata, &proplen)) {
+            const char lzo[] = "lzo";
+            const char zlib[] = "zlib";
+            
+            if (proplen == strlen(lzo) && RtlCompareMemory(propdata, lzo, strlen(lzo)) == strlen(lzo))
+                fcb->prop_compression = PropCompression_LZO;
+            else if (proplen == strlen(zlib) && RtlCompareMemory(propdata, zlib, strlen(zlib)) == strlen(zlib))
+                fcb->prop_compression = PropCompression_Zlib;
+            else
+                fcb->prop_compression = PropCompression_None;
+            
+            ExFreePool(propdata);
+        }
+    }
+}
+
 NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type, PANSI_STRING utf8, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
@@ -1037,93 +1139,7 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
                 ier = (INODE_EXTREF*)&ier->name[ier->n];
             }
         } else if (tp.item->key.obj_type == TYPE_XATTR_ITEM) {
-            if (tp.item->size < sizeof(DIR_ITEM)) {
-                ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(DIR_ITEM));
-                continue;
-            }
-            
-            if (tp.item->key.offset == EA_REPARSE_HASH) {
-                UINT8* xattrdata;
-                UINT16 xattrlen;
-                
-                if (extract_xattr(tp.item->data, tp.item->size, EA_REPARSE, &xattrdata, &xattrlen)) {
-                    fcb->reparse_xattr.Buffer = (char*)xattrdata;
-                    fcb->reparse_xattr.Length = fcb->reparse_xattr.MaximumLength = xattrlen;
-                }
-            } else if (tp.item->key.offset == EA_EA_HASH) {
-                UINT8* eadata;
-                UINT16 ealen;
-                
-                if (extract_xattr(tp.item->data, tp.item->size, EA_EA, &eadata, &ealen)) {
-                    ULONG offset;
-                    
-                    Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, ealen, &offset);
-                    
-                    if (!NT_SUCCESS(Status)) {
-                        WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
-                        ExFreePool(eadata);
-                    } else {
-                        FILE_FULL_EA_INFORMATION* eainfo;
-                        fcb->ea_xattr.Buffer = (char*)eadata;
-                        fcb->ea_xattr.Length = fcb->ea_xattr.MaximumLength = ealen;
-                        
-                        fcb->ealen = 4;
-                        
-                        // calculate ealen
-                        eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
-                        do {
-                            fcb->ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
-                            
-                            if (eainfo->NextEntryOffset == 0)
-                                break;
-                            
-                            eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
-                        } while (TRUE);
-                    }
-                }
-            } else if (tp.item->key.offset == EA_DOSATTRIB_HASH) {
-                UINT8* xattrdata;
-                UINT16 xattrlen;
-                
-                if (extract_xattr(tp.item->data, tp.item->size, EA_DOSATTRIB, &xattrdata, &xattrlen)) {
-                    if (get_file_attributes_from_xattr((char*)xattrdata, xattrlen, &fcb->atts)) {
-                        atts_set = TRUE;
-                        
-                        if (fcb->type == BTRFS_TYPE_DIRECTORY)
-                            fcb->atts |= FILE_ATTRIBUTE_DIRECTORY;
-                        else if (fcb->type == BTRFS_TYPE_SYMLINK)
-                            fcb->atts |= FILE_ATTRIBUTE_REPARSE_POINT;
-                    }
-                    
-                    ExFreePool(xattrdata);
-                }
-            } else if (tp.item->key.offset == EA_NTACL_HASH) {
-                UINT16 buflen;
-                
-                if (extract_xattr(tp.item->data, tp.item->size, EA_NTACL, (UINT8**)&fcb->sd, &buflen)) {
-                    if (get_sd_from_xattr(fcb, buflen)) {
-                        sd_set = TRUE;
-                    } else
-                        ExFreePool(fcb->sd);
-                }
-            } else if (tp.item->key.offset == EA_PROP_COMPRESSION_HASH) {
-                UINT8* propdata;
-                UINT16 proplen;
-                
-                if (extract_xattr(tp.item->data, tp.item->size, EA_PROP_COMPRESSION, &propdata, &proplen)) {
-                    const char lzo[] = "lzo";
-                    const char zlib[] = "zlib";
-                    
-                    if (proplen == strlen(lzo) && RtlCompareMemory(propdata, lzo, strlen(lzo)) == strlen(lzo))
-                        fcb->prop_compression = PropCompression_LZO;
-                    else if (proplen == strlen(zlib) && RtlCompareMemory(propdata, zlib, strlen(zlib)) == strlen(zlib))
-                        fcb->prop_compression = PropCompression_Zlib;
-                    else
-                        fcb->prop_compression = PropCompression_None;
-                    
-                    ExFreePool(propdata);
-                }
-            }
+            fcb_load_xattr(fcb, tp.item, &atts_set, &sd_set);
         } else if (tp.item->key.obj_type == TYPE_EXTENT_DATA) {
             extent* ext;
             BOOL unique = FALSE;
@@ -1204,6 +1220,8 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
     if (!sd_set)
         fcb_get_sd(fcb, parent, FALSE, Irp);
     
+    fcb_share_sd(fcb);
+    
     if (fcb->type == BTRFS_TYPE_DIRECTORY && fcb->atts & FILE_ATTRIBUTE_REPARSE_POINT && fcb->reparse_xattr.Length == 0) {
         fcb->atts &= ~FILE_ATTRIBUTE_REPARSE_POINT;
         
@@ -1271,12 +1289,6 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
         return STATUS_INSUFFICIENT_RESOURCES;
     }
       
-    if (!get_xattr(Vcb, parent->subvol, parent->inode, xattr->Buffer, streamhash, &xattrdata, &xattrlen, Irp)) {
-        ERR("get_xattr failed\n");
-        free_fcb(fcb);
-        return STATUS_INTERNAL_ERROR;
-    }
-
     fcb->Vcb = Vcb;
     
     fcb->subvol = parent->subvol;
@@ -1286,7 +1298,7 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
     fcb->adshash = streamhash;
     fcb->adsxattr = *xattr;
     
-    // find XATTR_ITEM overhead and hence calculate maximum length
+    // load the data and find the XATTR_ITEM overhead, and hence the maximum length, in one lookup
     
     searchkey.obj_id = parent->inode;
     searchkey.obj_type = TYPE_XATTR_ITEM;
@@ -1305,8 +1317,14 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
         return STATUS_INTERNAL_ERROR;
     }
     
-    if (tp.item->size < xattrlen) {
-        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, xattrlen);
+    if (tp.item->size < sizeof(DIR_ITEM)) {
+        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(DIR_ITEM));
+        free_fcb(fcb);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    if (!extract_xattr(tp.item->data, tp.item->size, xattr->Buffer, &xattrdata, &xattrlen)) {
+        ERR("extract_xattr failed\n");
         free_fcb(fcb);
         return STATUS_INTERNAL_ERROR;
     }
@@ -116,6 +116,148 @@ static UINT64 get_extent_hash(UINT8 type, void* data) {
     }
 }
 
+// The decoded contents of EXTENT_ITEMs get looked up over and over again while
+// deciding whether to COW - each lookup would otherwise be a find_item on the
+// extent root. Anything that changes an EXTENT_ITEM in place has to call
+// invalidate_extent_cache; do_write throws the whole lot away after each commit.
+void init_extent_cache(device_extension* Vcb) {
+    ULONG i;
+    
+    for (i = 0; i < EXTENT_CACHE_BUCKETS; i++) {
+        InitializeListHead(&Vcb->extent_cache[i]);
+    }
+    
+    Vcb->extent_cache_entries = 0;
+    
+    ExInitializeResourceLite(&Vcb->extent_cache_lock);
+}
+
+static __inline LIST_ENTRY* get_extent_cache_bucket(device_extension* Vcb, UINT64 address) {
+    return &Vcb->extent_cache[(address / Vcb->superblock.sector_size) % EXTENT_CACHE_BUCKETS];
+}
+
+static extent_cache_entry* find_cached_extent(device_extension* Vcb, UINT64 address) {
+    LIST_ENTRY *bucket, *le;
+    
+    bucket = get_extent_cache_bucket(Vcb, address);
+    
+    le = bucket->Flink;
+    while (le != bucket) {
+        extent_cache_entry* ece = CONTAINING_RECORD(le, extent_cache_entry, list_entry);
+        
+        if (ece->address == address)
+            return ece;
+        
+        le = le->Flink;
+    }
+    
+    return NULL;
+}
+
+static BOOL get_cached_extent(device_extension* Vcb, UINT64 address, UINT64 size, extent_cache_entry* ece) {
+    extent_cache_entry* ece2;
+    BOOL found = FALSE;
+    
+    ExAcquireResourceSharedLite(&Vcb->extent_cache_lock, TRUE);
+    
+    ece2 = find_cached_extent(Vcb, address);
+    
+    // size is 0 for skinny metadata items, where we don't check it
+    if (ece2 && (ece2->size == 0 || size == 0 || ece2->size == size)) {
+        RtlCopyMemory(ece, ece2, sizeof(extent_cache_entry));
+        found = TRUE;
+    }
+    
+    ExReleaseResourceLite(&Vcb->extent_cache_lock);
+    
+    return found;
+}
+
+static void cache_extent(device_extension* Vcb, UINT64 address, UINT64 size, UINT64 refcount, UINT64 flags) {
+    extent_cache_entry* ece;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->extent_cache_lock, TRUE);
+    
+    ece = find_cached_extent(Vcb, address);
+    
+    if (!ece) {
+        if (Vcb->extent_cache_entries >= EXTENT_CACHE_MAX_ENTRIES)
+            goto end;
+        
+        ece = ExAllocatePoolWithTag(PagedPool, sizeof(extent_cache_entry), ALLOC_TAG);
+        if (!ece) {
+            ERR("out of memory\n");
+            goto end;
+        }
+        
+        ece->address = address;
+        
+        InsertTailList(get_extent_cache_bucket(Vcb, address), &ece->list_entry);
+        Vcb->extent_cache_entries++;
+    }
+    
+    ece->size = size;
+    ece->refcount = refcount;
+    ece->flags = flags;
+    ece->unique_known = FALSE;
+    ece->unique = FALSE;
+    
+end:
+    ExReleaseResourceLite(&Vcb->extent_cache_lock);
+}
+
+static void cache_extent_unique(device_extension* Vcb, UINT64 address, UINT64 size, BOOL unique) {
+    extent_cache_entry* ece;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->extent_cache_lock, TRUE);
+    
+    ece = find_cached_extent(Vcb, address);
+    
+    if (ece && (ece->size == 0 || ece->size == size)) {
+        ece->unique_known = TRUE;
+        ece->unique = unique;
+    }
+    
+    ExReleaseResourceLite(&Vcb->extent_cache_lock);
+}
+
+void invalidate_extent_cache(device_extension* Vcb, UINT64 address) {
+    extent_cache_entry* ece;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->extent_cache_lock, TRUE);
+    
+    ece = find_cached_extent(Vcb, address);
+    
+    if (ece) {
+        RemoveEntryList(&ece->list_entry);
+        Vcb->extent_cache_entries--;
+        ExFreePool(ece);
+        
+        Vcb->counters.extent_cache_invalidations++;
+    }
+    
+    ExReleaseResourceLite(&Vcb->extent_cache_lock);
+}
+
+void clear_extent_cache(device_extension* Vcb) {
+    ULONG i;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->extent_cache_lock, TRUE);
+    
+    for (i = 0; i < EXTENT_CACHE_BUCKETS; i++) {
+        while (!IsListEmpty(&Vcb->extent_cache[i])) {
+            LIST_ENTRY* le = RemoveHeadList(&Vcb->extent_cache[i]);
+            extent_cache_entry* ece = CONTAINING_RECORD(le, extent_cache_entry, list_entry);
+            
+            ExFreePool(ece);
+        }
+    }
+    
+    Vcb->extent_cache_entries = 0;
+    
+    ExReleaseResourceLite(&Vcb->extent_cache_lock);
+}
+
 static void free_extent_refs(LIST_ENTRY* extent_refs) {
     while (!IsListEmpty(extent_refs)) {
         LIST_ENTRY* le = RemoveHeadList(extent_refs);
@@ -467,6 +609,8 @@ NTSTATUS increase_extent_refcount(device_extension* Vcb, UINT64 address, UINT64
         return STATUS_INTERNAL_ERROR;
     }
     
+    invalidate_extent_cache(Vcb, address);
+    
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -869,6 +1013,8 @@ NTSTATUS decrease_extent_refcount(device_extension* Vcb, UINT64 address, UINT64
     ULONG datalen = get_extent_data_len(type);
     BOOL is_tree = (type == TYPE_TREE_BLOCK_REF || type == TYPE_SHARED_BLOCK_REF), skinny = FALSE;
     
+    invalidate_extent_cache(Vcb, address);
+    
     if (is_tree && Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA) {
         searchkey.obj_id = address;
         searchkey.obj_type = TYPE_METADATA_ITEM;
@@ -1663,6 +1809,14 @@ UINT64 get_extent_refcount(device_extension* Vcb, UINT64 address, UINT64 size, P
     traverse_ptr tp;
     NTSTATUS Status;
     EXTENT_ITEM* ei;
+    extent_cache_entry ece;
+    
+    if (get_cached_extent(Vcb, address, size, &ece)) {
+        InterlockedIncrement64(&Vcb->counters.extent_cache_hits);
+        return ece.refcount;
+    }
+    
+    InterlockedIncrement64(&Vcb->counters.extent_cache_misses);
     
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
@@ -1678,6 +1832,8 @@ UINT64 get_extent_refcount(device_extension* Vcb, UINT64 address, UINT64 size, P
         tp.item->key.obj_type == TYPE_METADATA_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
         ei = (EXTENT_ITEM*)tp.item->data;
     
+        cache_extent(Vcb, address, 0, ei->refcount, ei->flags);
+    
         return ei->refcount;
     }
     
@@ -1692,6 +1848,8 @@ UINT64 get_extent_refcount(device_extension* Vcb, UINT64 address, UINT64 size, P
     if (tp.item->size == sizeof(EXTENT_ITEM_V0)) {
         EXTENT_ITEM_V0* eiv0 = (EXTENT_ITEM_V0*)tp.item->data;
         
+        cache_extent(Vcb, address, size, eiv0->refcount, 0);
+        
         return eiv0->refcount;
     } else if (tp.item->size < sizeof(EXTENT_ITEM)) {
         ERR("(%llx,%x,%llx) was %x bytes, expected at least %x\n", tp.item->key.obj_id, tp.item->key.obj_type,
@@ -1701,10 +1859,12 @@ UINT64 get_extent_refcount(device_extension* Vcb, UINT64 address, UINT64 size, P
     
     ei = (EXTENT_ITEM*)tp.item->data;
     
+    cache_extent(Vcb, address, size, ei->refcount, ei->flags);
+    
     return ei->refcount;
 }
 
-BOOL is_extent_unique(device_extension* Vcb, UINT64 address, UINT64 size, PIRP Irp) {
+static BOOL is_extent_unique2(device_extension* Vcb, UINT64 address, UINT64 size, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
@@ -1840,11 +2000,36 @@ BOOL is_extent_unique(device_extension* Vcb, UINT64 address, UINT64 size, PIRP I
     return FALSE;
 }
 
+BOOL is_extent_unique(device_extension* Vcb, UINT64 address, UINT64 size, PIRP Irp) {
+    extent_cache_entry ece;
+    BOOL unique;
+    
+    if (get_cached_extent(Vcb, address, size, &ece) && ece.unique_known) {
+        InterlockedIncrement64(&Vcb->counters.extent_cache_hits);
+        return ece.unique;
+    }
+    
+    unique = is_extent_unique2(Vcb, address, size, Irp);
+    
+    // get_extent_refcount will have added an entry if the extent exists
+    cache_extent_unique(Vcb, address, size, unique);
+    
+    return unique;
+}
+
 UINT64 get_extent_flags(device_extension* Vcb, UINT64 address, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp;
     NTSTATUS Status;
     EXTENT_ITEM* ei;
+    extent_cache_entry ece;
+    
+    if (get_cached_extent(Vcb, address, 0, &ece)) {
+        InterlockedIncrement64(&Vcb->counters.extent_cache_hits);
+        return ece.flags;
+    }
+    
+    InterlockedIncrement64(&Vcb->counters.extent_cache_misses);
     
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
@@ -1860,6 +2045,8 @@ UINT64 get_extent_flags(device_extension* Vcb, UINT64 address, PIRP Irp) {
         tp.item->key.obj_type == TYPE_METADATA_ITEM && tp.item->size >= sizeof(EXTENT_ITEM)) {
         ei = (EXTENT_ITEM*)tp.item->data;
     
+        cache_extent(Vcb, address, 0, ei->refcount, ei->flags);
+    
         return ei->flags;
     }
     
@@ -1868,9 +2055,13 @@ UINT64 get_extent_flags(device_extension* Vcb, UINT64 address, PIRP Irp) {
         return 0;
     }
     
-    if (tp.item->size == sizeof(EXTENT_ITEM_V0))
+    if (tp.item->size == sizeof(EXTENT_ITEM_V0)) {
+        EXTENT_ITEM_V0* eiv0 = (EXTENT_ITEM_V0*)tp.item->data;
+        
+        cache_extent(Vcb, address, tp.item->key.offset, eiv0->refcount, 0);
+        
         return 0;
-    else if (tp.item->size < sizeof(EXTENT_ITEM)) {
+    } else if (tp.item->size < sizeof(EXTENT_ITEM)) {
         ERR("(%llx,%x,%llx) was %x bytes, expected at least %x\n", tp.item->key.obj_id, tp.item->key.obj_type,
                                                                    tp.item->key.offset, tp.item->size, sizeof(EXTENT_DATA));
         return 0;
@@ -1878,6 +2069,8 @@ UINT64 get_extent_flags(device_extension* Vcb, UINT64 address, PIRP Irp) {
     
     ei = (EXTENT_ITEM*)tp.item->data;
     
+    cache_extent(Vcb, address, tp.item->key.offset, ei->refcount, ei->flags);
+    
     return ei->flags;
 }
 
@@ -1887,6 +2080,8 @@ void update_extent_flags(device_extension* Vcb, UINT64 address, UINT64 flags, PI
     NTSTATUS Status;
     EXTENT_ITEM* ei;
     
+    invalidate_extent_cache(Vcb, address);
+    
     searchkey.obj_id = address;
     searchkey.obj_type = Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA ? TYPE_METADATA_ITEM : TYPE_EXTENT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -1921,6 +2116,26 @@ void update_extent_flags(device_extension* Vcb, UINT64 address, UINT64 flags, PI
     ei->flags = flags;
 }
 
+// changed_extents is kept sorted by address, so that update_chunk_usage
+// applies the collapsed refcount changes to the extent tree in order.
+void insert_changed_extent(chunk* c, changed_extent* ce) {
+    LIST_ENTRY* le;
+    
+    le = c->changed_extents.Blink;
+    while (le != &c->changed_extents) {
+        changed_extent* ce2 = CONTAINING_RECORD(le, changed_extent, list_entry);
+        
+        if (ce2->address <= ce->address) {
+            InsertHeadList(le, &ce->list_entry);
+            return;
+        }
+        
+        le = le->Blink;
+    }
+    
+    InsertHeadList(&c->changed_extents, &ce->list_entry);
+}
+
 static changed_extent* get_changed_extent_item(chunk* c, UINT64 address, UINT64 size, BOOL no_csum) {
     LIST_ENTRY* le;
     changed_extent* ce;
@@ -1931,6 +2146,8 @@ static changed_extent* get_changed_extent_item(chunk* c, UINT64 address, UINT64
         
         if (ce->address == address && ce->size == size)
             return ce;
+        else if (ce->address > address)
+            break;
         
         le = le->Flink;
     }
@@ -1951,7 +2168,7 @@ static changed_extent* get_changed_extent_item(chunk* c, UINT64 address, UINT64
     InitializeListHead(&ce->refs);
     InitializeListHead(&ce->old_refs);
     
-    InsertTailList(&c->changed_extents, &ce->list_entry);
+    insert_changed_extent(c, ce);
     
     return ce;
 }
@@ -1962,8 +2179,6 @@ NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, UINT64 addre
     changed_extent* ce;
     changed_extent_ref* cer;
     NTSTATUS Status;
-    KEY searchkey;
-    traverse_ptr tp;
     UINT64 old_count;
     
     ExAcquireResourceExclusiveLite(&c->changed_extents_lock, TRUE);
@@ -1977,38 +2192,11 @@ NTSTATUS update_changed_extent_ref(device_extension* Vcb, chunk* c, UINT64 addre
     }
     
     if (IsListEmpty(&ce->refs) && IsListEmpty(&ce->old_refs)) { // new entry
-        searchkey.obj_id = address;
-        searchkey.obj_type = TYPE_EXTENT_ITEM;
-        searchkey.offset = 0xffffffffffffffff;
+        // usually served from the extent cache rather than the tree itself
+        ce->count = ce->old_count = get_extent_refcount(Vcb, address, size, Irp);
         
-        Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("error - find_item returned %08x\n", Status);
-            goto end;
-        }
-        
-        if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-            ERR("could not find address %llx in extent tree\n", address);
-            Status = STATUS_INTERNAL_ERROR;
-            goto end;
-        }
-        
-        if (tp.item->key.offset != size) {
-            ERR("extent %llx had size %llx, not %llx as expected\n", address, tp.item->key.offset, size);
-            Status = STATUS_INTERNAL_ERROR;
-            goto end;
-        }
-        
-        if (tp.item->size == sizeof(EXTENT_ITEM_V0)) {
-            EXTENT_ITEM_V0* eiv0 = (EXTENT_ITEM_V0*)tp.item->data;
-            
-            ce->count = ce->old_count = eiv0->refcount;
-        } else if (tp.item->size >= sizeof(EXTENT_ITEM)) {
-            EXTENT_ITEM* ei = (EXTENT_ITEM*)tp.item->data;
-            
-            ce->count = ce->old_count = ei->refcount;
-        } else {
-            ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM));
+        if (ce->count == 0) {
+            ERR("could not find extent %llx in extent tree\n", address);
             Status = STATUS_INTERNAL_ERROR;
             goto end;
         }
@@ -165,6 +165,9 @@ static BOOLEAN STDCALL fast_io_check_if_possible(PFILE_OBJECT FileObject, PLARGE
     
     TRACE("(%p, %llx, %x, %x, %x, %x, %p, %p)\n", FileObject, FileOffset->QuadPart, Length, Wait, LockKey, CheckForReadOperation, IoStatus, DeviceObject);
     
+    if (!fcb || fcb->type == BTRFS_TYPE_DIRECTORY)
+        return FALSE;
+    
     len2.QuadPart = Length;
     
     if (CheckForReadOperation) {
@@ -251,17 +254,33 @@ static BOOLEAN STDCALL fast_io_mdl_write_complete_compressed(PFILE_OBJECT FileOb
 }
 
 static NTSTATUS STDCALL fast_io_release_for_mod_write(PFILE_OBJECT FileObject, struct _ERESOURCE *ResourceToRelease, PDEVICE_OBJECT DeviceObject){
-    TRACE("STUB: fast_io_release_for_mod_write\n");
-    return STATUS_NOT_IMPLEMENTED;
+    TRACE("(%p, %p, %p)\n", FileObject, ResourceToRelease, DeviceObject);
+    
+    // acquired shared by fast_io_acquire_for_mod_write
+    ExReleaseResourceLite(ResourceToRelease);
+    
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS STDCALL fast_io_acquire_for_ccflush(PFILE_OBJECT FileObject, PDEVICE_OBJECT DeviceObject){
-    TRACE("STUB: fast_io_acquire_for_ccflush\n");
+    fcb* fcb = FileObject->FsContext;
+    
+    TRACE("(%p, %p)\n", FileObject, DeviceObject);
+    
+    if (fcb && fcb->Header.PagingIoResource)
+        ExAcquireResourceSharedLite(fcb->Header.PagingIoResource, TRUE);
+    
     return STATUS_SUCCESS;
 }
 
 static NTSTATUS STDCALL fast_io_release_for_ccflush(PFILE_OBJECT FileObject, PDEVICE_OBJECT DeviceObject){
-    TRACE("STUB: fast_io_release_for_ccflush\n");
+    fcb* fcb = FileObject->FsContext;
+    
+    TRACE("(%p, %p)\n", FileObject, DeviceObject);
+    
+    if (fcb && fcb->Header.PagingIoResource)
+        ExReleaseResourceLite(fcb->Header.PagingIoResource);
+    
     return STATUS_SUCCESS;
 }
 
@@ -280,7 +299,6 @@ static BOOLEAN STDCALL fast_io_write(PFILE_OBJECT FileObject, PLARGE_INTEGER Fil
     return FALSE;
 }
 
-#ifdef _DEBUG
 static BOOLEAN STDCALL fast_io_read(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, BOOLEAN Wait, ULONG LockKey, PVOID Buffer, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
     TRACE("(%p, %p, %x, %x, %x, %p, %p, %p)\n", FileObject, FileOffset, Length, Wait, LockKey, Buffer, IoStatus, DeviceObject);
 
@@ -302,7 +320,15 @@ static BOOLEAN STDCALL fast_io_mdl_read_complete(PFILE_OBJECT FileObject, PMDL M
 static BOOLEAN STDCALL fast_io_prepare_mdl_write(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, ULONG Length, ULONG LockKey, PMDL* MdlChain, PIO_STATUS_BLOCK IoStatus, PDEVICE_OBJECT DeviceObject) {
     TRACE("(%p, %p, %x, %x, %p, %p, %p)\n", FileObject, FileOffset, Length, LockKey, MdlChain, IoStatus, DeviceObject);
 
-    return FsRtlPrepareMdlWriteDev(FileObject, FileOffset, Length, LockKey, MdlChain, IoStatus, DeviceObject);
+    if (FsRtlPrepareMdlWriteDev(FileObject, FileOffset, Length, LockKey, MdlChain, IoStatus, DeviceObject)) {
+        fcb* fcb = FileObject->FsContext;
+        
+        fcb->inode_item.st_size = fcb->Header.FileSize.QuadPart;
+        
+        return TRUE;
+    }
+    
+    return FALSE;
 }
 
 static BOOLEAN STDCALL fast_io_mdl_write_complete(PFILE_OBJECT FileObject, PLARGE_INTEGER FileOffset, PMDL MdlChain, PDEVICE_OBJECT DeviceObject) {
@@ -310,7 +336,6 @@ static BOOLEAN STDCALL fast_io_mdl_write_complete(PFILE_OBJECT FileObject, PLARG
 
     return FsRtlMdlWriteCompleteDev(FileObject, FileOffset, MdlChain, DeviceObject);
 }
-#endif
 
 void __stdcall init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     RtlZeroMemory(&FastIoDispatch, sizeof(FastIoDispatch));
@@ -339,20 +364,11 @@ void __stdcall init_fast_io_dispatch(FAST_IO_DISPATCH** fiod) {
     FastIoDispatch.AcquireForCcFlush = fast_io_acquire_for_ccflush;
     FastIoDispatch.ReleaseForCcFlush = fast_io_release_for_ccflush;
     FastIoDispatch.FastIoWrite = fast_io_write;
-    
-#ifdef _DEBUG
     FastIoDispatch.FastIoRead = fast_io_read;
     FastIoDispatch.MdlRead = fast_io_mdl_read;
     FastIoDispatch.MdlReadComplete = fast_io_mdl_read_complete;
     FastIoDispatch.PrepareMdlWrite = fast_io_prepare_mdl_write;
     FastIoDispatch.MdlWriteComplete = fast_io_mdl_write_complete;
-#else
-    FastIoDispatch.FastIoRead = FsRtlCopyRead;
-    FastIoDispatch.MdlRead = FsRtlMdlReadDev;
-    FastIoDispatch.MdlReadComplete = FsRtlMdlReadCompleteDev;
-    FastIoDispatch.PrepareMdlWrite = FsRtlPrepareMdlWriteDev;
-    FastIoDispatch.MdlWriteComplete = FsRtlMdlWriteCompleteDev;
-#endif
     
     *fiod = &FastIoDispatch;
 }
@@ -316,6 +316,8 @@ static NTSTATUS duplicate_fcb(fcb* oldfcb, fcb** pfcb) {
         }
         
         RtlCopyMemory(fcb->sd, oldfcb->sd, RtlLengthSecurityDescriptor(oldfcb->sd));
+        
+        fcb_share_sd(fcb);
     }
     
     fcb->atts = oldfcb->atts;
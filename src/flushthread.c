@@ -22,6 +22,12 @@
 
 #define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
 
+// below this, it's quicker to flush the fcbs ourselves than to hand them to the worker threads
+#define PARALLEL_FLUSH_MIN_FCBS 32
+
+// number of tree nodes of deleted subvols to free in each commit
+#define DROP_BATCH_NODES 1024
+
 // #define DEBUG_WRITE_LOOPS
 
 typedef struct {
@@ -435,12 +441,13 @@ nextdev:
 static BOOL trees_consistent(device_extension* Vcb) {
     ULONG maxsize = Vcb->superblock.node_size - sizeof(tree_header);
     LIST_ENTRY* le;
+    UINT8 level;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
             if (t->header.num_items == 0 && t->parent) {
 #ifdef DEBUG_WRITE_LOOPS
                 ERR("empty tree found, looping again\n");
@@ -461,9 +468,9 @@ static BOOL trees_consistent(device_extension* Vcb) {
 #endif
                 return FALSE;
             }
+            
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     return TRUE;
@@ -473,66 +480,64 @@ static NTSTATUS add_parents(device_extension* Vcb, PIRP Irp) {
     UINT8 level;
     LIST_ENTRY* le;
     
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         BOOL nothing_found = TRUE;
         
         TRACE("level = %u\n", level);
         
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
+            
+            nothing_found = FALSE;
             
-            if (t->write && t->header.level == level) {
-                TRACE("tree %p: root = %llx, level = %x, parent = %p\n", t, t->header.tree_id, t->header.level, t->parent);
+            if (t->parent) {
+                if (!t->parent->write)
+                    TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
+                    
+                mark_tree_dirty(t->parent);
+            } else if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
+                KEY searchkey;
+                traverse_ptr tp;
+                NTSTATUS Status;
                 
-                nothing_found = FALSE;
+                searchkey.obj_id = t->root->id;
+                searchkey.obj_type = TYPE_ROOT_ITEM;
+                searchkey.offset = 0xffffffffffffffff;
                 
-                if (t->parent) {
-                    if (!t->parent->write)
-                        TRACE("adding tree %p (level %x)\n", t->parent, t->header.level);
-                        
-                    t->parent->write = TRUE;
-                } else if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
-                    KEY searchkey;
-                    traverse_ptr tp;
-                    NTSTATUS Status;
+                Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return Status;
+                }
+                
+                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                    ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+                    return STATUS_INTERNAL_ERROR;
+                }
+                
+                if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
+                    ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
                     
-                    searchkey.obj_id = t->root->id;
-                    searchkey.obj_type = TYPE_ROOT_ITEM;
-                    searchkey.offset = 0xffffffffffffffff;
+                    if (!ri) {
+                        ERR("out of memory\n");
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                    }
                     
-                    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                    RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
+                    
+                    Status = delete_tree_item(Vcb, &tp);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("error - find_item returned %08x\n", Status);
+                        ERR("delete_tree_item returned %08x\n", Status);
                         return Status;
                     }
                     
-                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
-                        return STATUS_INTERNAL_ERROR;
-                    }
-                    
-                    if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
-                        ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
-                        
-                        if (!ri) {
-                            ERR("out of memory\n");
-                            return STATUS_INSUFFICIENT_RESOURCES;
-                        }
-                        
-                        RtlCopyMemory(ri, &t->root->root_item, sizeof(ROOT_ITEM));
-                        
-                        Status = delete_tree_item(Vcb, &tp);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("delete_tree_item returned %08x\n", Status);
-                            return Status;
-                        }
-                        
-                        Status = insert_tree_item(Vcb, Vcb->root_root, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("insert_tree_item returned %08x\n", Status);
-                            return Status;
-                        }
+                    Status = insert_tree_item(Vcb, Vcb->root_root, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("insert_tree_item returned %08x\n", Status);
+                        return Status;
                     }
                 }
             }
@@ -550,7 +555,7 @@ static NTSTATUS add_parents(device_extension* Vcb, PIRP Irp) {
 static void add_parents_to_cache(tree* t) {
     while (t->parent) {
         t = t->parent;
-        t->write = TRUE;
+        mark_tree_dirty(t);
     }
 }
 
@@ -590,7 +595,6 @@ static BOOL insert_tree_extent_skinny(device_extension* Vcb, UINT8 level, UINT64
 }
 
 BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* address) {
-    LIST_ENTRY* le;
     space* s;
     
     TRACE("(%p, %llx, %p)\n", Vcb, c->offset, address);
@@ -607,7 +611,7 @@ BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* add
         }
     }
     
-    if (IsListEmpty(&c->space_size))
+    if (!c->space_tree.root)
         return FALSE;
     
     if (!c->last_alloc_set) {
@@ -623,45 +627,17 @@ BOOL find_metadata_address_in_chunk(device_extension* Vcb, chunk* c, UINT64* add
         }
     }
     
-    le = c->space.Flink;
-    while (le != &c->space) {
-        s = CONTAINING_RECORD(le, space, list_entry);
-        
-        if (s->address <= c->last_alloc && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
-            *address = c->last_alloc;
-            c->last_alloc += Vcb->superblock.node_size;
-            return TRUE;
-        }
-        
-        le = le->Flink;
-    }
+    s = space_tree_find_address(&c->space_tree, c->last_alloc);
     
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-        
-        if (s->size == Vcb->superblock.node_size) {
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            return TRUE;
-        } else if (s->size < Vcb->superblock.node_size) {
-            if (le == c->space_size.Flink)
-                return FALSE;
-            
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-            
-            *address = s->address;
-            c->last_alloc = s->address + Vcb->superblock.node_size;
-            
-            return TRUE;
-        }
-        
-        le = le->Flink;
+    if (s && s->address + s->size >= c->last_alloc + Vcb->superblock.node_size) {
+        *address = c->last_alloc;
+        c->last_alloc += Vcb->superblock.node_size;
+        return TRUE;
     }
     
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = space_tree_find_size(&c->space_tree, Vcb->superblock.node_size);
     
-    if (s->size > Vcb->superblock.node_size) {
+    if (s) {
         *address = s->address;
         c->last_alloc = s->address + Vcb->superblock.node_size;
         return TRUE;
@@ -1044,7 +1020,8 @@ static NTSTATUS update_tree_extents(device_extension* Vcb, tree* t, PIRP Irp, LI
                                     if (ce2->address == ed2->address) {
                                         ce = ce2;
                                         break;
-                                    }
+                                    } else if (ce2->address > ed2->address)
+                                        break;
 
                                     le2 = le2->Flink;
                                 }
@@ -1286,7 +1263,8 @@ static NTSTATUS update_tree_extents(device_extension* Vcb, tree* t, PIRP Irp, LI
                                     if (ce2->address == ed2->address) {
                                         ce = ce2;
                                         break;
-                                    }
+                                    } else if (ce2->address > ed2->address)
+                                        break;
 
                                     le2 = le2->Flink;
                                 }
@@ -1365,37 +1343,39 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && !t->has_new_address) {
-            chunk* c;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            Status = get_tree_new_address(Vcb, t, Irp, rollback);
-            if (!NT_SUCCESS(Status)) {
-                ERR("get_tree_new_address returned %08x\n", Status);
-                return Status;
-            }
-            
-            TRACE("allocated extent %llx\n", t->new_address);
-            
-            c = get_chunk_from_address(Vcb, t->new_address);
-            
-            if (c)
-                c->used += Vcb->superblock.node_size;
-            else {
-                ERR("could not find chunk for address %llx\n", t->new_address);
-                return STATUS_INTERNAL_ERROR;
+            if (!t->has_new_address) {
+                chunk* c;
+                
+                Status = get_tree_new_address(Vcb, t, Irp, rollback);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("get_tree_new_address returned %08x\n", Status);
+                    return Status;
+                }
+                
+                TRACE("allocated extent %llx\n", t->new_address);
+                
+                c = get_chunk_from_address(Vcb, t->new_address);
+                
+                if (c)
+                    c->used += Vcb->superblock.node_size;
+                else {
+                    ERR("could not find chunk for address %llx\n", t->new_address);
+                    return STATUS_INTERNAL_ERROR;
+                }
+                
+                changed = TRUE;
+                
+                if (t->header.level > max_level)
+                    max_level = t->header.level;
             }
             
-            changed = TRUE;
-            
-            if (t->header.level > max_level)
-                max_level = t->header.level;
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     if (!changed)
@@ -1403,11 +1383,11 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
     
     level = max_level;
     do {
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (t->write && !t->updated_extents && t->has_address && t->header.level == level) {
+            if (!t->updated_extents && t->has_address) {
                 Status = update_tree_extents(Vcb, t, Irp, rollback);
                 if (!NT_SUCCESS(Status)) {
                     ERR("update_tree_extents returned %08x\n", Status);
@@ -1430,50 +1410,53 @@ static NTSTATUS allocate_tree_extents(device_extension* Vcb, PIRP Irp, LIST_ENTR
 static NTSTATUS update_root_root(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
     NTSTATUS Status;
+    UINT8 level;
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && !t->parent) {
-            if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
-                KEY searchkey;
-                traverse_ptr tp;
-                
-                searchkey.obj_id = t->root->id;
-                searchkey.obj_type = TYPE_ROOT_ITEM;
-                searchkey.offset = 0xffffffffffffffff;
-                
-                Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("error - find_item returned %08x\n", Status);
-                    return Status;
-                }
-                
-                if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                    ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
-                    return STATUS_INTERNAL_ERROR;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            if (!t->parent) {
+                if (t->root != Vcb->root_root && t->root != Vcb->chunk_root) {
+                    KEY searchkey;
+                    traverse_ptr tp;
+                    
+                    searchkey.obj_id = t->root->id;
+                    searchkey.obj_type = TYPE_ROOT_ITEM;
+                    searchkey.offset = 0xffffffffffffffff;
+                    
+                    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("error - find_item returned %08x\n", Status);
+                        return Status;
+                    }
+                    
+                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+                        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+                        return STATUS_INTERNAL_ERROR;
+                    }
+                    
+                    TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
+                    
+                    t->root->root_item.block_number = t->new_address;
+                    t->root->root_item.root_level = t->header.level;
+                    t->root->root_item.generation = Vcb->superblock.generation;
+                    t->root->root_item.generation2 = Vcb->superblock.generation;
+                    
+                    // item is guaranteed to be at least sizeof(ROOT_ITEM), due to add_parents
+    
+                    RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
                 }
                 
-                TRACE("updating the address for root %llx to %llx\n", searchkey.obj_id, t->new_address);
-                
-                t->root->root_item.block_number = t->new_address;
-                t->root->root_item.root_level = t->header.level;
-                t->root->root_item.generation = Vcb->superblock.generation;
-                t->root->root_item.generation2 = Vcb->superblock.generation;
-                
-                // item is guaranteed to be at least sizeof(ROOT_ITEM), due to add_parents
-
-                RtlCopyMemory(tp.item->data, &t->root->root_item, sizeof(ROOT_ITEM));
+                t->root->treeholder.address = t->new_address;
+                t->root->treeholder.generation = Vcb->superblock.generation;
             }
             
-            t->root->treeholder.address = t->new_address;
-            t->root->treeholder.generation = Vcb->superblock.generation;
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     Status = update_chunk_caches(Vcb, Irp, rollback);
@@ -1492,42 +1475,60 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp
     NTSTATUS Status;
     ULONG num_bits;
     
-    // merge together runs
+    // merge together runs, allocating each merged buffer once rather than copying as it grows
     c = NULL;
     le = tree_writes->Flink;
     while (le != tree_writes) {
+        LIST_ENTRY* le2;
+        UINT32 run_length;
+        
         tw = CONTAINING_RECORD(le, tree_write, list_entry);
         
         if (!c || tw->address < c->offset || tw->address >= c->offset + c->chunk_item->size)
             c = get_chunk_from_address(Vcb, tw->address);
-        else {
-            tree_write* tw2 = CONTAINING_RECORD(le->Blink, tree_write, list_entry);
+        
+        run_length = tw->length;
+        
+        le2 = le->Flink;
+        while (le2 != tree_writes && c) {
+            tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
             
-            if (tw->address == tw2->address + tw2->length) {
-                UINT8* data = ExAllocatePoolWithTag(NonPagedPool, tw2->length + tw->length, ALLOC_TAG);
-                
-                if (!data) {
-                    ERR("out of memory\n");
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
+            if (tw2->address != tw->address + run_length || tw2->address >= c->offset + c->chunk_item->size)
+                break;
+            
+            run_length += tw2->length;
+            le2 = le2->Flink;
+        }
+        
+        if (run_length > tw->length) {
+            UINT8* data = ExAllocatePoolWithTag(NonPagedPool, run_length, ALLOC_TAG);
+            UINT32 off;
+            
+            if (!data) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            
+            RtlCopyMemory(data, tw->data, tw->length);
+            off = tw->length;
+            
+            while (tw->list_entry.Flink != le2) {
+                tree_write* tw2 = CONTAINING_RECORD(tw->list_entry.Flink, tree_write, list_entry);
                 
-                RtlCopyMemory(data, tw2->data, tw2->length);
-                RtlCopyMemory(&data[tw2->length], tw->data, tw->length);
+                RtlCopyMemory(&data[off], tw2->data, tw2->length);
+                off += tw2->length;
                 
                 ExFreePool(tw2->data);
-                tw2->data = data;
-                tw2->length += tw->length;
-                
-                ExFreePool(tw->data);
-                RemoveEntryList(&tw->list_entry);
-                ExFreePool(tw);
-                
-                le = tw2->list_entry.Flink;
-                continue;
+                RemoveEntryList(&tw2->list_entry);
+                ExFreePool(tw2);
             }
+            
+            ExFreePool(tw->data);
+            tw->data = data;
+            tw->length = run_length;
         }
         
-        le = le->Flink;
+        le = le2;
     }
     
     // mark RAID5/6 overlaps so we can do them one by one
@@ -1677,73 +1678,129 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp
     return STATUS_SUCCESS;
 }
 
+void write_tree_node(device_extension* Vcb, tree* t, UINT8* data) {
+    UINT8* body;
+    UINT32 crc32;
+    
+    body = data + sizeof(tree_header);
+    
+    RtlCopyMemory(data, &t->header, sizeof(tree_header));
+    RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+    
+    if (t->header.level == 0) {
+        leaf_node* itemptr = (leaf_node*)body;
+        int i = 0;
+        LIST_ENTRY* le2;
+        UINT8* dataptr = data + Vcb->superblock.node_size;
+        
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+            if (!td->ignore) {
+                dataptr = dataptr - td->size;
+                
+                itemptr[i].key = td->key;
+                itemptr[i].offset = (UINT8*)dataptr - (UINT8*)body;
+                itemptr[i].size = td->size;
+                i++;
+                
+                if (td->size > 0)
+                    RtlCopyMemory(dataptr, td->data, td->size);
+            }
+            
+            le2 = le2->Flink;
+        }
+    } else {
+        internal_node* itemptr = (internal_node*)body;
+        int i = 0;
+        LIST_ENTRY* le2;
+        
+        le2 = t->itemlist.Flink;
+        while (le2 != &t->itemlist) {
+            tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+            if (!td->ignore) {
+                itemptr[i].key = td->key;
+                itemptr[i].address = td->treeholder.address;
+                itemptr[i].generation = td->treeholder.generation;
+                i++;
+            }
+            
+            le2 = le2->Flink;
+        }
+    }
+    
+    crc32 = calc_crc32c(0xffffffff, (UINT8*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
+    crc32 = ~crc32;
+    *((UINT32*)data) = crc32;
+    TRACE("setting crc32 to %08x\n", crc32);
+}
+
 static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     UINT8 level;
-    UINT8 *data, *body;
-    UINT32 crc32;
     NTSTATUS Status;
     LIST_ENTRY* le;
     LIST_ENTRY tree_writes;
     tree_write* tw;
+    tree** trees;
+    UINT8** datas;
+    ULONG num_trees, i;
     
     TRACE("(%p)\n", Vcb);
     
     InitializeListHead(&tree_writes);
 
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         BOOL nothing_found = TRUE;
         
         TRACE("level = %u\n", level);
         
-        le = Vcb->trees.Flink;
-        while (le != &Vcb->trees) {
-            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            KEY firstitem, searchkey;
+            LIST_ENTRY* le2;
+            traverse_ptr tp;
+            EXTENT_ITEM_TREE* eit;
             
-            if (t->write && t->header.level == level) {
-                KEY firstitem, searchkey;
-                LIST_ENTRY* le2;
-                traverse_ptr tp;
-                EXTENT_ITEM_TREE* eit;
-                
-                if (!t->has_new_address) {
-                    ERR("error - tried to write tree with no new address\n");
-                    return STATUS_INTERNAL_ERROR;
-                }
-                
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        firstitem = td->key;
-                        break;
-                    }
-                    le2 = le2->Flink;
+            if (!t->has_new_address) {
+                ERR("error - tried to write tree with no new address\n");
+                return STATUS_INTERNAL_ERROR;
+            }
+            
+            le2 = t->itemlist.Flink;
+            while (le2 != &t->itemlist) {
+                tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                if (!td->ignore) {
+                    firstitem = td->key;
+                    break;
                 }
+                le2 = le2->Flink;
+            }
+            
+            if (t->parent) {
+                t->paritem->key = firstitem;
+                t->paritem->treeholder.address = t->new_address;
+                t->paritem->treeholder.generation = Vcb->superblock.generation;
+            }
+            
+            if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
+                searchkey.obj_id = t->new_address;
+                searchkey.obj_type = TYPE_EXTENT_ITEM;
+                searchkey.offset = Vcb->superblock.node_size;
                 
-                if (t->parent) {
-                    t->paritem->key = firstitem;
-                    t->paritem->treeholder.address = t->new_address;
-                    t->paritem->treeholder.generation = Vcb->superblock.generation;
+                Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("error - find_item returned %08x\n", Status);
+                    return Status;
                 }
                 
-                if (!(Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA)) {
-                    searchkey.obj_id = t->new_address;
-                    searchkey.obj_type = TYPE_EXTENT_ITEM;
-                    searchkey.offset = Vcb->superblock.node_size;
-                    
-                    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, Irp);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("error - find_item returned %08x\n", Status);
-                        return Status;
-                    }
-                    
-                    if (keycmp(searchkey, tp.item->key)) {
+                if (keycmp(searchkey, tp.item->key)) {
 //                         traverse_ptr next_tp;
 //                         BOOL b;
 //                         tree_data* paritem;
-                        
-                        ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-                        
+                    
+                    ERR("could not find %llx,%x,%llx in extent_root (found %llx,%x,%llx instead)\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
+                    
 //                         searchkey.obj_id = 0;
 //                         searchkey.obj_type = 0;
 //                         searchkey.offset = 0;
@@ -1767,22 +1824,21 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
 //                         } while (b);
 //                         
 //                         free_traverse_ptr(&tp);
-                        
-                        return STATUS_INTERNAL_ERROR;
-                    }
-                    
-                    if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
-                        ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
-                        return STATUS_INTERNAL_ERROR;
-                    }
                     
-                    eit = (EXTENT_ITEM_TREE*)tp.item->data;
-                    eit->firstitem = firstitem;
+                    return STATUS_INTERNAL_ERROR;
+                }
+                
+                if (tp.item->size < sizeof(EXTENT_ITEM_TREE)) {
+                    ERR("(%llx,%x,%llx) was %u bytes, expected at least %u\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, tp.item->size, sizeof(EXTENT_ITEM_TREE));
+                    return STATUS_INTERNAL_ERROR;
                 }
                 
-                nothing_found = FALSE;
+                eit = (EXTENT_ITEM_TREE*)tp.item->data;
+                eit->firstitem = firstitem;
             }
             
+            nothing_found = FALSE;
+            
             le = le->Flink;
         }
         
@@ -1792,16 +1848,44 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
     
     TRACE("allocated tree extents\n");
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+    num_trees = 0;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            num_trees++;
+            le = le->Flink;
+        }
+    }
+    
+    if (num_trees == 0)
+        return STATUS_SUCCESS;
+    
+    trees = ExAllocatePoolWithTag(PagedPool, sizeof(tree*) * num_trees, ALLOC_TAG);
+    if (!trees) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    datas = ExAllocatePoolWithTag(PagedPool, sizeof(UINT8*) * num_trees, ALLOC_TAG);
+    if (!datas) {
+        ERR("out of memory\n");
+        ExFreePool(trees);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(datas, sizeof(UINT8*) * num_trees);
+    
+    i = 0;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
 #ifdef DEBUG_PARANOID
-        UINT32 num_items = 0, size = 0;
-        LIST_ENTRY* le2;
-        BOOL crash = FALSE;
+            UINT32 num_items = 0, size = 0;
+            LIST_ENTRY* le2;
+            BOOL crash = FALSE;
 #endif
-
-        if (t->write) {
+            
 #ifdef DEBUG_PARANOID
             le2 = t->itemlist.Flink;
             while (le2 != &t->itemlist) {
@@ -1860,101 +1944,77 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             t->header.fs_uuid = Vcb->superblock.uuid;
             t->has_address = TRUE;
             
-            data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-            if (!data) {
+            datas[i] = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
+            if (!datas[i]) {
                 ERR("out of memory\n");
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 goto end;
             }
             
-            body = data + sizeof(tree_header);
+            trees[i] = t;
+            i++;
             
-            RtlCopyMemory(data, &t->header, sizeof(tree_header));
-            RtlZeroMemory(body, Vcb->superblock.node_size - sizeof(tree_header));
+            le = le->Flink;
+        }
+    }
+    
+    // Serialising and checksumming nodes is only worth handing to the calc threads
+    // for larger commits.
+    
+    if (num_trees < 16) {
+        for (i = 0; i < num_trees; i++) {
+            write_tree_node(Vcb, trees[i], datas[i]);
+        }
+    } else {
+        tree_write_job* twj;
+        
+        Status = add_tree_write_job(Vcb, trees, datas, num_trees, &twj);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_tree_write_job returned %08x\n", Status);
+            goto end;
+        }
+        
+        KeWaitForSingleObject(&twj->event, Executive, KernelMode, FALSE, NULL);
+        free_tree_write_job(twj);
+    }
+    
+    for (i = 0; i < num_trees; i++) {
+        tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
+        if (!tw) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        tw->address = trees[i]->new_address;
+        tw->length = Vcb->superblock.node_size;
+        tw->data = datas[i];
+        tw->overlap = FALSE;
+        
+        datas[i] = NULL;
+        
+        if (IsListEmpty(&tree_writes))
+            InsertTailList(&tree_writes, &tw->list_entry);
+        else {
+            LIST_ENTRY* le2;
+            BOOL inserted = FALSE;
             
-            if (t->header.level == 0) {
-                leaf_node* itemptr = (leaf_node*)body;
-                int i = 0;
-                LIST_ENTRY* le2;
-                UINT8* dataptr = data + Vcb->superblock.node_size;
+            le2 = tree_writes.Flink;
+            while (le2 != &tree_writes) {
+                tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
                 
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        dataptr = dataptr - td->size;
-                        
-                        itemptr[i].key = td->key;
-                        itemptr[i].offset = (UINT8*)dataptr - (UINT8*)body;
-                        itemptr[i].size = td->size;
-                        i++;
-                        
-                        if (td->size > 0)
-                            RtlCopyMemory(dataptr, td->data, td->size);
-                    }
-                    
-                    le2 = le2->Flink;
+                if (tw2->address > tw->address) {
+                    InsertHeadList(le2->Blink, &tw->list_entry);
+                    inserted = TRUE;
+                    break;
                 }
-            } else {
-                internal_node* itemptr = (internal_node*)body;
-                int i = 0;
-                LIST_ENTRY* le2;
                 
-                le2 = t->itemlist.Flink;
-                while (le2 != &t->itemlist) {
-                    tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                    if (!td->ignore) {
-                        itemptr[i].key = td->key;
-                        itemptr[i].address = td->treeholder.address;
-                        itemptr[i].generation = td->treeholder.generation;
-                        i++;
-                    }
-                    
-                    le2 = le2->Flink;
-                }
-            }
-            
-            crc32 = calc_crc32c(0xffffffff, (UINT8*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
-            crc32 = ~crc32;
-            *((UINT32*)data) = crc32;
-            TRACE("setting crc32 to %08x\n", crc32);
-            
-            tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
-            if (!tw) {
-                ERR("out of memory\n");
-                return STATUS_INSUFFICIENT_RESOURCES;
+                le2 = le2->Flink;
             }
             
-            tw->address = t->new_address;
-            tw->length = Vcb->superblock.node_size;
-            tw->data = data;
-            tw->overlap = FALSE;
-            
-            if (IsListEmpty(&tree_writes))
+            if (!inserted)
                 InsertTailList(&tree_writes, &tw->list_entry);
-            else {
-                LIST_ENTRY* le2;
-                BOOL inserted = FALSE;
-                
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
-                    tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
-                    
-                    if (tw2->address > tw->address) {
-                        InsertHeadList(le2->Blink, &tw->list_entry);
-                        inserted = TRUE;
-                        break;
-                    }
-                    
-                    le2 = le2->Flink;
-                }
-                
-                if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
-            }
         }
-
-        le = le->Flink;
     }
     
     Status = do_tree_writes(Vcb, &tree_writes, Irp);
@@ -1976,6 +2036,14 @@ end:
         ExFreePool(tw);
     }
     
+    for (i = 0; i < num_trees; i++) {
+        if (datas[i])
+            ExFreePool(datas[i]);
+    }
+    
+    ExFreePool(datas);
+    ExFreePool(trees);
+    
     return Status;
 }
 
@@ -2087,25 +2155,28 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     UINT64 i;
     NTSTATUS Status;
     LIST_ENTRY* le;
+    UINT8 level;
     
     TRACE("(%p)\n", Vcb);
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-        
-        if (t->write && !t->parent) {
-            if (t->root == Vcb->root_root) {
-                Vcb->superblock.root_tree_addr = t->new_address;
-                Vcb->superblock.root_level = t->header.level;
-            } else if (t->root == Vcb->chunk_root) {
-                Vcb->superblock.chunk_tree_addr = t->new_address;
-                Vcb->superblock.chunk_root_generation = t->header.generation;
-                Vcb->superblock.chunk_root_level = t->header.level;
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            if (!t->parent) {
+                if (t->root == Vcb->root_root) {
+                    Vcb->superblock.root_tree_addr = t->new_address;
+                    Vcb->superblock.root_level = t->header.level;
+                } else if (t->root == Vcb->chunk_root) {
+                    Vcb->superblock.chunk_tree_addr = t->new_address;
+                    Vcb->superblock.chunk_root_generation = t->header.generation;
+                    Vcb->superblock.chunk_root_level = t->header.level;
+                }
             }
+            
+            le = le->Flink;
         }
-        
-        le = le->Flink;
     }
     
     for (i = 0; i < BTRFS_NUM_BACKUP_ROOTS - 1; i++) {
@@ -2137,10 +2208,13 @@ static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_ex
     NTSTATUS Status;
     UINT64 old_size;
     
+    // extent was allocated and freed again within this transaction
     if (ce->count == 0 && ce->old_count == 0) {
         while (!IsListEmpty(&ce->refs)) {
             changed_extent_ref* cer = CONTAINING_RECORD(RemoveHeadList(&ce->refs), changed_extent_ref, list_entry);
             ExFreePool(cer);
+            
+            Vcb->counters.extent_refs_collapsed++;
         }
         
         while (!IsListEmpty(&ce->old_refs)) {
@@ -2175,6 +2249,11 @@ static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_ex
             
             old_size = ce->old_count > 0 ? ce->old_size : ce->size;
             
+            if (cer->edr.count == old_count)
+                Vcb->counters.extent_refs_collapsed++;
+            else
+                Vcb->counters.extent_refs_applied++;
+            
             if (cer->edr.count > old_count) {
                 Status = increase_extent_refcount_data(Vcb, ce->address, old_size, cer->edr.root, cer->edr.objid, cer->edr.offset, cer->edr.count - old_count, Irp);
                             
@@ -2224,6 +2303,8 @@ static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_ex
                 } else
                     data = NULL;
                 
+                invalidate_extent_cache(Vcb, ce->address);
+                
                 Status = insert_tree_item(Vcb, Vcb->extent_root, ce->address, TYPE_EXTENT_ITEM, ce->size, data, tp.item->size, NULL, Irp);
                 if (!NT_SUCCESS(Status)) {
                     ERR("insert_tree_item returned %08x\n", Status);
@@ -2687,6 +2768,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     nt->new_address = 0;
     nt->has_new_address = FALSE;
     nt->updated_extents = FALSE;
+    nt->write = FALSE;
     nt->uniqueness_determined = TRUE;
     nt->is_unique = TRUE;
     nt->list_entry_hash.Flink = NULL;
@@ -2736,7 +2818,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     nt->size = t->size - size;
     t->size = size;
     t->header.num_items = numitems;
-    nt->write = TRUE;
+    mark_tree_dirty(nt);
     
     InterlockedIncrement(&Vcb->open_trees);
     InsertTailList(&Vcb->trees, &nt->list_entry);
@@ -2818,8 +2900,8 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     
     TRACE("adding new tree parent\n");
     
-    if (nt->header.level == 255) {
-        ERR("cannot add parent to tree at level 255\n");
+    if (nt->header.level >= BTRFS_MAX_LEVEL - 1) {
+        ERR("cannot add parent to tree at level %u\n", nt->header.level);
         return STATUS_INTERNAL_ERROR;
     }
     
@@ -2843,6 +2925,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     pt->new_address = 0;
     pt->has_new_address = FALSE;
     pt->updated_extents = FALSE;
+    pt->write = FALSE;
 //     pt->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(tree_nonpaged), ALLOC_TAG);
     pt->size = pt->header.num_items * sizeof(internal_node);
     pt->uniqueness_determined = TRUE;
@@ -2888,7 +2971,7 @@ static NTSTATUS STDCALL split_tree_at(device_extension* Vcb, tree* t, tree_data*
     InsertTailList(&pt->itemlist, &td->list_entry);
     nt->paritem = td;
     
-    pt->write = TRUE;
+    mark_tree_dirty(pt);
 
     t->root->treeholder.tree = pt;
     
@@ -3166,7 +3249,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
         
         par = next_tree->parent;
         while (par) {
-            par->write = TRUE;
+            mark_tree_dirty(par);
             par = par->parent;
         }
         
@@ -3257,7 +3340,7 @@ static NTSTATUS try_tree_amalgamate(device_extension* Vcb, tree* t, BOOL* done,
         
         par = next_tree;
         while (par) {
-            par->write = TRUE;
+            mark_tree_dirty(par);
             par = par->parent;
         }
             
@@ -3400,100 +3483,98 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     
     max_level = 0;
     
-    for (level = 0; level <= 255; level++) {
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
         LIST_ENTRY *le, *nextle;
         
         empty = TRUE;
         
         TRACE("doing level %u\n", level);
         
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
     
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
             nextle = le->Flink;
             
-            if (t->write && t->header.level == level) {
-                empty = FALSE;
-                
-                if (t->header.num_items == 0) {
-                    if (!t->updated_extents && t->has_address) {
-                        Status = update_tree_extents(Vcb, t, Irp, rollback);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("update_tree_extents returned %08x\n", Status);
-                            return Status;
-                        }
+            empty = FALSE;
+            
+            if (t->header.num_items == 0) {
+                if (!t->updated_extents && t->has_address) {
+                    Status = update_tree_extents(Vcb, t, Irp, rollback);
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("update_tree_extents returned %08x\n", Status);
+                        return Status;
                     }
+                }
 
-                    if (t->parent) {
-                        done_deletions = TRUE;
+                if (t->parent) {
+                    done_deletions = TRUE;
             
-                        TRACE("deleting tree in root %llx\n", t->root->id);
-                        
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
-                        
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_address = FALSE;
-                        }
+                    TRACE("deleting tree in root %llx\n", t->root->id);
+                    
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+                    
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
                         
-                        if (!t->paritem->ignore) {
-                            t->paritem->ignore = TRUE;
-                            t->parent->header.num_items--;
-                            t->parent->size -= sizeof(internal_node);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        RemoveEntryList(&t->paritem->list_entry);
-                        ExFreePool(t->paritem);
-                        t->paritem = NULL;
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, t->parent->header.tree_id, t->header.level, Irp, rollback);
                         
-                        free_tree(t);
-                    } else if (t->header.level != 0) {
-                        if (t->has_new_address) {
-                            Status = update_extent_level(Vcb, t->new_address, t, 0, Irp);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("update_extent_level returned %08x\n", Status);
-                                return Status;
-                            }
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        t->header.level = 0;
+                        t->has_address = FALSE;
                     }
-                } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
-                    TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
                     
-                    if (!t->updated_extents && t->has_address) {
-                        Status = update_tree_extents_recursive(Vcb, t, Irp, rollback);
+                    if (!t->paritem->ignore) {
+                        t->paritem->ignore = TRUE;
+                        t->parent->header.num_items--;
+                        t->parent->size -= sizeof(internal_node);
+                    }
+                    
+                    RemoveEntryList(&t->paritem->list_entry);
+                    ExFreePool(t->paritem);
+                    t->paritem = NULL;
+                    
+                    free_tree(t);
+                } else if (t->header.level != 0) {
+                    if (t->has_new_address) {
+                        Status = update_extent_level(Vcb, t->new_address, t, 0, Irp);
+                        
                         if (!NT_SUCCESS(Status)) {
-                            ERR("update_tree_extents_recursive returned %08x\n", Status);
+                            ERR("update_extent_level returned %08x\n", Status);
                             return Status;
                         }
                     }
                     
-                    Status = split_tree(Vcb, t);
-
+                    set_tree_level(t, 0);
+                }
+            } else if (t->size > Vcb->superblock.node_size - sizeof(tree_header)) {
+                TRACE("splitting overlarge tree (%x > %x)\n", t->size, Vcb->superblock.node_size - sizeof(tree_header));
+                
+                if (!t->updated_extents && t->has_address) {
+                    Status = update_tree_extents_recursive(Vcb, t, Irp, rollback);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("split_tree returned %08x\n", Status);
+                        ERR("update_tree_extents_recursive returned %08x\n", Status);
                         return Status;
                     }
                 }
+                
+                Status = split_tree(Vcb, t);
+
+                if (!NT_SUCCESS(Status)) {
+                    ERR("split_tree returned %08x\n", Status);
+                    return Status;
+                }
             }
             
             le = nextle;
@@ -3512,12 +3593,12 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     for (level = 0; level <= max_level; level++) {
         LIST_ENTRY* le;
         
-        le = Vcb->trees.Flink;
+        le = Vcb->dirty_trees[level].Flink;
     
-        while (le != &Vcb->trees) {
-            t = CONTAINING_RECORD(le, tree, list_entry);
+        while (le != &Vcb->dirty_trees[level]) {
+            t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (t->write && t->header.level == level && t->header.num_items > 0 && t->parent && t->size < min_size && is_tree_unique(Vcb, t, Irp)) {
+            if (t->header.num_items > 0 && t->parent && t->size < min_size && is_tree_unique(Vcb, t, Irp)) {
                 BOOL done;
                 
                 do {
@@ -3539,71 +3620,69 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         for (level = max_level; level > 0; level--) {
             LIST_ENTRY *le, *nextle;
             
-            le = Vcb->trees.Flink;
-            while (le != &Vcb->trees) {
+            le = Vcb->dirty_trees[level].Flink;
+            while (le != &Vcb->dirty_trees[level]) {
                 nextle = le->Flink;
-                t = CONTAINING_RECORD(le, tree, list_entry);
-                
-                if (t->write && t->header.level == level) {
-                    if (!t->parent && t->header.num_items == 1) {
-                        LIST_ENTRY* le2 = t->itemlist.Flink;
-                        tree_data* td;
-                        tree* child_tree = NULL;
-
-                        while (le2 != &t->itemlist) {
-                            td = CONTAINING_RECORD(le2, tree_data, list_entry);
-                            if (!td->ignore)
-                                break;
-                            le2 = le2->Flink;
-                        }
-                        
-                        TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
-                        
-                        if (t->has_new_address) { // delete associated EXTENT_ITEM
-                            Status = reduce_tree_extent(Vcb, t->new_address, t, t->header.tree_id, t->header.level, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_new_address = FALSE;
-                        } else if (t->has_address) {
-                            Status = reduce_tree_extent(Vcb,t->header.address, t, t->header.tree_id, t->header.level, Irp, rollback);
-                            
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("reduce_tree_extent returned %08x\n", Status);
-                                return Status;
-                            }
-                            
-                            t->has_address = FALSE;
-                        }
+                t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+                
+                if (!t->parent && t->header.num_items == 1) {
+                    LIST_ENTRY* le2 = t->itemlist.Flink;
+                    tree_data* td;
+                    tree* child_tree = NULL;
+
+                    while (le2 != &t->itemlist) {
+                        td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        if (!td->ignore)
+                            break;
+                        le2 = le2->Flink;
+                    }
+                    
+                    TRACE("deleting top-level tree in root %llx with one item\n", t->root->id);
+                    
+                    if (t->has_new_address) { // delete associated EXTENT_ITEM
+                        Status = reduce_tree_extent(Vcb, t->new_address, t, t->header.tree_id, t->header.level, Irp, rollback);
                         
-                        if (!td->treeholder.tree) { // load first item if not already loaded
-                            KEY searchkey = {0,0,0};
-                            traverse_ptr tp;
-                            
-                            Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
-                            if (!NT_SUCCESS(Status)) {
-                                ERR("error - find_item returned %08x\n", Status);
-                                return Status;
-                            }
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        child_tree = td->treeholder.tree;
+                        t->has_new_address = FALSE;
+                    } else if (t->has_address) {
+                        Status = reduce_tree_extent(Vcb,t->header.address, t, t->header.tree_id, t->header.level, Irp, rollback);
                         
-                        if (child_tree) {
-                            child_tree->parent = NULL;
-                            child_tree->paritem = NULL;
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("reduce_tree_extent returned %08x\n", Status);
+                            return Status;
                         }
                         
-                        t->root->root_item.bytes_used -= Vcb->superblock.node_size;
-
-                        free_tree(t);
+                        t->has_address = FALSE;
+                    }
+                    
+                    if (!td->treeholder.tree) { // load first item if not already loaded
+                        KEY searchkey = {0,0,0};
+                        traverse_ptr tp;
                         
-                        if (child_tree)
-                            child_tree->root->treeholder.tree = child_tree;
+                        Status = find_item(Vcb, t->root, &tp, &searchkey, FALSE, Irp);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("error - find_item returned %08x\n", Status);
+                            return Status;
+                        }
+                    }
+                    
+                    child_tree = td->treeholder.tree;
+                    
+                    if (child_tree) {
+                        child_tree->parent = NULL;
+                        child_tree->paritem = NULL;
                     }
+                    
+                    t->root->root_item.bytes_used -= Vcb->superblock.node_size;
+
+                    free_tree(t);
+                    
+                    if (child_tree)
+                        child_tree->root->treeholder.tree = child_tree;
                 }
                 
                 le = nextle;
@@ -3614,7 +3693,7 @@ static NTSTATUS STDCALL do_splits(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder* th, UINT8 level, tree* parent, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder* th, UINT8 level, tree* parent, ULONG* budget, BOOL* done, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     
     if (!th->tree) {
@@ -3633,11 +3712,41 @@ static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder*
             tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
             
             if (!td->ignore) {
-                Status = remove_root_extents(Vcb, r, &td->treeholder, th->tree->header.level - 1, th->tree, Irp, rollback);
+                LIST_ENTRY* le2 = le->Flink;
+                tree_data* next = NULL;
                 
-                if (!NT_SUCCESS(Status)) {
-                    ERR("remove_root_extents returned %08x\n", Status);
-                    return Status;
+                while (le2 != &th->tree->itemlist) {
+                    tree_data* td2 = CONTAINING_RECORD(le2, tree_data, list_entry);
+                    
+                    if (!td2->ignore) {
+                        next = td2;
+                        break;
+                    }
+                    
+                    le2 = le2->Flink;
+                }
+                
+                // Everything before drop_progress has already gone, so skip any child that finishes before it.
+                if (!next || keycmp(next->key, r->root_item.drop_progress) == 1) {
+                    if (*budget == 0) {
+                        // Resuming only looks at drop_progress - as keys in a child are never less than its
+                        // parent's key, it's enough to tell which subtrees are gone. We fill in drop_level
+                        // for the benefit of Linux, which expects it to be set alongside drop_progress.
+                        r->root_item.drop_progress = td->key;
+                        r->root_item.drop_level = th->tree->header.level - 1;
+                        *done = FALSE;
+                        return STATUS_SUCCESS;
+                    }
+                    
+                    Status = remove_root_extents(Vcb, r, &td->treeholder, th->tree->header.level - 1, th->tree, budget, done, Irp, rollback);
+                    
+                    if (!NT_SUCCESS(Status)) {
+                        ERR("remove_root_extents returned %08x\n", Status);
+                        return Status;
+                    }
+                    
+                    if (!*done)
+                        return STATUS_SUCCESS;
                 }
             }
             
@@ -3648,34 +3757,141 @@ static NTSTATUS remove_root_extents(device_extension* Vcb, root* r, tree_holder*
     if (th->tree && !th->tree->updated_extents && th->tree->has_address) {
         Status = update_tree_extents(Vcb, th->tree, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
-            ERR("update_tree_extents returned %08x\n", Status);
+            ERR("update_tree_extents returned %08x\n", Status);
+            return Status;
+        }
+    }
+    
+    if (!th->tree || th->tree->has_address) {
+        Status = reduce_tree_extent(Vcb, th->address, NULL, parent ? parent->header.tree_id : r->id, level, Irp, rollback);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("reduce_tree_extent(%llx) returned %08x\n", th->address, Status);
+            return Status;
+        }
+    }
+    
+    if (*budget > 0)
+        (*budget)--;
+    
+    *done = TRUE;
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS update_dropped_root_item(device_extension* Vcb, root* r, PIRP Irp) {
+    KEY searchkey;
+    traverse_ptr tp;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = r->id;
+    searchkey.obj_type = TYPE_ROOT_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+        ERR("could not find ROOT_ITEM for tree %llx\n", searchkey.obj_id);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    if (tp.item->size < sizeof(ROOT_ITEM)) { // if not full length, delete and create new entry
+        ROOT_ITEM* ri = ExAllocatePoolWithTag(PagedPool, sizeof(ROOT_ITEM), ALLOC_TAG);
+        
+        if (!ri) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
+        
+        Status = delete_tree_item(Vcb, &tp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("delete_tree_item returned %08x\n", Status);
+            ExFreePool(ri);
             return Status;
         }
-    }
-    
-    if (!th->tree || th->tree->has_address) {
-        Status = reduce_tree_extent(Vcb, th->address, NULL, parent ? parent->header.tree_id : r->id, level, Irp, rollback);
         
+        Status = insert_tree_item(Vcb, Vcb->root_root, tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset, ri, sizeof(ROOT_ITEM), NULL, Irp);
         if (!NT_SUCCESS(Status)) {
-            ERR("reduce_tree_extent(%llx) returned %08x\n", th->address, Status);
+            ERR("insert_tree_item returned %08x\n", Status);
+            ExFreePool(ri);
             return Status;
         }
+    } else {
+        RtlCopyMemory(tp.item->data, &r->root_item, sizeof(ROOT_ITEM));
+        mark_tree_dirty(tp.tree);
     }
     
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS drop_root(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS drop_root(device_extension* Vcb, root* r, ULONG* budget, BOOL* done, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
     
-    Status = remove_root_extents(Vcb, r, &r->treeholder, r->root_item.root_level, NULL, Irp, rollback);
+    // The first time round we just record that the root is being deleted, with an orphan item
+    // in the root tree as Linux does. Its trees will still be dirty from before the deletion,
+    // and get written out as normal in this commit. The actual dropping happens a bit at a time
+    // in later commits, working from what's on disk.
+    
+    searchkey.obj_id = ORPHAN_ID;
+    searchkey.obj_type = TYPE_ORPHAN_ITEM;
+    searchkey.offset = r->id;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(tp.item->key, searchkey)) {
+        Status = insert_tree_item(Vcb, Vcb->root_root, ORPHAN_ID, TYPE_ORPHAN_ITEM, r->id, NULL, 0, NULL, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item returned %08x\n", Status);
+            return Status;
+        }
+        
+        r->root_item.num_references = 0;
+        RtlZeroMemory(&r->root_item.drop_progress, sizeof(KEY));
+        r->root_item.drop_level = 0;
+        
+        Status = update_dropped_root_item(Vcb, r, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("update_dropped_root_item returned %08x\n", Status);
+            return Status;
+        }
+        
+        *done = FALSE;
+        
+        return STATUS_SUCCESS;
+    }
+    
+    Status = remove_root_extents(Vcb, r, &r->treeholder, r->root_item.root_level, NULL, budget, done, Irp, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("remove_root_extents returned %08x\n", Status);
         return Status;
     }
     
+    // delete items in tree cache - we read the path down to drop_progress again next time
+    
+    free_trees_root(Vcb, r);
+    
+    if (!*done) {
+        Status = update_dropped_root_item(Vcb, r, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("update_dropped_root_item returned %08x\n", Status);
+            return Status;
+        }
+        
+        return STATUS_SUCCESS;
+    }
+    
     // remove entry in uuid root (tree 9)
     if (Vcb->uuid_root) {
         RtlCopyMemory(&searchkey.obj_id, &r->root_item.uuid.uuid[0], sizeof(UINT64));
@@ -3721,28 +3937,56 @@ static NTSTATUS drop_root(device_extension* Vcb, root* r, PIRP Irp, LIST_ENTRY*
     } else
         WARN("could not find (%llx,%x,%llx) in root_root\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
     
-    // delete items in tree cache
+    // delete orphan item
     
-    free_trees_root(Vcb, r);
+    searchkey.obj_id = ORPHAN_ID;
+    searchkey.obj_type = TYPE_ORPHAN_ITEM;
+    searchkey.offset = r->id;
+    
+    Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (!keycmp(tp.item->key, searchkey)) {
+        Status = delete_tree_item(Vcb, &tp);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("delete_tree_item returned %08x\n", Status);
+            return Status;
+        }
+    } else
+        WARN("could not find (%llx,%x,%llx) in root_root\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
     
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS drop_roots(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+static NTSTATUS drop_roots(device_extension* Vcb, LIST_ENTRY* dropped, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY *le = Vcb->drop_roots.Flink, *le2;
     NTSTATUS Status;
+    ULONG budget = DROP_BATCH_NODES;
     
-    while (le != &Vcb->drop_roots) {
+    // Only free a limited number of nodes per commit, so that deleting a big subvol doesn't hold
+    // up everything else. The drop thread keeps committing until drop_roots is empty.
+    
+    while (le != &Vcb->drop_roots && budget > 0) {
         root* r = CONTAINING_RECORD(le, root, list_entry);
+        BOOL done;
         
         le2 = le->Flink;
         
-        Status = drop_root(Vcb, r, Irp, rollback);
+        Status = drop_root(Vcb, r, &budget, &done, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("drop_root(%llx) returned %08x\n", r->id, Status);
             return Status;
         }
         
+        if (done) {
+            RemoveEntryList(&r->list_entry);
+            InsertTailList(dropped, &r->list_entry);
+        }
+        
         le = le2;
     }
     
@@ -4981,6 +5225,186 @@ end:
     return Status;
 }
 
+// Returns TRUE if flush_fcb will only add items to the batch list for this fcb, rather than
+// changing any trees directly - only these fcbs are safe to flush on more than one thread at once.
+static BOOL flush_fcb_batch_only(fcb* fcb) {
+    if (fcb->ads)
+        return FALSE;
+    
+    if (fcb->deleted)
+        return TRUE;
+    
+    if (!fcb->created && (fcb->extents_changed || fcb->inode_item_changed))
+        return FALSE;
+    
+    if (fcb->extents_changed) {
+        LIST_ENTRY* le;
+        BOOL has_extents = FALSE;
+        
+        le = fcb->extents.Flink;
+        while (le != &fcb->extents) {
+            extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+            
+            if (!ext->ignore) {
+                if (ext->extent_data.type != EXTENT_TYPE_INLINE)
+                    return FALSE;
+                
+                has_extents = TRUE;
+            }
+            
+            le = le->Flink;
+        }
+        
+        // we would need to insert a sparse extent
+        if (!has_extents && fcb->inode_item.st_size > 0 && !(fcb->Vcb->superblock.incompat_flags & BTRFS_INCOMPAT_FLAGS_NO_HOLES))
+            return FALSE;
+    }
+    
+    // deleting xattrs goes straight to the tree
+    
+    if (fcb->atts_changed && fcb->atts_deleted)
+        return FALSE;
+    
+    if (fcb->reparse_xattr_changed && (!fcb->reparse_xattr.Buffer || fcb->reparse_xattr.Length == 0))
+        return FALSE;
+    
+    if (fcb->ea_changed && (!fcb->ea_xattr.Buffer || fcb->ea_xattr.Length == 0))
+        return FALSE;
+    
+    if (fcb->prop_compression_changed && fcb->prop_compression == PropCompression_None)
+        return FALSE;
+    
+    return TRUE;
+}
+
+void do_flush_fcb_job(flush_fcb_job* job) {
+    LIST_ENTRY* le;
+    
+    job->Status = STATUS_SUCCESS;
+    
+    le = job->fcbs.Flink;
+    while (le != &job->fcbs) {
+        dirty_fcb* dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
+        NTSTATUS Status;
+        
+        ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
+        Status = flush_fcb(dirt->fcb, FALSE, &job->batchlist, NULL);
+        ExReleaseResourceLite(dirt->fcb->Header.Resource);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_fcb returned %08x\n", Status);
+            job->Status = Status;
+            break;
+        }
+        
+        le = le->Flink;
+    }
+    
+    KeSetEvent(&job->event, 0, FALSE);
+}
+
+static void merge_batch_lists(LIST_ENTRY* batchlist, LIST_ENTRY* batchlist2) {
+    while (!IsListEmpty(batchlist2)) {
+        batch_root* br2 = CONTAINING_RECORD(RemoveHeadList(batchlist2), batch_root, list_entry);
+        batch_root* br = NULL;
+        LIST_ENTRY* le;
+        
+        le = batchlist->Flink;
+        while (le != batchlist) {
+            batch_root* br3 = CONTAINING_RECORD(le, batch_root, list_entry);
+            
+            if (br3->r == br2->r) {
+                br = br3;
+                break;
+            }
+            
+            le = le->Flink;
+        }
+        
+        if (!br) {
+            InsertTailList(batchlist, &br2->list_entry);
+            continue;
+        }
+        
+        // both lists are already sorted, so we can merge them in one pass
+        
+        le = br->items.Flink;
+        while (!IsListEmpty(&br2->items)) {
+            batch_item* bi = CONTAINING_RECORD(RemoveHeadList(&br2->items), batch_item, list_entry);
+            
+            while (le != &br->items) {
+                batch_item* bi2 = CONTAINING_RECORD(le, batch_item, list_entry);
+                
+                if (keycmp(bi2->key, bi->key) == 1)
+                    break;
+                
+                le = le->Flink;
+            }
+            
+            InsertTailList(le, &bi->list_entry);
+        }
+        
+        ExFreePool(br2);
+    }
+}
+
+static NTSTATUS flush_fcbs_parallel(device_extension* Vcb, LIST_ENTRY* fcbs, ULONG num_fcbs, LIST_ENTRY* batchlist) {
+    NTSTATUS Status;
+    flush_fcb_job* jobs;
+    ULONG num_jobs, i;
+    
+    num_jobs = min(Vcb->calcthreads.num_threads, num_fcbs);
+    
+    jobs = ExAllocatePoolWithTag(NonPagedPool, sizeof(flush_fcb_job) * num_jobs, ALLOC_TAG);
+    if (!jobs) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    for (i = 0; i < num_jobs; i++) {
+        InitializeListHead(&jobs[i].fcbs);
+        InitializeListHead(&jobs[i].batchlist);
+        KeInitializeEvent(&jobs[i].event, NotificationEvent, FALSE);
+    }
+    
+    i = 0;
+    while (!IsListEmpty(fcbs)) {
+        InsertTailList(&jobs[i].fcbs, RemoveHeadList(fcbs));
+        i = (i + 1) % num_jobs;
+    }
+    
+    ExAcquireResourceExclusiveLite(&Vcb->calcthreads.lock, TRUE);
+    
+    for (i = 0; i < num_jobs; i++) {
+        InsertTailList(&Vcb->calcthreads.flush_list, &jobs[i].list_entry);
+    }
+    
+    ExReleaseResourceLite(&Vcb->calcthreads.lock);
+    
+    KeSetEvent(&Vcb->calcthreads.event, 0, FALSE);
+    KeClearEvent(&Vcb->calcthreads.event);
+    
+    Status = STATUS_SUCCESS;
+    
+    for (i = 0; i < num_jobs; i++) {
+        KeWaitForSingleObject(&jobs[i].event, Executive, KernelMode, FALSE, NULL);
+        
+        if (!NT_SUCCESS(jobs[i].Status) && NT_SUCCESS(Status))
+            Status = jobs[i].Status;
+        
+        merge_batch_lists(batchlist, &jobs[i].batchlist);
+        
+        // give the dirty_fcbs back to the caller, as free_fcb isn't safe to call from more than one thread
+        while (!IsListEmpty(&jobs[i].fcbs)) {
+            InsertTailList(fcbs, RemoveHeadList(&jobs[i].fcbs));
+        }
+    }
+    
+    ExFreePool(jobs);
+    
+    return Status;
+}
+
 void add_trim_entry_avoid_sb(device_extension* Vcb, device* dev, UINT64 address, UINT64 size) {
     int i;
     ULONG sblen = sector_align(sizeof(superblock), Vcb->superblock.sector_size);
@@ -5202,6 +5626,14 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
             WARN("could not find BLOCK_GROUP_ITEM for chunk %llx\n", c->offset);
     }
     
+    if (Vcb->free_space_tree) {
+        Status = remove_free_space_tree_chunk(Vcb, c, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("remove_free_space_tree_chunk returned %08x\n", Status);
+            return Status;
+        }
+    }
+    
     if (c->chunk_item->type & BLOCK_FLAG_SYSTEM)
         remove_from_bootstrap(Vcb, 0x100, TYPE_CHUNK_ITEM, c->offset);
     
@@ -5237,6 +5669,9 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
     ExFreePool(c->chunk_item);
     ExFreePool(c->devices);
     
+    if (c->cache_image)
+        ExFreePool(c->cache_image);
+    
     while (!IsListEmpty(&c->space)) {
         space* s = CONTAINING_RECORD(c->space.Flink, space, list_entry);
         
@@ -5607,7 +6042,7 @@ static NTSTATUS add_root_item_to_cache(device_extension* Vcb, UINT64 root, PIRP
             return Status;
         }
     } else {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
     
     return STATUS_SUCCESS;
@@ -6062,8 +6497,9 @@ nextdev:
 
 static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
-    LIST_ENTRY *le, batchlist;
-    BOOL cache_changed = FALSE;
+    LIST_ENTRY *le, batchlist, batch_fcbs, dropped;
+    BOOL cache_changed = FALSE, parallel;
+    ULONG num_batch_fcbs = 0;
     volume_device_extension* vde;
 #ifdef DEBUG_FLUSH_TIMES
     UINT64 filerefs = 0, fcbs = 0;
@@ -6076,11 +6512,23 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     TRACE("(%p)\n", Vcb);
     
     InitializeListHead(&batchlist);
+    InitializeListHead(&batch_fcbs);
+    InitializeListHead(&dropped);
+    
+    parallel = Vcb->calcthreads.num_threads > 1;
 
 #ifdef DEBUG_FLUSH_TIMES
     time1 = KeQueryPerformanceCounter(&freq);
 #endif
     
+    release_alloc_clusters(Vcb);
+    
+    Status = flush_all_delalloc(Vcb, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("flush_all_delalloc returned %08x\n", Status);
+        return Status;
+    }
+    
     ExAcquireResourceExclusiveLite(&Vcb->dirty_filerefs_lock, TRUE);
     
     while (!IsListEmpty(&Vcb->dirty_filerefs)) {
@@ -6156,6 +6604,14 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         if (dirt->fcb->subvol != Vcb->root_root || dirt->fcb->deleted) {
             RemoveEntryList(le);
             
+            if (parallel && flush_fcb_batch_only(dirt->fcb)) {
+                InsertTailList(&batch_fcbs, &dirt->list_entry);
+                num_batch_fcbs++;
+                
+                le = le2;
+                continue;
+            }
+            
             ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
             Status = flush_fcb(dirt->fcb, FALSE, &batchlist, Irp);
             ExReleaseResourceLite(dirt->fcb->Header.Resource);
@@ -6175,6 +6631,46 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         le = le2;
     }
     
+    if (num_batch_fcbs > 0) {
+        if (num_batch_fcbs >= PARALLEL_FLUSH_MIN_FCBS)
+            Status = flush_fcbs_parallel(Vcb, &batch_fcbs, num_batch_fcbs, &batchlist);
+        else {
+            Status = STATUS_SUCCESS;
+            
+            le = batch_fcbs.Flink;
+            while (le != &batch_fcbs) {
+                dirty_fcb* dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
+                
+                ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
+                Status = flush_fcb(dirt->fcb, FALSE, &batchlist, Irp);
+                ExReleaseResourceLite(dirt->fcb->Header.Resource);
+                
+                if (!NT_SUCCESS(Status)) {
+                    ERR("flush_fcb returned %08x\n", Status);
+                    break;
+                }
+                
+                le = le->Flink;
+            }
+        }
+        
+        while (!IsListEmpty(&batch_fcbs)) {
+            dirty_fcb* dirt = CONTAINING_RECORD(RemoveHeadList(&batch_fcbs), dirty_fcb, list_entry);
+            
+            free_fcb(dirt->fcb);
+            ExFreePool(dirt);
+        }
+        
+        if (!NT_SUCCESS(Status)) {
+            ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
+            return Status;
+        }
+
+#ifdef DEBUG_FLUSH_TIMES
+        fcbs += num_batch_fcbs;
+#endif
+    }
+    
     ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
     
     commit_batch_list(Vcb, &batchlist, Irp);
@@ -6186,11 +6682,11 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
 #endif
 
     if (!IsListEmpty(&Vcb->drop_roots)) {
-        Status = drop_roots(Vcb, Irp, rollback);
+        Status = drop_roots(Vcb, &dropped, Irp, rollback);
         
         if (!NT_SUCCESS(Status)) {
             ERR("drop_roots returned %08x\n", Status);
-            return Status;
+            goto end;
         }
     }
     
@@ -6199,7 +6695,7 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         
         if (!NT_SUCCESS(Status)) {
             ERR("update_chunks returned %08x\n", Status);
-            return Status;
+            goto end;
         }
     }
     
@@ -6219,17 +6715,17 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("error - find_item returned %08x\n", Status);
-            return Status;
+            goto end;
         }
         
-        Vcb->root_root->treeholder.tree->write = TRUE;
+        mark_tree_dirty(Vcb->root_root->treeholder.tree);
     }
     
     // make sure we always update the extent tree
     Status = add_root_item_to_cache(Vcb, BTRFS_ROOT_EXTENT, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("add_root_item_to_cache returned %08x\n", Status);
-        return Status;
+        goto end;
     }
     
     do {
@@ -6328,7 +6824,8 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     }
 #endif
     
-    Vcb->superblock.cache_generation = Vcb->superblock.generation;
+    if (!Vcb->free_space_tree)
+        Vcb->superblock.cache_generation = Vcb->superblock.generation;
     
     if (!Vcb->options.no_barrier)
         flush_disk_caches(Vcb);
@@ -6359,19 +6856,12 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
     
     Status = STATUS_SUCCESS;
     
-    le = Vcb->trees.Flink;
-    while (le != &Vcb->trees) {
-        tree* t = CONTAINING_RECORD(le, tree, list_entry);
-
-        t->write = FALSE;
-        
-        le = le->Flink;
-    }
+    clear_dirty_trees(Vcb);
     
     Vcb->need_write = FALSE;
     
-    while (!IsListEmpty(&Vcb->drop_roots)) {
-        LIST_ENTRY* le = RemoveHeadList(&Vcb->drop_roots);
+    while (!IsListEmpty(&dropped)) {
+        LIST_ENTRY* le = RemoveHeadList(&dropped);
         root* r = CONTAINING_RECORD(le, root, list_entry);
 
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
@@ -6379,7 +6869,17 @@ static NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* r
         ExFreePool(r);
     }
     
+    // more to do - wake up the drop thread
+    if (!IsListEmpty(&Vcb->drop_roots))
+        KeSetEvent(&Vcb->drop_thread_event, 0, FALSE);
+    
 end:
+    // If the commit failed, the volume is about to go readonly - put anything we dropped back
+    // on drop_roots, so that uninit still frees it.
+    while (!IsListEmpty(&dropped)) {
+        InsertTailList(&Vcb->drop_roots, RemoveHeadList(&dropped));
+    }
+    
     TRACE("do_write returning %08x\n", Status);
     
     return Status;
@@ -6401,6 +6901,8 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp) {
     } else
         clear_rollback(Vcb, &rollback);
     
+    clear_extent_cache(Vcb);
+    
     return Status;
 }
 
@@ -6486,3 +6988,44 @@ void STDCALL flush_thread(void* context) {
     
     PsTerminateSystemThread(STATUS_SUCCESS);
 }
+
+void STDCALL drop_thread(void* context) {
+    DEVICE_OBJECT* devobj = context;
+    device_extension* Vcb = devobj->DeviceExtension;
+    
+    ObReferenceObject(devobj);
+    
+    // Deleted subvols are dropped a batch at a time by do_write, which wakes us up again if
+    // there's anything left. We release tree_lock between commits so that everybody else
+    // gets a look-in.
+    
+    while (TRUE) {
+        KeWaitForSingleObject(&Vcb->drop_thread_event, Executive, KernelMode, FALSE, NULL);
+        
+        if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
+            break;
+        
+        FsRtlEnterFileSystem();
+        
+        ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+        
+        if (!IsListEmpty(&Vcb->drop_roots) && !Vcb->readonly && !Vcb->locked && !Vcb->removing) {
+            NTSTATUS Status = do_write(Vcb, NULL);
+            
+            if (!NT_SUCCESS(Status))
+                ERR("do_write returned %08x\n", Status);
+            
+            free_trees(Vcb);
+        }
+        
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        
+        FsRtlExitFileSystem();
+    }
+    
+    ObDereferenceObject(devobj);
+    
+    KeSetEvent(&Vcb->drop_thread_finished, 0, FALSE);
+    
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
@@ -131,7 +131,224 @@ NTSTATUS clear_free_space_cache(device_extension* Vcb, LIST_ENTRY* batchlist, PI
     return Status;
 }
 
-NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset, UINT64 size) {
+#define space_node_height(n) ((n) ? (n)->height : 0)
+
+static __inline space* space_from_node(space_node* n, BOOL by_size) {
+    return by_size ? CONTAINING_RECORD(n, space, node_size) : CONTAINING_RECORD(n, space, node);
+}
+
+static int space_tree_cmp(space* s1, space* s2, BOOL by_size) {
+    if (by_size) {
+        if (s1->tree_size < s2->tree_size)
+            return -1;
+        else if (s1->tree_size > s2->tree_size)
+            return 1;
+    }
+    
+    if (s1->tree_address < s2->tree_address)
+        return -1;
+    else if (s1->tree_address > s2->tree_address)
+        return 1;
+    
+    return 0;
+}
+
+static void space_node_fix_height(space_node* n) {
+    int l = space_node_height(n->left), r = space_node_height(n->right);
+    
+    n->height = (l > r ? l : r) + 1;
+}
+
+static space_node* space_node_rotate_left(space_node* n) {
+    space_node* r = n->right;
+    
+    n->right = r->left;
+    r->left = n;
+    
+    space_node_fix_height(n);
+    space_node_fix_height(r);
+    
+    return r;
+}
+
+static space_node* space_node_rotate_right(space_node* n) {
+    space_node* l = n->left;
+    
+    n->left = l->right;
+    l->right = n;
+    
+    space_node_fix_height(n);
+    space_node_fix_height(l);
+    
+    return l;
+}
+
+static space_node* space_node_balance(space_node* n) {
+    int diff;
+    
+    space_node_fix_height(n);
+    
+    diff = space_node_height(n->left) - space_node_height(n->right);
+    
+    if (diff > 1) {
+        if (space_node_height(n->left->right) > space_node_height(n->left->left))
+            n->left = space_node_rotate_left(n->left);
+        
+        return space_node_rotate_right(n);
+    } else if (diff < -1) {
+        if (space_node_height(n->right->left) > space_node_height(n->right->right))
+            n->right = space_node_rotate_right(n->right);
+        
+        return space_node_rotate_left(n);
+    }
+    
+    return n;
+}
+
+static space_node* space_node_insert(space_node* root, space* s, BOOL by_size) {
+    if (!root) {
+        space_node* n = by_size ? &s->node_size : &s->node;
+        
+        n->left = n->right = NULL;
+        n->height = 1;
+        
+        return n;
+    }
+    
+    if (space_tree_cmp(s, space_from_node(root, by_size), by_size) < 0)
+        root->left = space_node_insert(root->left, s, by_size);
+    else
+        root->right = space_node_insert(root->right, s, by_size);
+    
+    return space_node_balance(root);
+}
+
+static space_node* space_node_remove_min(space_node* root, space_node** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    
+    root->left = space_node_remove_min(root->left, min);
+    
+    return space_node_balance(root);
+}
+
+static space_node* space_node_remove(space_node* root, space* s, BOOL by_size) {
+    space_node* n = by_size ? &s->node_size : &s->node;
+    
+    if (!root) {
+        ERR("could not find space entry %llx,%llx in tree\n", s->tree_address, s->tree_size);
+        return NULL;
+    }
+    
+    if (root == n) {
+        space_node *min, *right;
+        
+        if (!n->right)
+            return n->left;
+        
+        right = space_node_remove_min(n->right, &min);
+        
+        min->left = n->left;
+        min->right = right;
+        
+        return space_node_balance(min);
+    }
+    
+    if (space_tree_cmp(s, space_from_node(root, by_size), by_size) < 0)
+        root->left = space_node_remove(root->left, s, by_size);
+    else
+        root->right = space_node_remove(root->right, s, by_size);
+    
+    return space_node_balance(root);
+}
+
+// The trees are keyed on tree_address and tree_size rather than address and size, so that an entry
+// can still be found after it's been resized. Callers must call space_tree_update once they're done
+// changing an entry, and must take an entry out of the trees before another one can take its key.
+void space_tree_insert(space_tree* tree, space* s) {
+    s->tree_address = s->address;
+    s->tree_size = s->size;
+    
+    tree->root = space_node_insert(tree->root, s, FALSE);
+    tree->root_size = space_node_insert(tree->root_size, s, TRUE);
+}
+
+static void space_tree_remove(space_tree* tree, space* s) {
+    tree->root = space_node_remove(tree->root, s, FALSE);
+    tree->root_size = space_node_remove(tree->root_size, s, TRUE);
+}
+
+static void space_tree_update(space_tree* tree, space* s) {
+    space_tree_remove(tree, s);
+    space_tree_insert(tree, s);
+}
+
+// returns the entry with the highest address not after address
+space* space_tree_find_address(space_tree* tree, UINT64 address) {
+    space_node* n = tree->root;
+    space* ret = NULL;
+    
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node);
+        
+        if (s->tree_address <= address) {
+            ret = s;
+            n = n->right;
+        } else
+            n = n->left;
+    }
+    
+    return ret;
+}
+
+// returns the smallest entry at least length bytes long, picking the lowest address if there's a tie
+space* space_tree_find_size(space_tree* tree, UINT64 length) {
+    space_node* n = tree->root_size;
+    space* ret = NULL;
+    
+    while (n) {
+        space* s = CONTAINING_RECORD(n, space, node_size);
+        
+        if (s->tree_size >= length) {
+            ret = s;
+            n = n->left;
+        } else
+            n = n->right;
+    }
+    
+    return ret;
+}
+
+// returns the first entry in list which could overlap or touch address
+static LIST_ENTRY* space_list_start(LIST_ENTRY* list, space_tree* tree, UINT64 address) {
+    space* s;
+    LIST_ENTRY* le;
+    
+    if (!tree)
+        return list->Flink;
+    
+    s = space_tree_find_address(tree, address);
+    
+    if (!s)
+        return list->Flink;
+    
+    le = &s->list_entry;
+    
+    while (le->Blink != list) {
+        space* s2 = CONTAINING_RECORD(le->Blink, space, list_entry);
+        
+        if (s2->address + s2->size < address)
+            break;
+        
+        le = le->Blink;
+    }
+    
+    return le;
+}
+
+NTSTATUS add_space_entry(LIST_ENTRY* list, space_tree* tree, UINT64 offset, UINT64 size) {
     space* s;
     
     s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
@@ -151,7 +368,14 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
         
         if (s2->address < offset)
             InsertTailList(list, &s->list_entry);
-        else {
+        else if (tree) {
+            s2 = space_tree_find_address(tree, offset);
+            
+            if (s2)
+                InsertHeadList(&s2->list_entry, &s->list_entry);
+            else
+                InsertHeadList(list, &s->list_entry);
+        } else {
             LIST_ENTRY* le;
             
             le = list->Flink;
@@ -160,7 +384,7 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
                 
                 if (s2->address > offset) {
                     InsertTailList(le, &s->list_entry);
-                    goto size;
+                    break;
                 }
                 
                 le = le->Flink;
@@ -168,33 +392,8 @@ NTSTATUS add_space_entry(LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 offset,
         }
     }
     
-size:
-    if (!list_size)
-        return STATUS_SUCCESS;
-    
-    if (IsListEmpty(list_size))
-        InsertTailList(list_size, &s->list_entry_size);
-    else {
-        space* s2 = CONTAINING_RECORD(list_size->Blink, space, list_entry_size);
-        
-        if (s2->size >= size)
-            InsertTailList(list_size, &s->list_entry_size);
-        else {
-            LIST_ENTRY* le;
-            
-            le = list_size->Flink;
-            while (le != list_size) {
-                s2 = CONTAINING_RECORD(le, space, list_entry_size);
-                
-                if (s2->size <= size) {
-                    InsertHeadList(le->Blink, &s->list_entry_size);
-                    return STATUS_SUCCESS;
-                }
-                
-                le = le->Flink;
-            }
-        }
-    }
+    if (tree)
+        space_tree_insert(tree, s);
     
     return STATUS_SUCCESS;
 }
@@ -220,7 +419,7 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offse
         addr = offset + (index * Vcb->superblock.sector_size);
         length = Vcb->superblock.sector_size * runlength;
         
-        add_space_entry(&c->space, &c->space_size, addr, length);
+        add_space_entry(&c->space, &c->space_tree, addr, length);
         index += runlength;
         *total_space += length;
        
@@ -228,30 +427,6 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offse
     }
 }
 
-static void order_space_entry(space* s, LIST_ENTRY* list_size) {
-    LIST_ENTRY* le;
-    
-    if (IsListEmpty(list_size)) {
-        InsertHeadList(list_size, &s->list_entry_size);
-        return;
-    }
-    
-    le = list_size->Flink;
-    
-    while (le != list_size) {
-        space* s2 = CONTAINING_RECORD(le, space, list_entry_size);
-        
-        if (s2->size <= s->size) {
-            InsertHeadList(le->Blink, &s->list_entry_size);
-            return;
-        }
-        
-        le = le->Flink;
-    }
-    
-    InsertTailList(list_size, &s->list_entry_size);
-}
-
 typedef struct {
     UINT64 stripe;
     LIST_ENTRY list_entry;
@@ -397,6 +572,63 @@ end:
     return Status;
 }
 
+static void clear_cache_image(chunk* c) {
+    if (c->cache_image) {
+        ExFreePool(c->cache_image);
+        c->cache_image = NULL;
+    }
+    
+    c->cache_image_len = 0;
+    c->cache_image_inode = 0;
+}
+
+// Keeps a copy of what's now in the cache inode, so that next time we only have to write the sectors which
+// have changed. Anything after the last non-zero sector is zero on disk, so there's no need to keep it.
+static void set_cache_image(chunk* c, UINT8* data, UINT64 size, ULONG sector_size) {
+    UINT64 len = size;
+    
+    while (len > 0 && data[len - 1] == 0) {
+        len--;
+    }
+    
+    len = sector_align(len, sector_size);
+    
+    if (c->cache_image && c->cache_image_len != len)
+        clear_cache_image(c);
+    
+    if (!c->cache_image && len > 0) {
+        c->cache_image = ExAllocatePoolWithTag(PagedPool, len, ALLOC_TAG);
+        
+        if (!c->cache_image) {
+            ERR("out of memory\n");
+            clear_cache_image(c);
+            return;
+        }
+    }
+    
+    if (len > 0)
+        RtlCopyMemory(c->cache_image, data, len);
+    
+    c->cache_image_len = (ULONG)len;
+    c->cache_image_inode = c->cache->inode;
+    c->cache_image_size = size;
+}
+
+static BOOL cache_sector_changed(chunk* c, UINT8* data, UINT64 new_len, UINT64 sector, UINT64 header_sectors, ULONG sector_size) {
+    UINT64 off = sector * sector_size;
+    
+    if (sector < header_sectors)
+        return TRUE;
+    
+    if (off >= new_len && off >= c->cache_image_len)
+        return FALSE;
+    
+    if (off >= new_len || off >= c->cache_image_len)
+        return TRUE;
+    
+    return RtlCompareMemory(data + off, c->cache_image + off, sector_size) != sector_size;
+}
+
 static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp;
@@ -533,7 +765,7 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
         fse = (FREE_SPACE_ENTRY*)&data[off];
         
         if (fse->type == FREE_SPACE_EXTENT) {
-            Status = add_space_entry(&c->space, &c->space_size, fse->offset, fse->size);
+            Status = add_space_entry(&c->space, &c->space_tree, fse->offset, fse->size);
             if (!NT_SUCCESS(Status)) {
                 ERR("add_space_entry returned %08x\n", Status);
                 ExFreePool(data);
@@ -594,11 +826,10 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
                 s->size += s2->size;
                 
                 RemoveEntryList(&s2->list_entry);
-                RemoveEntryList(&s2->list_entry_size);
+                space_tree_remove(&c->space_tree, s2);
                 ExFreePool(s2);
                 
-                RemoveEntryList(&s->list_entry_size);
-                order_space_entry(s, &c->space_size);
+                space_tree_update(&c->space_tree, s);
                 
                 le2 = le;
             }
@@ -607,6 +838,8 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
         le = le2;
     }
     
+    set_cache_image(c, data, c->cache->inode_item.st_size, Vcb->superblock.sector_size);
+    
     ExFreePool(data);
     
     return STATUS_SUCCESS;
@@ -643,15 +876,111 @@ clearcache:
         LIST_ENTRY* le2 = le->Flink;
         
         RemoveEntryList(&s->list_entry);
-        RemoveEntryList(&s->list_entry_size);
         ExFreePool(s);
         
         le = le2;
     }
     
+    c->space_tree.root = NULL;
+    c->space_tree.root_size = NULL;
+    
     return STATUS_NOT_FOUND;
 }
 
+static void load_free_space_tree_bitmap(device_extension* Vcb, chunk* c, tree_data* item, UINT64* total_space) {
+    UINT64 i, num_bits, runstart = 0, runlength = 0;
+    UINT8* data = item->data;
+    
+    num_bits = item->key.offset / Vcb->superblock.sector_size;
+    
+    if (item->size < (num_bits + 7) / 8) {
+        WARN("(%llx,%x,%llx) was %u bytes, expected %llx\n", item->key.obj_id, item->key.obj_type, item->key.offset, item->size, (num_bits + 7) / 8);
+        num_bits = item->size * 8;
+    }
+    
+    // set bits are free sectors
+    for (i = 0; i < num_bits; i++) {
+        if (data[i / 8] & (1 << (i % 8))) {
+            if (runlength == 0)
+                runstart = i;
+            
+            runlength++;
+        } else if (runlength > 0) {
+            space_list_add2(Vcb, &c->space, &c->space_tree, item->key.obj_id + (runstart * Vcb->superblock.sector_size), runlength * Vcb->superblock.sector_size, NULL);
+            *total_space += runlength * Vcb->superblock.sector_size;
+            runlength = 0;
+        }
+    }
+    
+    if (runlength > 0) {
+        space_list_add2(Vcb, &c->space, &c->space_tree, item->key.obj_id + (runstart * Vcb->superblock.sector_size), runlength * Vcb->superblock.sector_size, NULL);
+        *total_space += runlength * Vcb->superblock.sector_size;
+    }
+}
+
+static NTSTATUS load_stored_free_space_tree(device_extension* Vcb, chunk* c, PIRP Irp) {
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    UINT64 total_space = 0, superblock_size;
+    NTSTATUS Status;
+    
+    TRACE("(%p, %llx)\n", Vcb, c->offset);
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_FREE_SPACE_INFO;
+    searchkey.offset = c->chunk_item->size;
+    
+    Status = find_item(Vcb, Vcb->space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(tp.item->key, searchkey)) {
+        WARN("(%llx,%x,%llx) not found in free space tree\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
+        return STATUS_NOT_FOUND;
+    }
+    
+    // The extents and bitmaps for the chunk follow its FREE_SPACE_INFO, and are keyed by address, so we can
+    // build c->space in order without sorting.
+    
+    while (find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
+        tp = next_tp;
+        
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
+        
+        if (tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT) {
+            space_list_add2(Vcb, &c->space, &c->space_tree, tp.item->key.obj_id, tp.item->key.offset, NULL);
+            total_space += tp.item->key.offset;
+        } else if (tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP)
+            load_free_space_tree_bitmap(Vcb, c, tp.item, &total_space);
+    }
+    
+    Status = get_superblock_size(c, &superblock_size);
+    if (!NT_SUCCESS(Status)) {
+        ERR("get_superblock_size returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (c->chunk_item->size - c->used != total_space + superblock_size) {
+        WARN("invalidating free space tree for chunk %llx: space was %llx, expected %llx\n", c->offset, total_space + superblock_size, c->chunk_item->size - c->used);
+        
+        while (!IsListEmpty(&c->space)) {
+            space* s = CONTAINING_RECORD(RemoveHeadList(&c->space), space, list_entry);
+            
+            ExFreePool(s);
+        }
+        
+        c->space_tree.root = NULL;
+        c->space_tree.root_size = NULL;
+        
+        return STATUS_NOT_FOUND;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     traverse_ptr tp, next_tp;
     KEY searchkey;
@@ -661,7 +990,18 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
     NTSTATUS Status;
 //     LIST_ENTRY* le;
     
-    if (Vcb->superblock.generation - 1 == Vcb->superblock.cache_generation) {
+    if (Vcb->free_space_tree) {
+        Status = load_stored_free_space_tree(Vcb, c, Irp);
+        
+        if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
+            ERR("load_stored_free_space_tree returned %08x\n", Status);
+            return Status;
+        }
+        
+        // make sure the tree gets rewritten for this chunk on the next flush
+        if (Status == STATUS_NOT_FOUND && !c->list_entry_changed.Flink)
+            InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
+    } else if (Vcb->superblock.generation - 1 == Vcb->superblock.cache_generation) {
         Status = load_stored_free_space_cache(Vcb, c, Irp);
         
         if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
@@ -703,7 +1043,7 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
                     s->size = tp.item->key.obj_id - lastaddr;
                     InsertTailList(&c->space, &s->list_entry);
                     
-                    order_space_entry(s, &c->space_size);
+                    space_tree_insert(&c->space_tree, s);
                     
                     TRACE("(%llx,%llx)\n", s->address, s->size);
                 }
@@ -731,15 +1071,15 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
             s->size = c->offset + c->chunk_item->size - lastaddr;
             InsertTailList(&c->space, &s->list_entry);
             
-            order_space_entry(s, &c->space_size);
+            space_tree_insert(&c->space_tree, s);
             
             TRACE("(%llx,%llx)\n", s->address, s->size);
         }
     }
     
-//     le = c->space_size.Flink;
-//     while (le != &c->space_size) {
-//         space* s = CONTAINING_RECORD(le, space, list_entry_size);
+//     le = c->space.Flink;
+//     while (le != &c->space) {
+//         space* s = CONTAINING_RECORD(le, space, list_entry);
 //         
 //         ERR("(%llx, %llx)\n", s->address, s->size);
 //         
@@ -750,12 +1090,16 @@ static NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp)
     return STATUS_SUCCESS;
 }
 
-NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
+static NTSTATUS load_cache_chunk2(device_extension* Vcb, chunk* c, BOOL background, PIRP Irp) {
     NTSTATUS Status;
+    LARGE_INTEGER time1, time2, freq;
+    UINT64 us;
     
     if (c->cache_loaded)
         return STATUS_SUCCESS;
     
+    time1 = KeQueryPerformanceCounter(&freq);
+    
     Status = load_free_space_cache(Vcb, c, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("load_free_space_cache returned %08x\n", Status);
@@ -765,10 +1109,87 @@ NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
     protect_superblocks(Vcb, c);
     
     c->cache_loaded = TRUE;
+    
+    time2 = KeQueryPerformanceCounter(NULL);
+    us = (time2.QuadPart - time1.QuadPart) * 1000000 / freq.QuadPart;
+    
+    TRACE("loaded free space for chunk %llx in %llu us (%s)\n", c->offset, us, background ? "background" : "on demand");
+    
+    InterlockedIncrement64(background ? &Vcb->counters.space_cache_loaded_bg : &Vcb->counters.space_cache_loaded);
+    InterlockedExchangeAdd64(&Vcb->counters.space_cache_load_time, (LONGLONG)us);
 
     return STATUS_SUCCESS;
 }
 
+NTSTATUS load_cache_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
+    return load_cache_chunk2(Vcb, c, FALSE, Irp);
+}
+
+void STDCALL space_loader_thread(void* context) {
+    DEVICE_OBJECT* devobj = context;
+    device_extension* Vcb = devobj->DeviceExtension;
+    UINT64 offset = 0;
+    BOOL data_pass = TRUE;
+    
+    ObReferenceObject(devobj);
+    
+    // Data chunks go first, as that's where the first writes after mount will end up. We remember
+    // how far we've got by offset, as we drop chunk_lock between chunks and new ones can be added.
+    
+    while (!Vcb->removing && devobj->Vpb->Flags & VPB_MOUNTED) {
+        LIST_ENTRY* le;
+        chunk* c = NULL;
+        
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+        ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+        
+        le = Vcb->chunks.Flink;
+        while (le != &Vcb->chunks) {
+            chunk* c2 = CONTAINING_RECORD(le, chunk, list_entry);
+            
+            if (c2->offset >= offset && !c2->cache_loaded && !c2->readonly && !c2->reloc &&
+                (c2->chunk_item->type & BLOCK_FLAG_DATA ? TRUE : FALSE) == data_pass && (!c || c2->offset < c->offset))
+                c = c2;
+            
+            le = le->Flink;
+        }
+        
+        ExReleaseResourceLite(&Vcb->chunk_lock);
+        
+        if (!c) {
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            
+            if (!data_pass)
+                break;
+            
+            data_pass = FALSE;
+            offset = 0;
+            continue;
+        }
+        
+        offset = c->offset + 1;
+        
+        // If somebody else has the chunk locked, they'll load it themselves if they need it.
+        if (ExAcquireResourceExclusiveLite(&c->lock, FALSE)) {
+            NTSTATUS Status = load_cache_chunk2(Vcb, c, TRUE, NULL);
+            if (!NT_SUCCESS(Status))
+                WARN("load_cache_chunk2 returned %08x for chunk %llx\n", Status, c->offset);
+            
+            ExReleaseResourceLite(&c->lock);
+        }
+        
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    }
+    
+    Vcb->space_thread_running = FALSE;
+    
+    ObDereferenceObject(devobj);
+    
+    KeSetEvent(&Vcb->space_thread_finished, 0, FALSE);
+    
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
 static NTSTATUS insert_cache_extent(fcb* fcb, UINT64 start, UINT64 length, LIST_ENTRY* rollback) {
     LIST_ENTRY* le = fcb->Vcb->chunks.Flink;
     chunk* c;
@@ -1030,7 +1451,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
         
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
 
         // remove existing extents
         
@@ -1061,6 +1482,9 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             }
         }
         
+        // the new extent is preallocated, so what we remember of the old contents is no use
+        clear_cache_image(c);
+        
         // add new extent
         
         Status = insert_cache_extent(c->cache, 0, new_cache_size, rollback);
@@ -1116,7 +1540,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
                 return STATUS_INTERNAL_ERROR;
             }
             
-            tp.tree->write = TRUE;
+            mark_tree_dirty(tp.tree);
         }
 
         searchkey.obj_id = FREE_SPACE_CACHE_ID;
@@ -1139,7 +1563,7 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
             return STATUS_INTERNAL_ERROR;
         }
         
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
     }
     
     // FIXME - reduce inode allocation if cache is shrinking. Make sure to avoid infinite write loops
@@ -1147,6 +1571,208 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
     return STATUS_SUCCESS;
 }
 
+// Returns the next run of free space in the chunk, treating anything freed in this transaction as free.
+static BOOL next_free_run(chunk* c, LIST_ENTRY** le1, LIST_ENTRY** le2, UINT64* address, UINT64* length) {
+    BOOL found = FALSE;
+    UINT64 end = 0;
+    
+    while (TRUE) {
+        LIST_ENTRY** le;
+        space* s;
+        
+        if (*le1 != &c->space && (*le2 == &c->deleting ||
+            CONTAINING_RECORD(*le1, space, list_entry)->address <= CONTAINING_RECORD(*le2, space, list_entry)->address))
+            le = le1;
+        else if (*le2 != &c->deleting)
+            le = le2;
+        else
+            break;
+        
+        s = CONTAINING_RECORD(*le, space, list_entry);
+        
+        if (!found) {
+            *address = s->address;
+            end = s->address + s->size;
+            found = TRUE;
+        } else if (s->address <= end)
+            end = max(end, s->address + s->size);
+        else
+            break;
+        
+        *le = (*le)->Flink;
+    }
+    
+    if (found)
+        *length = end - *address;
+    
+    return found;
+}
+
+static NTSTATUS insert_free_space_extent(device_extension* Vcb, UINT64 address, UINT64 length, PIRP Irp) {
+    NTSTATUS Status;
+    
+    Status = insert_tree_item(Vcb, Vcb->space_root, address, TYPE_FREE_SPACE_EXTENT, length, NULL, 0, NULL, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("insert_tree_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// Brings the chunk's part of the free space tree into line with c->space and c->deleting. Items which
+// are already right are left alone, so only the leaves covering ranges which have changed get COWed.
+// Bitmaps are converted to extents, which Linux is happy to read back.
+static NTSTATUS update_free_space_tree_chunk(device_extension* Vcb, chunk* c, BOOL* changed, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    LIST_ENTRY *le1, *le2;
+    UINT64 address, length;
+    UINT32 count;
+    BOOL have_run, b;
+    FREE_SPACE_INFO* fsi;
+    
+    *changed = FALSE;
+    
+    if (!c->cache_loaded)
+        return STATUS_SUCCESS;
+    
+    count = 0;
+    le1 = c->space.Flink;
+    le2 = c->deleting.Flink;
+    
+    while (next_free_run(c, &le1, &le2, &address, &length)) {
+        count++;
+    }
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_FREE_SPACE_INFO;
+    searchkey.offset = c->chunk_item->size;
+    
+    Status = find_item(Vcb, Vcb->space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (keycmp(tp.item->key, searchkey) || tp.item->size < sizeof(FREE_SPACE_INFO) ||
+        ((FREE_SPACE_INFO*)tp.item->data)->count != count || ((FREE_SPACE_INFO*)tp.item->data)->flags != 0) {
+        if (!keycmp(tp.item->key, searchkey)) {
+            Status = delete_tree_item(Vcb, &tp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delete_tree_item returned %08x\n", Status);
+                return Status;
+            }
+        }
+        
+        fsi = ExAllocatePoolWithTag(PagedPool, sizeof(FREE_SPACE_INFO), ALLOC_TAG);
+        if (!fsi) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        fsi->count = count;
+        fsi->flags = 0;
+        
+        Status = insert_tree_item(Vcb, Vcb->space_root, searchkey.obj_id, searchkey.obj_type, searchkey.offset, fsi, sizeof(FREE_SPACE_INFO), &tp, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("insert_tree_item returned %08x\n", Status);
+            ExFreePool(fsi);
+            return Status;
+        }
+        
+        *changed = TRUE;
+    }
+    
+    // walk the existing items and the free space list side by side
+    
+    le1 = c->space.Flink;
+    le2 = c->deleting.Flink;
+    have_run = next_free_run(c, &le1, &le2, &address, &length);
+    
+    b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+    while (b) {
+        tp = next_tp;
+        
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
+        
+        if (tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT || tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP) {
+            while (have_run && address < tp.item->key.obj_id) {
+                Status = insert_free_space_extent(Vcb, address, length, Irp);
+                if (!NT_SUCCESS(Status))
+                    return Status;
+                
+                *changed = TRUE;
+                have_run = next_free_run(c, &le1, &le2, &address, &length);
+            }
+            
+            if (have_run && tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT && tp.item->key.obj_id == address && tp.item->key.offset == length)
+                have_run = next_free_run(c, &le1, &le2, &address, &length);
+            else {
+                Status = delete_tree_item(Vcb, &tp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("delete_tree_item returned %08x\n", Status);
+                    return Status;
+                }
+                
+                *changed = TRUE;
+            }
+        }
+        
+        b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+    }
+    
+    while (have_run) {
+        Status = insert_free_space_extent(Vcb, address, length, Irp);
+        if (!NT_SUCCESS(Status))
+            return Status;
+        
+        *changed = TRUE;
+        have_run = next_free_run(c, &le1, &le2, &address, &length);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS remove_free_space_tree_chunk(device_extension* Vcb, chunk* c, PIRP Irp) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    BOOL b;
+    
+    searchkey.obj_id = c->offset;
+    searchkey.obj_type = TYPE_FREE_SPACE_INFO;
+    searchkey.offset = 0;
+    
+    Status = find_item(Vcb, Vcb->space_root, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    do {
+        if (tp.item->key.obj_id >= c->offset + c->chunk_item->size)
+            break;
+        
+        if (tp.item->key.obj_id >= c->offset && (tp.item->key.obj_type == TYPE_FREE_SPACE_INFO ||
+            tp.item->key.obj_type == TYPE_FREE_SPACE_EXTENT || tp.item->key.obj_type == TYPE_FREE_SPACE_BITMAP)) {
+            Status = delete_tree_item(Vcb, &tp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("delete_tree_item returned %08x\n", Status);
+                return Status;
+            }
+        }
+        
+        b = find_next_item(Vcb, &tp, &next_tp, FALSE, Irp);
+        if (b)
+            tp = next_tp;
+    } while (b);
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY *le = Vcb->chunks_changed.Flink, batchlist;
     NTSTATUS Status;
@@ -1160,14 +1786,21 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
         chunk* c = CONTAINING_RECORD(le, chunk, list_entry_changed);
 
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        Status = allocate_cache_chunk(Vcb, c, &b, &batchlist, Irp, rollback);
+        
+        // With the free space tree, this is also where we write it - it has to happen before the trees are
+        // allocated, as changing it can dirty more trees.
+        if (Vcb->free_space_tree)
+            Status = update_free_space_tree_chunk(Vcb, c, &b, Irp);
+        else
+            Status = allocate_cache_chunk(Vcb, c, &b, &batchlist, Irp, rollback);
+        
         ExReleaseResourceLite(&c->lock);
         
         if (b)
             *changed = TRUE;
         
         if (!NT_SUCCESS(Status)) {
-            ERR("allocate_cache_chunk(%llx) returned %08x\n", c->offset, Status);
+            ERR("updating cache for chunk %llx returned %08x\n", c->offset, Status);
             clear_batch_list(Vcb, &batchlist);
             return Status;
         }
@@ -1180,7 +1813,7 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
     return STATUS_SUCCESS;
 }
 
-static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c) {
+void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c) {
     rollback_space* rs;
     
     rs = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_space), ALLOC_TAG);
@@ -1190,7 +1823,7 @@ static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list,
     }
     
     rs->list = list;
-    rs->list_size = list_size;
+    rs->tree = tree;
     rs->address = address;
     rs->length = length;
     rs->chunk = c;
@@ -1198,7 +1831,7 @@ static void add_rollback_space(LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list,
     add_rollback(rollback, add ? ROLLBACK_ADD_SPACE : ROLLBACK_SUBTRACT_SPACE, rs);
 }
 
-void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
+void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
     LIST_ENTRY* le;
     space *s, *s2;
     
@@ -1218,16 +1851,16 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
         s->size = length;
         InsertTailList(list, &s->list_entry);
         
-        if (list_size)
-            InsertTailList(list_size, &s->list_entry_size);
+        if (tree)
+            space_tree_insert(tree, s);
         
         if (rollback)
-            add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+            add_rollback_space(rollback, TRUE, list, tree, address, length, c);
         
         return;
     }
     
-    le = list->Flink;
+    le = space_list_start(list, tree, address);
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         
@@ -1239,7 +1872,7 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
         if (address <= s2->address && address + length >= s2->address + s2->size) {
             if (address < s2->address) {
                 if (rollback)
-                    add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
+                    add_rollback_space(rollback, TRUE, list, tree, address, s2->address - address, c);
                 
                 s2->size += s2->address - address;
                 s2->address = address;
@@ -1253,8 +1886,8 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
                         
                         RemoveEntryList(&s3->list_entry);
                         
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        if (tree)
+                            space_tree_remove(tree, s3);
                         
                         ExFreePool(s3);
                     } else
@@ -1264,7 +1897,7 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
             
             if (length > s2->size) {
                 if (rollback)
-                    add_rollback_space(rollback, TRUE, list, list_size, s2->address + s2->size, address + length - s2->address - s2->size, c);
+                    add_rollback_space(rollback, TRUE, list, tree, s2->address + s2->size, address + length - s2->address - s2->size, c);
                 
                 s2->size = length;
                 
@@ -1276,8 +1909,8 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
                         
                         RemoveEntryList(&s3->list_entry);
                         
-                        if (list_size)
-                            RemoveEntryList(&s3->list_entry_size);
+                        if (tree)
+                            space_tree_remove(tree, s3);
                         
                         ExFreePool(s3);
                     } else
@@ -1285,10 +1918,8 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
                 }
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(tree, s2);
             
             return;
         }
@@ -1296,7 +1927,7 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
         // new entry overlaps start of old one
         if (address < s2->address && address + length >= s2->address) {
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, s2->address - address, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, s2->address - address, c);
             
             s2->size += s2->address - address;
             s2->address = address;
@@ -1310,18 +1941,16 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
                     
                     RemoveEntryList(&s3->list_entry);
                     
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    if (tree)
+                        space_tree_remove(tree, s3);
                     
                     ExFreePool(s3);
                 } else
                     break;
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(tree, s2);
             
             return;
         }
@@ -1329,7 +1958,7 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
         // new entry overlaps end of old one
         if (address <= s2->address + s2->size && address + length > s2->address + s2->size) {
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, s2->address + s2->size - address, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, s2->address + s2->size - address, c);
             
             s2->size = address + length - s2->address;
             
@@ -1341,18 +1970,16 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
                     
                     RemoveEntryList(&s3->list_entry);
                     
-                    if (list_size)
-                        RemoveEntryList(&s3->list_entry_size);
+                    if (tree)
+                        space_tree_remove(tree, s3);
                     
                     ExFreePool(s3);
                 } else
                     break;
             }
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(tree, s2);
             
             return;
         }
@@ -1367,14 +1994,14 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
             }
             
             if (rollback)
-                add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+                add_rollback_space(rollback, TRUE, list, tree, address, length, c);
             
             s->address = address;
             s->size = length;
             InsertHeadList(s2->list_entry.Blink, &s->list_entry);
             
-            if (list_size)
-                order_space_entry(s, list_size);
+            if (tree)
+                space_tree_insert(tree, s);
             
             return;
         }
@@ -1383,13 +2010,13 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
     }
     
     // check if contiguous with last entry
+    s2 = CONTAINING_RECORD(list->Blink, space, list_entry);
+    
     if (s2->address + s2->size == address) {
         s2->size += length;
         
-        if (list_size) {
-            RemoveEntryList(&s2->list_entry_size);
-            order_space_entry(s2, list_size);
-        }
+        if (tree)
+            space_tree_update(tree, s2);
         
         return;
     }
@@ -1406,14 +2033,14 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
     s->size = length;
     InsertTailList(list, &s->list_entry);
     
-    if (list_size)
-        order_space_entry(s, list_size);
+    if (tree)
+        space_tree_insert(tree, s);
     
     if (rollback)
-        add_rollback_space(rollback, TRUE, list, list_size, address, length, c);
+        add_rollback_space(rollback, TRUE, list, tree, address, length, c);
 }
 
-static void space_list_merge(device_extension* Vcb, LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting) {
+static void space_list_merge(device_extension* Vcb, LIST_ENTRY* spacelist, space_tree* tree, LIST_ENTRY* deleting) {
     LIST_ENTRY* le;
     
     if (!IsListEmpty(deleting)) {
@@ -1421,7 +2048,7 @@ static void space_list_merge(device_extension* Vcb, LIST_ENTRY* spacelist, LIST_
         while (le != deleting) {
             space* s = CONTAINING_RECORD(le, space, list_entry);
             
-            space_list_add2(Vcb, spacelist, spacelist_size, s->address, s->size, NULL);
+            space_list_add2(Vcb, spacelist, tree, s->address, s->size, NULL);
             
             le = le->Flink;
         }
@@ -1435,11 +2062,12 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     FREE_SPACE_ITEM* fsi;
     void* data;
     FREE_SPACE_ENTRY* fse;
-    UINT64 num_entries, num_sectors, *cachegen, i, off;
+    UINT64 num_entries, num_sectors, *cachegen, i, j, off, header_sectors, written;
     UINT32* checksums;
     LIST_ENTRY* le;
+    BOOL incremental;
     
-    space_list_merge(Vcb, &c->space, &c->space_size, &c->deleting);
+    space_list_merge(Vcb, &c->space, &c->space_tree, &c->deleting);
     
     data = ExAllocatePoolWithTag(NonPagedPool, c->cache->inode_item.st_size, ALLOC_TAG);
     if (!data) {
@@ -1518,14 +2146,24 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     cachegen = (UINT64*)((UINT8*)data + (sizeof(UINT32) * num_sectors));
     *cachegen = Vcb->superblock.generation;
     
+    // The sectors holding the checksums and the generation change every time, but if we know what's already
+    // on disk, the other sectors only need checksumming and writing if their entries have changed.
+    
+    header_sectors = sector_align((sizeof(UINT32) * num_sectors) + sizeof(UINT64), Vcb->superblock.sector_size) / Vcb->superblock.sector_size;
+    
+    incremental = c->cache_image_inode == c->cache->inode && c->cache_image_size == c->cache->inode_item.st_size;
+    
+    off = sector_align(off, Vcb->superblock.sector_size);
+    
     // calculate cache checksums
     
     checksums = (UINT32*)data;
     
-    // FIXME - if we know sector is fully zeroed, use cached checksum
-    
     for (i = 0; i < num_sectors; i++) {
-        if (i * Vcb->superblock.sector_size > sizeof(UINT32) * num_sectors)
+        if (incremental && (i + 1) * sizeof(UINT32) <= c->cache_image_len &&
+            !cache_sector_changed(c, data, off, i, header_sectors, Vcb->superblock.sector_size))
+            checksums[i] = ((UINT32*)c->cache_image)[i];
+        else if (i * Vcb->superblock.sector_size > sizeof(UINT32) * num_sectors)
             checksums[i] = ~calc_crc32c(0xffffffff, (UINT8*)data + (i * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
         else if ((i + 1) * Vcb->superblock.sector_size < sizeof(UINT32) * num_sectors)
             checksums[i] = 0; // FIXME - test this
@@ -1535,11 +2173,49 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     
     // write cache
     
-    Status = do_write_file(c->cache, 0, c->cache->inode_item.st_size, data, NULL, FALSE, 0, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_write_file returned %08x\n", Status);
-        return Status;
+    written = 0;
+    
+    if (!incremental) {
+        Status = do_write_file(c->cache, 0, c->cache->inode_item.st_size, data, NULL, FALSE, 0, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write_file returned %08x\n", Status);
+            clear_cache_image(c);
+            ExFreePool(data);
+            return Status;
+        }
+        
+        written = c->cache->inode_item.st_size;
+    } else {
+        i = 0;
+        while (i < num_sectors) {
+            if (!cache_sector_changed(c, data, off, i, header_sectors, Vcb->superblock.sector_size)) {
+                i++;
+                continue;
+            }
+            
+            j = i + 1;
+            while (j < num_sectors && cache_sector_changed(c, data, off, j, header_sectors, Vcb->superblock.sector_size)) {
+                j++;
+            }
+            
+            Status = do_write_file(c->cache, i * Vcb->superblock.sector_size, j * Vcb->superblock.sector_size,
+                                   (UINT8*)data + (i * Vcb->superblock.sector_size), NULL, FALSE, 0, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("do_write_file returned %08x\n", Status);
+                clear_cache_image(c);
+                ExFreePool(data);
+                return Status;
+            }
+            
+            written += (j - i) * Vcb->superblock.sector_size;
+            i = j;
+        }
     }
+    
+    Vcb->counters.space_cache_written += written;
+    Vcb->counters.space_cache_skipped += c->cache->inode_item.st_size - written;
+    
+    set_cache_image(c, data, c->cache->inode_item.st_size, Vcb->superblock.sector_size);
 
     ExFreePool(data);
     
@@ -1562,7 +2238,14 @@ NTSTATUS update_chunk_caches(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollba
         c = CONTAINING_RECORD(le, chunk, list_entry_changed);
         
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
-        Status = update_chunk_cache(Vcb, c, &now, &batchlist, Irp, rollback);
+        
+        // the free space tree has already been written by allocate_cache
+        if (Vcb->free_space_tree) {
+            space_list_merge(Vcb, &c->space, &c->space_tree, &c->deleting);
+            Status = STATUS_SUCCESS;
+        } else
+            Status = update_chunk_cache(Vcb, c, &now, &batchlist, Irp, rollback);
+        
         ExReleaseResourceLite(&c->lock);
 
         if (!NT_SUCCESS(Status)) {
@@ -1589,10 +2272,10 @@ void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 addr
     if (!c->list_entry_changed.Flink)
         InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
     
-    _space_list_add2(Vcb, list, deleting ? NULL : &c->space_size, address, length, c, rollback, func);
+    _space_list_add2(Vcb, list, deleting ? NULL : &c->space_tree, address, length, c, rollback, func);
 }
 
-void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
+void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, space_tree* tree, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
     LIST_ENTRY *le, *le2;
     space *s, *s2;
     
@@ -1603,7 +2286,7 @@ void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY*
     if (IsListEmpty(list))
         return;
     
-    le = list->Flink;
+    le = space_list_start(list, tree, address);
     while (le != list) {
         s2 = CONTAINING_RECORD(le, space, list_entry);
         le2 = le->Flink;
@@ -1613,18 +2296,18 @@ void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY*
         
         if (s2->address >= address && s2->address + s2->size <= address + length) { // remove entry entirely
             if (rollback)
-                add_rollback_space(rollback, FALSE, list, list_size, s2->address, s2->size, c);
+                add_rollback_space(rollback, FALSE, list, tree, s2->address, s2->size, c);
             
             RemoveEntryList(&s2->list_entry);
             
-            if (list_size)
-                RemoveEntryList(&s2->list_entry_size);
+            if (tree)
+                space_tree_remove(tree, s2);
             
             ExFreePool(s2);
         } else if (address + length > s2->address && address + length < s2->address + s2->size) {
             if (address > s2->address) { // cut out hole
                 if (rollback)
-                    add_rollback_space(rollback, FALSE, list, list_size, address, length, c);
+                    add_rollback_space(rollback, FALSE, list, tree, address, length, c);
                 
                 s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
 
@@ -1640,35 +2323,30 @@ void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY*
                 s2->size = s2->address + s2->size - address - length;
                 s2->address = address + length;
                 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                    order_space_entry(s, list_size);
+                if (tree) {
+                    space_tree_update(tree, s2);
+                    space_tree_insert(tree, s);
                 }
                 
                 return;
             } else { // remove start of entry
                 if (rollback)
-                    add_rollback_space(rollback, FALSE, list, list_size, s2->address, address + length - s2->address, c);
+                    add_rollback_space(rollback, FALSE, list, tree, s2->address, address + length - s2->address, c);
                 
                 s2->size -= address + length - s2->address;
                 s2->address = address + length;
                 
-                if (list_size) {
-                    RemoveEntryList(&s2->list_entry_size);
-                    order_space_entry(s2, list_size);
-                }
+                if (tree)
+                    space_tree_update(tree, s2);
             }
         } else if (address > s2->address && address < s2->address + s2->size) { // remove end of entry
             if (rollback)
-                add_rollback_space(rollback, FALSE, list, list_size, address, s2->address + s2->size - address, c);
+                add_rollback_space(rollback, FALSE, list, tree, address, s2->address + s2->size - address, c);
             
             s2->size = address - s2->address;
             
-            if (list_size) {
-                RemoveEntryList(&s2->list_entry_size);
-                order_space_entry(s2, list_size);
-            }
+            if (tree)
+                space_tree_update(tree, s2);
         }
         
         le = le2;
@@ -1683,5 +2361,5 @@ void _space_list_subtract(device_extension* Vcb, chunk* c, BOOL deleting, UINT64
     if (!c->list_entry_changed.Flink)
         InsertTailList(&Vcb->chunks_changed, &c->list_entry_changed);
     
-    _space_list_subtract2(Vcb, list, deleting ? NULL : &c->space_size, address, length, c, rollback, func);
+    _space_list_subtract2(Vcb, list, deleting ? NULL : &c->space_tree, address, length, c, rollback, func);
 }
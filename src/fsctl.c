@@ -74,190 +74,301 @@ static void get_uuid(BTRFS_UUID* uuid) {
     }
 }
 
-static NTSTATUS snapshot_tree_copy(device_extension* Vcb, UINT64 addr, root* subvol, UINT64* newaddr, PIRP Irp, LIST_ENTRY* rollback) {
-    UINT8* buf;
+static NTSTATUS snapshot_tree_copy(device_extension* Vcb, root* subvol, root* r, PIRP Irp) {
     NTSTATUS Status;
-    write_data_context* wtc;
+    tree *src = subvol->treeholder.tree, *t;
     LIST_ENTRY* le;
-    tree t;
-    tree_header* th;
-    chunk* c;
     
-    buf = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
-    if (!buf) {
+    // The new root starts off as an in-memory copy of the subvol's top node, which
+    // gets written out along with everything else at the next commit.
+    
+    t = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
+    if (!t) {
         ERR("out of memory\n");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     
-    wtc = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_data_context), ALLOC_TAG);
-    if (!wtc) {
-        ERR("out of memory\n");
-        ExFreePool(buf);
-        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlCopyMemory(&t->header, &src->header, sizeof(tree_header));
+    t->header.address = 0;
+    t->header.generation = Vcb->superblock.generation;
+    t->header.tree_id = r->id;
+    t->header.num_items = 0;
+    t->header.flags = HEADER_FLAG_MIXED_BACKREF | HEADER_FLAG_WRITTEN;
+    
+    t->has_address = FALSE;
+    t->size = 0;
+    t->Vcb = Vcb;
+    t->parent = NULL;
+    t->paritem = NULL;
+    t->root = r;
+    t->new_address = 0;
+    t->has_new_address = FALSE;
+    t->updated_extents = FALSE;
+    t->write = FALSE;
+    t->uniqueness_determined = TRUE;
+    t->is_unique = TRUE;
+    t->list_entry_hash.Flink = NULL;
+    t->buf = NULL;
+    InitializeListHead(&t->itemlist);
+    
+    le = src->itemlist.Flink;
+    while (le != &src->itemlist) {
+        tree_data* td = CONTAINING_RECORD(le, tree_data, list_entry);
+        
+        if (!td->ignore) {
+            tree_data* td2 = ExAllocateFromPagedLookasideList(&Vcb->tree_data_lookaside);
+            if (!td2) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
+            }
+            
+            td2->key = td->key;
+            td2->ignore = FALSE;
+            
+            if (t->header.level == 0) {
+                td2->size = td->size;
+                td2->inserted = TRUE;
+                
+                if (td->size > 0) {
+                    td2->data = ExAllocatePoolWithTag(PagedPool, td->size, ALLOC_TAG);
+                    if (!td2->data) {
+                        ERR("out of memory\n");
+                        ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, td2);
+                        Status = STATUS_INSUFFICIENT_RESOURCES;
+                        goto end;
+                    }
+                    
+                    RtlCopyMemory(td2->data, td->data, td->size);
+                } else
+                    td2->data = NULL;
+                
+                t->size += td->size + sizeof(leaf_node);
+            } else {
+                td2->treeholder.address = td->treeholder.address;
+                td2->treeholder.generation = td->treeholder.generation;
+                td2->treeholder.tree = NULL;
+                td2->inserted = FALSE;
+                
+                t->size += sizeof(internal_node);
+            }
+            
+            InsertTailList(&t->itemlist, &td2->list_entry);
+            t->header.num_items++;
+            
+            if (t->header.level == 0) {
+                if (td->key.obj_type == TYPE_EXTENT_DATA && td->size >= sizeof(EXTENT_DATA)) {
+                    EXTENT_DATA* ed = (EXTENT_DATA*)td->data;
+                    
+                    if ((ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) && td->size >= sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
+                        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ed->data[0];
+                        
+                        if (ed2->size != 0) { // not sparse
+                            Status = increase_extent_refcount_data(Vcb, ed2->address, ed2->size, r->id, td->key.obj_id, td->key.offset - ed2->offset, 1, Irp);
+                            
+                            if (!NT_SUCCESS(Status)) {
+                                ERR("increase_extent_refcount_data returned %08x\n", Status);
+                                goto end;
+                            }
+                        }
+                    }
+                }
+            } else {
+                TREE_BLOCK_REF tbr;
+                
+                tbr.offset = r->id;
+                
+                Status = increase_extent_refcount(Vcb, td->treeholder.address, Vcb->superblock.node_size, TYPE_TREE_BLOCK_REF, &tbr, NULL, t->header.level - 1, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("increase_extent_refcount returned %08x\n", Status);
+                    goto end;
+                }
+            }
+        }
+        
+        le = le->Flink;
     }
     
-    wtc->parity1 = wtc->parity2 = wtc->scratch = NULL;
-    wtc->mdl = wtc->parity1_mdl = wtc->parity2_mdl = NULL;
+    InterlockedIncrement(&Vcb->open_trees);
+    InsertTailList(&Vcb->trees, &t->list_entry);
     
-    Status = read_data(Vcb, addr, Vcb->superblock.node_size, NULL, TRUE, buf, NULL, NULL, Irp, 0, FALSE, 0);
-    if (!NT_SUCCESS(Status)) {
-        ERR("read_data returned %08x\n", Status);
-        goto end;
-    }
+    r->treeholder.tree = t;
     
-    th = (tree_header*)buf;
+    mark_tree_dirty(t);
+    Vcb->need_write = TRUE;
     
-    RtlZeroMemory(&t, sizeof(tree));
-    t.root = subvol;
-    t.header.level = th->level;
-    t.header.tree_id = t.root->id;
+    return STATUS_SUCCESS;
     
-    Status = get_tree_new_address(Vcb, &t, Irp, rollback);
-    if (!NT_SUCCESS(Status)) {
-        ERR("get_tree_new_address returned %08x\n", Status);
-        goto end;
+end:
+    while (!IsListEmpty(&t->itemlist)) {
+        tree_data* td = CONTAINING_RECORD(RemoveHeadList(&t->itemlist), tree_data, list_entry);
+        
+        if (t->header.level == 0 && td->data)
+            ExFreePool(td->data);
+        
+        ExFreeToPagedLookasideList(&Vcb->tree_data_lookaside, td);
     }
     
-    if (!t.has_new_address) {
-        ERR("tree new address not set\n");
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+    ExFreePool(t);
+    
+    return Status;
+}
+
+static void flush_subvol_fcbs(device_extension* Vcb, root* subvol) {
+    LIST_ENTRY* le;
+    struct _fcb** fcbs;
+    ULONG num_fcbs = 0, i;
+    
+    // We only hold fcb_lock while taking references - the paging writes from CcFlushCache acquire
+    // the fcbs' Header.Resource, and a thread which has that may itself be waiting for fcb_lock.
+    
+    ExAcquireResourceSharedLite(&Vcb->fcb_lock, TRUE);
+    
+    le = subvol->fcbs.Flink;
+    while (le != &subvol->fcbs) {
+        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+        
+        if (fcb->type != BTRFS_TYPE_DIRECTORY && !fcb->deleted)
+            num_fcbs++;
+        
+        le = le->Flink;
     }
     
-    c = get_chunk_from_address(Vcb, t.new_address);
-            
-    if (c)
-        c->used += Vcb->superblock.node_size;
-    else {
-        ERR("could not find chunk for address %llx\n", t.new_address);
-        Status = STATUS_INTERNAL_ERROR;
-        goto end;
+    if (num_fcbs == 0) {
+        ExReleaseResourceLite(&Vcb->fcb_lock);
+        return;
     }
     
-    th->address = t.new_address;
-    th->tree_id = subvol->id;
-    th->generation = Vcb->superblock.generation;
-    th->fs_uuid = Vcb->superblock.uuid;
+    fcbs = ExAllocatePoolWithTag(PagedPool, sizeof(struct _fcb*) * num_fcbs, ALLOC_TAG);
+    if (!fcbs) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->fcb_lock);
+        return;
+    }
     
-    if (th->level == 0) {
-        UINT32 i;
-        leaf_node* ln = (leaf_node*)&th[1];
-        
-        for (i = 0; i < th->num_items; i++) {
-            if (ln[i].key.obj_type == TYPE_EXTENT_DATA && ln[i].size >= sizeof(EXTENT_DATA) && ln[i].offset + ln[i].size <= Vcb->superblock.node_size - sizeof(tree_header)) {
-                EXTENT_DATA* ed = (EXTENT_DATA*)(((UINT8*)&th[1]) + ln[i].offset);
-                
-                if ((ed->type == EXTENT_TYPE_REGULAR || ed->type == EXTENT_TYPE_PREALLOC) && ln[i].size >= sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2)) {
-                    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ed->data[0];
-                    
-                    if (ed2->size != 0) { // not sparse
-                        Status = increase_extent_refcount_data(Vcb, ed2->address, ed2->size, subvol->id, ln[i].key.obj_id, ln[i].key.offset - ed2->offset, 1, Irp);
-                        
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("increase_extent_refcount_data returned %08x\n", Status);
-                            goto end;
-                        }
-                    }
-                }
-            }
-        }
-    } else {
-        UINT32 i;
-        internal_node* in = (internal_node*)&th[1];
+    i = 0;
+    le = subvol->fcbs.Flink;
+    while (le != &subvol->fcbs) {
+        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
         
-        for (i = 0; i < th->num_items; i++) {
-            TREE_BLOCK_REF tbr;
+        if (fcb->type != BTRFS_TYPE_DIRECTORY && !fcb->deleted) {
+#ifdef DEBUG_FCB_REFCOUNTS
+            LONG rc = InterlockedIncrement(&fcb->refcount);
             
-            tbr.offset = subvol->id;
-            
-            Status = increase_extent_refcount(Vcb, in[i].address, Vcb->superblock.node_size, TYPE_TREE_BLOCK_REF, &tbr, NULL, th->level - 1, Irp);
-            if (!NT_SUCCESS(Status)) {
-                ERR("increase_extent_refcount returned %08x\n", Status);
-                goto end;
-            }
+            WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+#else
+            InterlockedIncrement(&fcb->refcount);
+#endif
+            fcbs[i] = fcb;
+            i++;
         }
+        
+        le = le->Flink;
     }
     
-    *((UINT32*)buf) = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+    ExReleaseResourceLite(&Vcb->fcb_lock);
+    
+    for (i = 0; i < num_fcbs; i++) {
+        IO_STATUS_BLOCK iosb;
+        
+        CcFlushCache(&fcbs[i]->nonpaged->segment_object, NULL, 0, &iosb);
+    }
     
-    KeInitializeEvent(&wtc->Event, NotificationEvent, FALSE);
-    InitializeListHead(&wtc->stripes);
-    wtc->tree = TRUE;
-    wtc->stripes_left = 0;
+    ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
     
-    Status = write_data(Vcb, t.new_address, buf, Vcb->superblock.node_size, wtc, NULL, NULL, FALSE, 0);
-    if (!NT_SUCCESS(Status)) {
-        ERR("write_data returned %08x\n", Status);
-        goto end;
+    for (i = 0; i < num_fcbs; i++) {
+        free_fcb(fcbs[i]);
     }
     
-    if (wtc->stripes.Flink != &wtc->stripes) {
-        // launch writes and wait
-        le = wtc->stripes.Flink;
-        while (le != &wtc->stripes) {
-            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
+    ExReleaseResourceLite(&Vcb->fcb_lock);
+    
+    ExFreePool(fcbs);
+}
+
+static BOOL subvol_needs_commit(device_extension* Vcb, root* subvol) {
+    LIST_ENTRY* le;
+    UINT8 level;
+    BOOL ret = FALSE;
+    
+    // Anything still waiting to go into the subvol's trees has to be committed before we can
+    // copy its top node. The top node itself is allowed to be dirty, as it's copied from memory.
+    
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        le = Vcb->dirty_trees[level].Flink;
+        while (le != &Vcb->dirty_trees[level]) {
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
             
-            if (stripe->status != WriteDataStatus_Ignore)
-                IoCallDriver(stripe->device->devobj, stripe->Irp);
+            if (t->root == subvol && t->parent)
+                return TRUE;
             
             le = le->Flink;
         }
+    }
+    
+    ExAcquireResourceSharedLite(&Vcb->dirty_fcbs_lock, TRUE);
+    
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        dirty_fcb* dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
         
-        KeWaitForSingleObject(&wtc->Event, Executive, KernelMode, FALSE, NULL);
-        
-        le = wtc->stripes.Flink;
-        while (le != &wtc->stripes) {
-            write_data_stripe* stripe = CONTAINING_RECORD(le, write_data_stripe, list_entry);
-            
-            if (stripe->status != WriteDataStatus_Ignore && !NT_SUCCESS(stripe->iosb.Status)) {
-                Status = stripe->iosb.Status;
-                break;
-            }
-            
-            le = le->Flink;
+        if (dirt->fcb->subvol == subvol) {
+            ret = TRUE;
+            break;
         }
         
-        free_write_data_stripes(wtc);
-        buf = NULL;
+        le = le->Flink;
     }
     
-    if (NT_SUCCESS(Status))
-        *newaddr = t.new_address;
+    ExReleaseResourceLite(&Vcb->dirty_fcbs_lock);
     
-end:
-    ExFreePool(wtc);
+    if (ret)
+        return TRUE;
     
-    if (buf)
-        ExFreePool(buf);
+    ExAcquireResourceSharedLite(&Vcb->dirty_filerefs_lock, TRUE);
     
-    return Status;
-}
-
-static void flush_subvol_fcbs(root* subvol) {
-    LIST_ENTRY* le = subvol->fcbs.Flink;
+    le = Vcb->dirty_filerefs.Flink;
+    while (le != &Vcb->dirty_filerefs) {
+        dirty_fileref* dirt = CONTAINING_RECORD(le, dirty_fileref, list_entry);
+        
+        if (dirt->fileref->fcb->subvol == subvol || (dirt->fileref->parent && dirt->fileref->parent->fcb->subvol == subvol)) {
+            ret = TRUE;
+            break;
+        }
+        
+        le = le->Flink;
+    }
     
-    if (IsListEmpty(&subvol->fcbs))
-        return;
+    ExReleaseResourceLite(&Vcb->dirty_filerefs_lock);
     
-    while (le != &subvol->fcbs) {
-        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-        IO_STATUS_BLOCK iosb;
+    if (ret)
+        return TRUE;
+    
+    ExAcquireResourceSharedLite(&Vcb->delalloc_lock, TRUE);
+    
+    le = Vcb->delalloc_fcbs.Flink;
+    while (le != &Vcb->delalloc_fcbs) {
+        struct _fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_delalloc);
         
-        if (fcb->type != BTRFS_TYPE_DIRECTORY && !fcb->deleted)
-            CcFlushCache(&fcb->nonpaged->segment_object, NULL, 0, &iosb);
+        if (fcb->subvol == subvol) {
+            ret = TRUE;
+            break;
+        }
         
         le = le->Flink;
     }
+    
+    ExReleaseResourceLite(&Vcb->delalloc_lock);
+    
+    return ret;
 }
 
 static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, fcb* subvol_fcb, PANSI_STRING utf8, PUNICODE_STRING name, PIRP Irp) {
-    LIST_ENTRY rollback;
     UINT64 id;
     NTSTATUS Status;
     root *r, *subvol = subvol_fcb->subvol;
     KEY searchkey;
     traverse_ptr tp;
-    UINT64 address, dirpos, *root_num;
+    UINT64 dirpos, *root_num;
     LARGE_INTEGER time;
     BTRFS_TIME now;
     fcb* fcb = parent->FsContext;
@@ -278,26 +389,20 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
     
     fileref = ccb->fileref;
     
-    // flush open files on this subvol
-    
-    flush_subvol_fcbs(subvol);
-
-    // flush metadata
+    // Open files have already been flushed by our caller. We only need to commit
+    // if some of the subvol's metadata hasn't made it into its trees yet.
     
-    if (Vcb->need_write)
+    if (subvol_needs_commit(Vcb, subvol)) {
         Status = do_write(Vcb, Irp);
-    else
-        Status = STATUS_SUCCESS;
-    
-    free_trees(Vcb);
-    
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_write returned %08x\n", Status);
-        return Status;
+        
+        free_trees(Vcb);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("do_write returned %08x\n", Status);
+            return Status;
+        }
     }
     
-    InitializeListHead(&rollback);
-    
     // create new root
     
     id = InterlockedIncrement64(&Vcb->root_root->lastinode);
@@ -353,6 +458,18 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         goto end;
     }
     
+    // make sure the top of the subvol is loaded
+    
+    searchkey.obj_id = 0;
+    searchkey.obj_type = 0;
+    searchkey.offset = 0;
+    
+    Status = find_item(Vcb, subvol, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        goto end;
+    }
+    
     searchkey.obj_id = r->id;
     searchkey.obj_type = TYPE_ROOT_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -363,12 +480,25 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         goto end;
     }
     
-    Status = snapshot_tree_copy(Vcb, subvol->root_item.block_number, r, &address, Irp, &rollback);
+    Status = snapshot_tree_copy(Vcb, subvol, r, Irp);
     if (!NT_SUCCESS(Status)) {
         ERR("snapshot_tree_copy returned %08x\n", Status);
         goto end;
     }
     
+    // Any of the subvol's trees that are still loaded are now shared with the snapshot. This
+    // used to be taken care of by free_trees after the commit.
+    
+    le = Vcb->trees.Flink;
+    while (le != &Vcb->trees) {
+        tree* t = CONTAINING_RECORD(le, tree, list_entry);
+        
+        if (t->root == subvol)
+            t->uniqueness_determined = FALSE;
+        
+        le = le->Flink;
+    }
+    
     KeQuerySystemTime(&time);
     win_time_to_unix(time, &now);
     
@@ -380,7 +510,7 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
     r->root_item.inode.flags = 0xffffffff80000000; // FIXME - find out what these mean
     r->root_item.generation = Vcb->superblock.generation;
     r->root_item.objid = subvol->root_item.objid;
-    r->root_item.block_number = address;
+    r->root_item.block_number = 0; // filled in by update_root_root when the new tree is written
     r->root_item.bytes_used = subvol->root_item.bytes_used;
     r->root_item.last_snapshot_generation = Vcb->superblock.generation;
     r->root_item.root_level = subvol->root_item.root_level;
@@ -391,8 +521,6 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
     r->root_item.ctime = subvol->root_item.ctime;
     r->root_item.otime = now;
     
-    r->treeholder.address = address;
-    
     // FIXME - do we need to copy over the send and receive fields too?
     
     if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
@@ -418,7 +546,7 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         goto end;
     }
     
-    subvol->treeholder.tree->write = TRUE;
+    mark_tree_dirty(subvol->treeholder.tree);
     
     // create fileref for entry in other subvolume
     
@@ -533,19 +661,10 @@ static NTSTATUS do_create_snapshot(device_extension* Vcb, PFILE_OBJECT parent, f
         le = le->Flink;
     }
     
-    Status = do_write(Vcb, Irp);
-    
-    free_trees(Vcb);
-    
-    if (!NT_SUCCESS(Status))
-        ERR("do_write returned %08x\n", Status);
+    // The new tree and ROOT_ITEM are written out by the next commit, along with everything else.
+    Status = STATUS_SUCCESS;
     
 end:
-    if (NT_SUCCESS(Status))
-        clear_rollback(Vcb, &rollback);
-    else
-        do_rollback(Vcb, &rollback);
-
     return Status;
 }
 
@@ -626,29 +745,11 @@ static NTSTATUS create_snapshot(device_extension* Vcb, PFILE_OBJECT FileObject,
         ERR("RtlUnicodeToUTF8N failed with error %08x\n", Status);
         goto end2;
     }
-
-    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
-
-    // no need for fcb_lock as we have tree_lock exclusively
-    Status = open_fileref(fcb->Vcb, &fr2, &nameus, fileref, FALSE, NULL, NULL, PagedPool, FALSE, Irp);
-    
-    if (NT_SUCCESS(Status)) {
-        if (!fr2->deleted) {
-            WARN("file already exists\n");
-            free_fileref(fr2);
-            Status = STATUS_OBJECT_NAME_COLLISION;
-            goto end3;
-        } else
-            free_fileref(fr2);
-    } else if (!NT_SUCCESS(Status) && Status != STATUS_OBJECT_NAME_NOT_FOUND) {
-        ERR("open_fileref returned %08x\n", Status);
-        goto end3;
-    }
     
     Status = ObReferenceObjectByHandle(bcs->subvol, 0, *IoFileObjectType, UserMode, (void**)&subvol_obj, NULL);
     if (!NT_SUCCESS(Status)) {
         ERR("ObReferenceObjectByHandle returned %08x\n", Status);
-        goto end3;
+        goto end2;
     }
     
     subvol_fcb = subvol_obj->FsContext;
@@ -676,6 +777,33 @@ static NTSTATUS create_snapshot(device_extension* Vcb, PFILE_OBJECT FileObject,
         goto end;
     }
     
+    // Flush open files on the subvol before taking the tree lock exclusively, so that
+    // other threads can carry on while the cache manager writes everything out.
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    
+    flush_subvol_fcbs(Vcb, subvol_fcb->subvol);
+    
+    ExReleaseResourceLite(&Vcb->tree_lock);
+
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+
+    // no need for fcb_lock as we have tree_lock exclusively
+    Status = open_fileref(fcb->Vcb, &fr2, &nameus, fileref, FALSE, NULL, NULL, PagedPool, FALSE, Irp);
+    
+    if (NT_SUCCESS(Status)) {
+        if (!fr2->deleted) {
+            WARN("file already exists\n");
+            free_fileref(fr2);
+            Status = STATUS_OBJECT_NAME_COLLISION;
+            goto end3;
+        } else
+            free_fileref(fr2);
+    } else if (!NT_SUCCESS(Status) && Status != STATUS_OBJECT_NAME_NOT_FOUND) {
+        ERR("open_fileref returned %08x\n", Status);
+        goto end3;
+    }
+    
     // clear unique flag on extents of open files in subvol
     if (!IsListEmpty(&subvol_fcb->subvol->fcbs)) {
         LIST_ENTRY* le = subvol_fcb->subvol->fcbs.Flink;
@@ -714,12 +842,12 @@ static NTSTATUS create_snapshot(device_extension* Vcb, PFILE_OBJECT FileObject,
         }
     }
     
-end:
-    ObDereferenceObject(subvol_obj);
-    
 end3:
     ExReleaseResourceLite(&Vcb->tree_lock);
     
+end:
+    ObDereferenceObject(subvol_obj);
+    
 end2:
     ExFreePool(utf8.Buffer);
     
@@ -950,6 +1078,8 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, WC
         goto end;
     }
     
+    fcb_share_sd(rootfcb);
+    
     Status = RtlGetOwnerSecurityDescriptor(rootfcb->sd, &owner, &defaulted);
     if (!NT_SUCCESS(Status)) {
         ERR("RtlGetOwnerSecurityDescriptor returned %08x\n", Status);
@@ -1307,6 +1437,7 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
         SECURITY_INFORMATION secinfo;
         SECURITY_DESCRIPTOR sd;
         void* oldsd;
+        BOOL oldsd_shared;
         
         fcb->inode_item.st_uid = bsii->st_uid;
         
@@ -1325,6 +1456,7 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
         }
         
         oldsd = fcb->sd;
+        oldsd_shared = fcb->sd_shared;
         
         secinfo = OWNER_SECURITY_INFORMATION;
         Status = SeSetSecurityDescriptorInfoEx(NULL, &secinfo, &sd, (void**)&fcb->sd, SEF_AVOID_PRIVILEGE_CHECK, PagedPool, IoGetFileObjectGenericMapping());
@@ -1334,7 +1466,10 @@ static NTSTATUS set_inode_info(PFILE_OBJECT FileObject, void* data, ULONG length
             goto end;
         }
         
-        ExFreePool(oldsd);
+        free_sd(fcb->Vcb, oldsd, oldsd_shared);
+        
+        fcb->sd_shared = FALSE;
+        fcb_share_sd(fcb);
         
         fcb->sd_dirty = TRUE;
         
@@ -2982,6 +3117,35 @@ static NTSTATUS query_uuid(device_extension* Vcb, void* data, ULONG length) {
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS get_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_stats* bs = (btrfs_stats*)data;
+    
+    if (length < sizeof(btrfs_stats) || !data)
+        return STATUS_BUFFER_OVERFLOW;
+    
+    bs->sd_cache_hits = Vcb->counters.sd_cache_hits;
+    bs->sd_cache_misses = Vcb->counters.sd_cache_misses;
+    bs->sd_cache_entries = Vcb->counters.sd_cache_entries;
+    bs->sd_cache_size = Vcb->counters.sd_cache_size;
+    bs->sd_cache_saved = Vcb->counters.sd_cache_saved;
+    bs->space_cache_written = Vcb->counters.space_cache_written;
+    bs->space_cache_skipped = Vcb->counters.space_cache_skipped;
+    bs->space_cache_loaded = Vcb->counters.space_cache_loaded;
+    bs->space_cache_loaded_bg = Vcb->counters.space_cache_loaded_bg;
+    bs->space_cache_load_time = Vcb->counters.space_cache_load_time;
+    bs->balance_data_relocated = Vcb->counters.balance_data_relocated;
+    bs->balance_reloc_time = Vcb->counters.balance_reloc_time;
+    bs->background_bytes = Vcb->counters.background_bytes;
+    bs->throttle_time = Vcb->counters.throttle_time;
+    bs->extent_cache_hits = Vcb->counters.extent_cache_hits;
+    bs->extent_cache_misses = Vcb->counters.extent_cache_misses;
+    bs->extent_cache_invalidations = Vcb->counters.extent_cache_invalidations;
+    bs->extent_refs_applied = Vcb->counters.extent_refs_applied;
+    bs->extent_refs_collapsed = Vcb->counters.extent_refs_collapsed;
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP Irp, UINT32 type, BOOL user) {
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
     NTSTATUS Status;
@@ -3516,6 +3680,10 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP Irp, UINT32 type, BOOL
             Status = query_scrub(DeviceObject->DeviceExtension, Irp->RequestorMode, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
             break;
         
+        case FSCTL_BTRFS_QUERY_SCRUB_DEVICES:
+            Status = query_scrub_devices(DeviceObject->DeviceExtension, Irp->RequestorMode, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+        
         case FSCTL_BTRFS_PAUSE_SCRUB:
             Status = pause_scrub(DeviceObject->DeviceExtension, Irp->RequestorMode);
             break;
@@ -3527,6 +3695,18 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP Irp, UINT32 type, BOOL
         case FSCTL_BTRFS_STOP_SCRUB:
             Status = stop_scrub(DeviceObject->DeviceExtension, Irp->RequestorMode);
             break;
+            
+        case FSCTL_BTRFS_GET_STATS:
+            Status = get_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+            
+        case FSCTL_BTRFS_SET_THROTTLE:
+            Status = set_throttle(DeviceObject->DeviceExtension, Irp->AssociatedIrp.SystemBuffer, IrpSp->Parameters.FileSystemControl.InputBufferLength, Irp->RequestorMode);
+            break;
+            
+        case FSCTL_BTRFS_QUERY_THROTTLE:
+            Status = query_throttle(DeviceObject->DeviceExtension, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
 
         default:
             TRACE("unknown control code %x (DeviceType = %x, Access = %x, Function = %x, Method = %x)\n",
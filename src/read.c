@@ -2501,6 +2501,7 @@ NTSTATUS STDCALL read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, U
                     UINT64 addr;
 //                     UINT64 lockaddr, locklen;
                     chunk* c;
+                    LARGE_INTEGER io_time, io_freq;
                     
                     read = len - off;
                     if (read > length) read = length;
@@ -2560,7 +2561,12 @@ NTSTATUS STDCALL read_file(fcb* fcb, UINT8* data, UINT64 start, UINT64 length, U
                     } else
                         csum = NULL;
                     
+                    io_time = KeQueryPerformanceCounter(&io_freq);
+                    
                     Status = read_data(fcb->Vcb, addr, to_read, csum, FALSE, buf, c, NULL, Irp, 0, mdl, bytes_read);
+                    
+                    update_foreground_latency(fcb->Vcb, io_time, io_freq);
+                    
                     if (!NT_SUCCESS(Status)) {
                         ERR("read_data returned %08x\n", Status);
                         
@@ -2721,6 +2727,10 @@ nextitem:
         length -= read;
     }
     
+    // data which has been written but not yet allocated
+    if (!IsListEmpty(&fcb->delalloc))
+        read_delalloc(fcb, data, start, bytes_read);
+    
     Status = STATUS_SUCCESS;
     if (pbr)
         *pbr = bytes_read;
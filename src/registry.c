@@ -27,7 +27,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
-                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus;
+                   maxinlineus, subvolidus, skipbalanceus, nobarrierus, notrimus, clearcacheus, delallocus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -45,6 +45,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->no_barrier = mount_no_barrier;
     options->no_trim = mount_no_trim;
     options->clear_cache = mount_clear_cache;
+    options->delalloc = mount_delalloc;
     options->subvol_id = 0;
     
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
@@ -107,6 +108,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&nobarrierus, L"NoBarrier");
     RtlInitUnicodeString(&notrimus, L"NoTrim");
     RtlInitUnicodeString(&clearcacheus, L"ClearCache");
+    RtlInitUnicodeString(&delallocus, L"DelayedAllocation");
     
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -171,6 +173,10 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
                 
                 options->clear_cache = *val;
+            } else if (FsRtlAreNamesEqual(&delallocus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+                
+                options->delalloc = *val;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08x\n", Status);
@@ -503,7 +509,7 @@ end:
     ExFreePool(kbi);
 }
 
-static void read_mappings(PUNICODE_STRING regpath) {
+static void read_mappings(PUNICODE_STRING regpath, const WCHAR* mappings, BOOL group) {
     WCHAR* path;
     UNICODE_STRING us;
     HANDLE h;
@@ -513,8 +519,6 @@ static void read_mappings(PUNICODE_STRING regpath) {
     ULONG kvfilen, retlen, i;
     KEY_VALUE_FULL_INFORMATION* kvfi;
     
-    const WCHAR mappings[] = L"\\Mappings";
-    
     path = ExAllocatePoolWithTag(PagedPool, regpath->Length + (wcslen(mappings) * sizeof(WCHAR)), ALLOC_TAG);
     if (!path) {
         ERR("out of memory\n");
@@ -560,7 +564,10 @@ static void read_mappings(PUNICODE_STRING regpath) {
                 
                 TRACE("entry %u = %.*S = %u\n", i, kvfi->NameLength / sizeof(WCHAR), kvfi->Name, val);
                 
-                add_user_mapping(kvfi->Name, kvfi->NameLength / sizeof(WCHAR), val);
+                if (group)
+                    add_group_mapping(kvfi->Name, kvfi->NameLength / sizeof(WCHAR), val);
+                else
+                    add_user_mapping(kvfi->Name, kvfi->NameLength / sizeof(WCHAR), val);
             }
             
             i = i + 1;
@@ -634,7 +641,8 @@ void STDCALL read_registry(PUNICODE_STRING regpath) {
     
     static WCHAR def_log_file[] = L"\\??\\C:\\btrfs.log";
     
-    read_mappings(regpath);
+    read_mappings(regpath, L"\\Mappings", FALSE);
+    read_mappings(regpath, L"\\GroupMappings", TRUE);
     
     InitializeObjectAttributes(&oa, regpath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
     
@@ -657,6 +665,7 @@ void STDCALL read_registry(PUNICODE_STRING regpath) {
     get_registry_value(h, L"NoBarrier", REG_DWORD, &mount_no_barrier, sizeof(mount_no_barrier));
     get_registry_value(h, L"NoTrim", REG_DWORD, &mount_no_trim, sizeof(mount_no_trim));
     get_registry_value(h, L"ClearCache", REG_DWORD, &mount_clear_cache, sizeof(mount_clear_cache));
+    get_registry_value(h, L"DelayedAllocation", REG_DWORD, &mount_delalloc, sizeof(mount_delalloc));
     
     if (mount_flush_interval == 0)
         mount_flush_interval = 1;
@@ -18,6 +18,8 @@
 #include "btrfs_drv.h"
 
 #define SCRUB_UNIT 0x100000 // 1 MB
+#define SCRUB_WINDOW 0x1000000 // 16 MB
+#define SCRUB_MAX_ITEMS 0x4000
 
 struct _scrub_context;
 
@@ -44,6 +46,36 @@ typedef struct {
     LIST_ENTRY list_entry;
 } path_part;
 
+typedef struct {
+    UINT64 address;
+    UINT64 size;
+    UINT32* csum;
+    ULONG* bmparr;
+    RTL_BITMAP bmp;
+    BOOL bad;
+} scrub_item;
+
+typedef struct {
+    UINT64 phys;
+    UINT64 address;
+    UINT32 length;
+    ULONG item;
+} scrub_piece;
+
+typedef struct {
+    device_extension* Vcb;
+    chunk* c;
+    device* dev;
+    scrub_item* items;
+    ULONG num_items;
+    HANDLE thread;
+    KEVENT finished;
+    NTSTATUS Status;
+    UINT64 data_read;
+    UINT64 read_time;
+    UINT64 num_reads;
+} scrub_reader;
+
 static void log_file_checksum_error(device_extension* Vcb, UINT64 addr, UINT64 devid, UINT64 subvol, UINT64 inode, UINT64 offset) {
     LIST_ENTRY *le, parts;
     root* r = NULL;
@@ -1627,8 +1659,6 @@ typedef struct {
     IO_STATUS_BLOCK iosb;
     UINT64 offset;
     BOOL rewrite;
-    RTL_BITMAP error;
-    ULONG* errorarr;
 } scrub_context_raid56_stripe;
 
 typedef struct {
@@ -1641,6 +1671,8 @@ typedef struct {
     UINT32* csum;
     UINT8* parity_scratch;
     UINT8* parity_scratch2;
+    RTL_BITMAP* errors;
+    ULONG* errorarr;
 } scrub_context_raid56;
 
 static NTSTATUS STDCALL scrub_read_completion_raid56(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
@@ -1660,15 +1692,17 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     ULONG sectors_per_stripe = c->chunk_item->stripe_length / Vcb->superblock.sector_size, i;
     UINT16 stripe, parity = (bit_start + num + c->chunk_item->num_stripes - 1) % c->chunk_item->num_stripes;
     UINT64 off, stripeoff;
+    UINT8* parity_scratch = &context->parity_scratch[num * c->chunk_item->stripe_length];
+    RTL_BITMAP* error = &context->errors[num * c->chunk_item->num_stripes];
     
     stripe = (parity + 1) % c->chunk_item->num_stripes;
     off = (bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 1);
     stripeoff = num * sectors_per_stripe;
     
-    RtlCopyMemory(context->parity_scratch, &context->stripes[parity].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
+    RtlCopyMemory(parity_scratch, &context->stripes[parity].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
     
     while (stripe != parity) {
-        RtlClearAllBits(&context->stripes[stripe].error);
+        RtlClearAllBits(&error[stripe]);
         
         for (i = 0; i < sectors_per_stripe; i++) {
             if (RtlCheckBit(&context->alloc, off)) {
@@ -1678,7 +1712,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     UINT32 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                     
                     if (crc32 != *((UINT32*)th->csum) || th->address != addr)
-                        RtlSetBits(&context->stripes[stripe].error, i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
+                        RtlSetBits(&error[stripe], i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
                     
                     off += Vcb->superblock.node_size / Vcb->superblock.sector_size;
                     stripeoff += Vcb->superblock.node_size / Vcb->superblock.sector_size;
@@ -1689,7 +1723,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     UINT32 crc32 = ~calc_crc32c(0xffffffff, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
                     
                     if (crc32 != context->csum[off])
-                        RtlSetBit(&context->stripes[stripe].error, i);
+                        RtlSetBit(&error[stripe], i);
                 }
             }
             
@@ -1697,7 +1731,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             stripeoff++;
         }
         
-        do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
+        do_xor(parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
         
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
@@ -1705,15 +1739,15 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     
     // check parity
     
-    RtlClearAllBits(&context->stripes[parity].error);
+    RtlClearAllBits(&error[parity]);
     
     for (i = 0; i < sectors_per_stripe; i++) {
         ULONG o, j;
         
         o = i * Vcb->superblock.sector_size;
         for (j = 0; j < Vcb->superblock.sector_size; j++) { // FIXME - use SSE
-            if (context->parity_scratch[o] != 0) {
-                RtlSetBit(&context->stripes[parity].error, i);
+            if (parity_scratch[o] != 0) {
+                RtlSetBit(&error[parity], i);
                 break;
             }
             o++;
@@ -1734,7 +1768,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             if (RtlCheckBit(&context->alloc, off)) {
                 alloc = TRUE;
                 
-                if (RtlCheckBit(&context->stripes[stripe].error, i)) {
+                if (RtlCheckBit(&error[stripe], i)) {
                     bad_stripe = stripe;
                     bad_off = off;
                     num_errors++;
@@ -1748,14 +1782,14 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
         if (!alloc)
             continue;
         
-        if (num_errors == 0 && !RtlCheckBit(&context->stripes[parity].error, i)) // everything fine
+        if (num_errors == 0 && !RtlCheckBit(&error[parity], i)) // everything fine
             continue;
         
-        if (num_errors == 0 && RtlCheckBit(&context->stripes[parity].error, i)) { // parity error
+        if (num_errors == 0 && RtlCheckBit(&error[parity], i)) { // parity error
             UINT64 addr;
             
             do_xor(&context->stripes[parity].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                   &context->parity_scratch[i * Vcb->superblock.sector_size],
+                   &parity_scratch[i * Vcb->superblock.sector_size],
                    Vcb->superblock.sector_size);
             
             bad_off = ((bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 1)) + i;
@@ -1771,34 +1805,34 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             if (RtlCheckBit(&context->is_tree, bad_off)) {
                 tree_header* th;
                 
-                do_xor(&context->parity_scratch[i * Vcb->superblock.sector_size],
+                do_xor(&parity_scratch[i * Vcb->superblock.sector_size],
                        &context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                        Vcb->superblock.node_size);
                 
-                th = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
+                th = (tree_header*)&parity_scratch[i * Vcb->superblock.sector_size];
                 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                 
                 if (crc32 == *((UINT32*)th->csum) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
+                                  &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
                     
                     context->stripes[bad_stripe].rewrite = TRUE;
                     
-                    RtlClearBits(&context->stripes[bad_stripe].error, i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
+                    RtlClearBits(&error[bad_stripe], i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
                     
                     log_error(Vcb, addr, c->devices[bad_stripe]->devitem.dev_id, TRUE, TRUE, FALSE);
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe]->devitem.dev_id, TRUE, FALSE, FALSE);
             } else {
-                do_xor(&context->parity_scratch[i * Vcb->superblock.sector_size],
+                do_xor(&parity_scratch[i * Vcb->superblock.sector_size],
                        &context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
                        Vcb->superblock.sector_size);
                 
-                crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                crc32 = ~calc_crc32c(0xffffffff, &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                 
                 if (crc32 == context->csum[bad_off]) {
                     RtlCopyMemory(&context->stripes[bad_stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                                  &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                     
                     context->stripes[bad_stripe].rewrite = TRUE;
                     
@@ -1812,7 +1846,7 @@ static void scrub_raid5_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             while (stripe != parity) {
                 if (RtlCheckBit(&context->alloc, off)) {
-                    if (RtlCheckBit(&context->stripes[stripe].error, i)) {
+                    if (RtlCheckBit(&error[stripe], i)) {
                         UINT64 addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 1) * c->chunk_item->stripe_length) + (off * Vcb->superblock.sector_size);
 
                         log_error(Vcb, addr, c->devices[stripe]->devitem.dev_id, RtlCheckBit(&context->is_tree, off), FALSE, FALSE);
@@ -1831,16 +1865,19 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     UINT16 stripe, parity1 = (bit_start + num + c->chunk_item->num_stripes - 2) % c->chunk_item->num_stripes;
     UINT16 parity2 = (parity1 + 1) % c->chunk_item->num_stripes;
     UINT64 off, stripeoff;
+    UINT8* parity_scratch = &context->parity_scratch[num * c->chunk_item->stripe_length];
+    UINT8* parity_scratch2 = &context->parity_scratch2[num * c->chunk_item->stripe_length];
+    RTL_BITMAP* error = &context->errors[num * c->chunk_item->num_stripes];
     
     stripe = (parity1 + 2) % c->chunk_item->num_stripes;
     off = (bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 2);
     stripeoff = num * sectors_per_stripe;
     
-    RtlCopyMemory(context->parity_scratch, &context->stripes[parity1].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
-    RtlZeroMemory(context->parity_scratch2, c->chunk_item->stripe_length);
+    RtlCopyMemory(parity_scratch, &context->stripes[parity1].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
+    RtlZeroMemory(parity_scratch2, c->chunk_item->stripe_length);
     
     while (stripe != parity1) {
-        RtlClearAllBits(&context->stripes[stripe].error);
+        RtlClearAllBits(&error[stripe]);
         
         for (i = 0; i < sectors_per_stripe; i++) {
             if (RtlCheckBit(&context->alloc, off)) {
@@ -1850,7 +1887,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     UINT32 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                     
                     if (crc32 != *((UINT32*)th->csum) || th->address != addr)
-                        RtlSetBits(&context->stripes[stripe].error, i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
+                        RtlSetBits(&error[stripe], i, Vcb->superblock.node_size / Vcb->superblock.sector_size);
                     
                     off += Vcb->superblock.node_size / Vcb->superblock.sector_size;
                     stripeoff += Vcb->superblock.node_size / Vcb->superblock.sector_size;
@@ -1861,7 +1898,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     UINT32 crc32 = ~calc_crc32c(0xffffffff, context->stripes[stripe].buf + (stripeoff * Vcb->superblock.sector_size), Vcb->superblock.sector_size);
                     
                     if (crc32 != context->csum[off])
-                        RtlSetBit(&context->stripes[stripe].error, i);
+                        RtlSetBit(&error[stripe], i);
                 }
             }
             
@@ -1869,7 +1906,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             stripeoff++;
         }
         
-        do_xor(context->parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
+        do_xor(parity_scratch, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
         
         stripe = (stripe + 1) % c->chunk_item->num_stripes;
         stripeoff = num * sectors_per_stripe;
@@ -1877,15 +1914,15 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     
     // check parity 1
     
-    RtlClearAllBits(&context->stripes[parity1].error);
+    RtlClearAllBits(&error[parity1]);
     
     for (i = 0; i < sectors_per_stripe; i++) {
         ULONG o, j;
         
         o = i * Vcb->superblock.sector_size;
         for (j = 0; j < Vcb->superblock.sector_size; j++) { // FIXME - use SSE
-            if (context->parity_scratch[o] != 0) {
-                RtlSetBit(&context->stripes[parity1].error, i);
+            if (parity_scratch[o] != 0) {
+                RtlSetBit(&error[parity1], i);
                 break;
             }
             o++;
@@ -1897,18 +1934,18 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     stripe = parity1 == 0 ? (c->chunk_item->num_stripes - 1) : (parity1 - 1);
     
     while (stripe != parity2) {
-        galois_double(context->parity_scratch2, c->chunk_item->stripe_length);
-        do_xor(context->parity_scratch2, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
+        galois_double(parity_scratch2, c->chunk_item->stripe_length);
+        do_xor(parity_scratch2, &context->stripes[stripe].buf[num * c->chunk_item->stripe_length], c->chunk_item->stripe_length);
         
         stripe = stripe == 0 ? (c->chunk_item->num_stripes - 1) : (stripe - 1);
     }
     
-    RtlClearAllBits(&context->stripes[parity2].error);
+    RtlClearAllBits(&error[parity2]);
     
     for (i = 0; i < sectors_per_stripe; i++) {
         if (RtlCompareMemory(&context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                             &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size) != Vcb->superblock.sector_size)
-            RtlSetBit(&context->stripes[parity2].error, i);
+                             &parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size) != Vcb->superblock.sector_size)
+            RtlSetBit(&error[parity2], i);
     }
     
     // log and fix errors
@@ -1925,7 +1962,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             if (RtlCheckBit(&context->alloc, off)) {
                 alloc = TRUE;
                 
-                if (RtlCheckBit(&context->stripes[stripe].error, i)) {
+                if (RtlCheckBit(&error[stripe], i)) {
                     if (num_errors == 0) {
                         bad_stripe1 = stripe;
                         bad_off1 = off;
@@ -1944,15 +1981,15 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
         if (!alloc)
             continue;
         
-        if (num_errors == 0 && !RtlCheckBit(&context->stripes[parity1].error, i) && !RtlCheckBit(&context->stripes[parity2].error, i)) // everything fine
+        if (num_errors == 0 && !RtlCheckBit(&error[parity1], i) && !RtlCheckBit(&error[parity2], i)) // everything fine
             continue;
         
         if (num_errors == 0) { // parity error
             UINT64 addr;
             
-            if (RtlCheckBit(&context->stripes[parity1].error, i)) {
+            if (RtlCheckBit(&error[parity1], i)) {
                 do_xor(&context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                       &context->parity_scratch[i * Vcb->superblock.sector_size],
+                       &parity_scratch[i * Vcb->superblock.sector_size],
                        Vcb->superblock.sector_size);
                 
                 bad_off1 = ((bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 2)) + i;
@@ -1963,9 +2000,9 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 log_error(Vcb, addr, c->devices[parity1]->devitem.dev_id, FALSE, TRUE, TRUE);
             }
             
-            if (RtlCheckBit(&context->stripes[parity2].error, i)) {
+            if (RtlCheckBit(&error[parity2], i)) {
                 RtlCopyMemory(&context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                              &context->parity_scratch2[i * Vcb->superblock.sector_size],
+                              &parity_scratch2[i * Vcb->superblock.sector_size],
                               Vcb->superblock.sector_size);
                 
                 bad_off1 = ((bit_start + num - stripe_start) * sectors_per_stripe * (c->chunk_item->num_stripes - 2)) + i;
@@ -1982,7 +2019,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             len = RtlCheckBit(&context->is_tree, bad_off1)? Vcb->superblock.node_size : Vcb->superblock.sector_size;
             
-            do_xor(&context->parity_scratch[i * Vcb->superblock.sector_size],
+            do_xor(&parity_scratch[i * Vcb->superblock.sector_size],
                    &context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
             
             scratch = ExAllocatePoolWithTag(PagedPool, len, ALLOC_TAG);
@@ -2016,7 +2053,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             if (RtlCheckBit(&context->is_tree, bad_off1)) {
                 tree_header *th1, *th2;
                 
-                th1 = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
+                th1 = (tree_header*)&parity_scratch[i * Vcb->superblock.sector_size];
                 th2 = (tree_header*)scratch;
                 crc32a = ~calc_crc32c(0xffffffff, (UINT8*)&th1->fs_uuid, Vcb->superblock.node_size - sizeof(th1->csum));
                 crc32b = ~calc_crc32c(0xffffffff, (UINT8*)&th2->fs_uuid, Vcb->superblock.node_size - sizeof(th2->csum));
@@ -2049,7 +2086,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                         log_error(Vcb, addr, c->devices[parity1]->devitem.dev_id, FALSE, TRUE, TRUE);
                     } else {
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                      &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
+                                      &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
                         
                         if (crc32b != *((UINT32*)th2->csum) || th2->address != addr) {
                             // fix parity 2
@@ -2079,13 +2116,13 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                     
                     context->stripes[bad_stripe1].rewrite = TRUE;
                     
-                    RtlClearBits(&context->stripes[bad_stripe1].error, i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
+                    RtlClearBits(&error[bad_stripe1], i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
                     
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, TRUE, TRUE, FALSE);
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, TRUE, FALSE, FALSE);
             } else {
-                crc32a = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                crc32a = ~calc_crc32c(0xffffffff, &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                 crc32b = ~calc_crc32c(0xffffffff, scratch, Vcb->superblock.sector_size);
                 
                 if (crc32a == context->csum[bad_off1] || crc32b == context->csum[bad_off1]) {
@@ -2116,7 +2153,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                         log_error(Vcb, addr, c->devices[parity1]->devitem.dev_id, FALSE, TRUE, TRUE);
                     } else {
                         RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                      &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                                      &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                         
                         if (crc32b != context->csum[bad_off1]) {
                             // fix parity 2
@@ -2166,17 +2203,17 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             k = c->chunk_item->num_stripes - 3;
             if (stripe == bad_stripe1 || stripe == bad_stripe2) {
-                RtlZeroMemory(&context->parity_scratch[i * Vcb->superblock.sector_size], len);
-                RtlZeroMemory(&context->parity_scratch2[i * Vcb->superblock.sector_size], len);
+                RtlZeroMemory(&parity_scratch[i * Vcb->superblock.sector_size], len);
+                RtlZeroMemory(&parity_scratch2[i * Vcb->superblock.sector_size], len);
                 
                 if (stripe == bad_stripe1)
                     x = k;
                 else
                     y = k;
             } else {
-                RtlCopyMemory(&context->parity_scratch[i * Vcb->superblock.sector_size],
+                RtlCopyMemory(&parity_scratch[i * Vcb->superblock.sector_size],
                               &context->stripes[stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
-                RtlCopyMemory(&context->parity_scratch2[i * Vcb->superblock.sector_size],
+                RtlCopyMemory(&parity_scratch2[i * Vcb->superblock.sector_size],
                               &context->stripes[stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
             }
             
@@ -2184,12 +2221,12 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             k--;
             do {
-                galois_double(&context->parity_scratch[i * Vcb->superblock.sector_size], len);
+                galois_double(&parity_scratch[i * Vcb->superblock.sector_size], len);
                 
                 if (stripe != bad_stripe1 && stripe != bad_stripe2) {
-                    do_xor(&context->parity_scratch[i * Vcb->superblock.sector_size],
+                    do_xor(&parity_scratch[i * Vcb->superblock.sector_size],
                            &context->stripes[stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
-                    do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size],
+                    do_xor(&parity_scratch2[i * Vcb->superblock.sector_size],
                            &context->stripes[stripe].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
                 } else if (stripe == bad_stripe1)
                     x = k;
@@ -2209,8 +2246,8 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             p = &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)];
             q = &context->stripes[parity2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)];
-            pxy = &context->parity_scratch2[i * Vcb->superblock.sector_size];
-            qxy = &context->parity_scratch[i * Vcb->superblock.sector_size]; 
+            pxy = &parity_scratch2[i * Vcb->superblock.sector_size];
+            qxy = &parity_scratch[i * Vcb->superblock.sector_size]; 
             
             for (j = 0; j < len; j++) {
                 *qxy = gmul(a, *p ^ *pxy) ^ gmul(b, *q ^ *qxy);
@@ -2221,32 +2258,32 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
                 qxy++;
             }
             
-            do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->parity_scratch[i * Vcb->superblock.sector_size], len);
-            do_xor(&context->parity_scratch2[i * Vcb->superblock.sector_size], &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
+            do_xor(&parity_scratch2[i * Vcb->superblock.sector_size], &parity_scratch[i * Vcb->superblock.sector_size], len);
+            do_xor(&parity_scratch2[i * Vcb->superblock.sector_size], &context->stripes[parity1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)], len);
             
             addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (bad_off1 * Vcb->superblock.sector_size);
             
             if (RtlCheckBit(&context->is_tree, bad_off1)) {
-                tree_header* th = (tree_header*)&context->parity_scratch[i * Vcb->superblock.sector_size];
+                tree_header* th = (tree_header*)&parity_scratch[i * Vcb->superblock.sector_size];
                 UINT32 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                 
                 if (crc32 == *((UINT32*)th->csum) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
+                                  &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
                     
                     context->stripes[bad_stripe1].rewrite = TRUE;
                     
-                    RtlClearBits(&context->stripes[bad_stripe1].error, i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
+                    RtlClearBits(&error[bad_stripe1], i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
                     
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, TRUE, TRUE, FALSE);
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe1]->devitem.dev_id, TRUE, FALSE, FALSE);
             } else {
-                UINT32 crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                UINT32 crc32 = ~calc_crc32c(0xffffffff, &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                 
                 if (crc32 == context->csum[bad_off1]) {
                     RtlCopyMemory(&context->stripes[bad_stripe1].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                                  &parity_scratch[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                     
                     context->stripes[bad_stripe1].rewrite = TRUE;
                     
@@ -2258,26 +2295,26 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (bad_off2 * Vcb->superblock.sector_size);
             
             if (RtlCheckBit(&context->is_tree, bad_off2)) {
-                tree_header* th = (tree_header*)&context->parity_scratch2[i * Vcb->superblock.sector_size];
+                tree_header* th = (tree_header*)&parity_scratch2[i * Vcb->superblock.sector_size];
                 UINT32 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
                 
                 if (crc32 == *((UINT32*)th->csum) && th->address == addr) {
                     RtlCopyMemory(&context->stripes[bad_stripe2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
+                                  &parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.node_size);
                     
                     context->stripes[bad_stripe2].rewrite = TRUE;
                     
-                    RtlClearBits(&context->stripes[bad_stripe2].error, i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
+                    RtlClearBits(&error[bad_stripe2], i + 1, (Vcb->superblock.node_size / Vcb->superblock.sector_size) - 1);
                     
                     log_error(Vcb, addr, c->devices[bad_stripe2]->devitem.dev_id, TRUE, TRUE, FALSE);
                 } else
                     log_error(Vcb, addr, c->devices[bad_stripe2]->devitem.dev_id, TRUE, FALSE, FALSE);
             } else {
-                UINT32 crc32 = ~calc_crc32c(0xffffffff, &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                UINT32 crc32 = ~calc_crc32c(0xffffffff, &parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                 
                 if (crc32 == context->csum[bad_off2]) {
                     RtlCopyMemory(&context->stripes[bad_stripe2].buf[(num * c->chunk_item->stripe_length) + (i * Vcb->superblock.sector_size)],
-                                  &context->parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
+                                  &parity_scratch2[i * Vcb->superblock.sector_size], Vcb->superblock.sector_size);
                     
                     context->stripes[bad_stripe2].rewrite = TRUE;
                     
@@ -2291,7 +2328,7 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
             
             while (stripe != parity1) {
                 if (RtlCheckBit(&context->alloc, off)) {
-                    if (RtlCheckBit(&context->stripes[stripe].error, i)) {
+                    if (RtlCheckBit(&error[stripe], i)) {
                         UINT64 addr = c->offset + (stripe_start * (c->chunk_item->num_stripes - 2) * c->chunk_item->stripe_length) + (off * Vcb->superblock.sector_size);
 
                         log_error(Vcb, addr, c->devices[stripe]->devitem.dev_id, RtlCheckBit(&context->is_tree, off), FALSE, FALSE);
@@ -2305,23 +2342,144 @@ static void scrub_raid6_stripe(device_extension* Vcb, chunk* c, scrub_context_ra
     }
 }
 
+void scrub_parity_stripe(device_extension* Vcb, scrub_parity_job* spj, ULONG num) {
+    if (spj->c->chunk_item->type & BLOCK_FLAG_RAID6)
+        scrub_raid6_stripe(Vcb, spj->c, spj->context, spj->stripe_start, spj->bit_start, num);
+    else
+        scrub_raid5_stripe(Vcb, spj->c, spj->context, spj->stripe_start, spj->bit_start, num);
+}
+
+static NTSTATUS scrub_raid56_check(device_extension* Vcb, chunk* c, scrub_context_raid56* context, UINT64 stripe_start, UINT64 bit_start, ULONG num) {
+    NTSTATUS Status;
+    scrub_parity_job* spj;
+    
+    // not worth waking the calc threads for a single stripe
+    if (num == 1) {
+        if (c->chunk_item->type & BLOCK_FLAG_RAID6)
+            scrub_raid6_stripe(Vcb, c, context, stripe_start, bit_start, 0);
+        else
+            scrub_raid5_stripe(Vcb, c, context, stripe_start, bit_start, 0);
+        
+        return STATUS_SUCCESS;
+    }
+    
+    Status = add_scrub_parity_job(Vcb, c, context, stripe_start, bit_start, num, &spj);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_scrub_parity_job returned %08x\n", Status);
+        return Status;
+    }
+    
+    KeWaitForSingleObject(&spj->event, Executive, KernelMode, FALSE, NULL);
+    
+    free_scrub_parity_job(spj);
+    
+    return STATUS_SUCCESS;
+}
+
+static void scrub_raid56_free_irps(chunk* c, scrub_context_raid56_stripe* stripes) {
+    UINT16 i;
+    
+    for (i = 0; i < c->chunk_item->num_stripes; i++) {
+        if (stripes[i].Irp) {
+            if (c->devices[i]->devobj->Flags & DO_DIRECT_IO && stripes[i].Irp->MdlAddress) {
+                MmUnlockPages(stripes[i].Irp->MdlAddress);
+                IoFreeMdl(stripes[i].Irp->MdlAddress);
+            }
+            
+            IoFreeIrp(stripes[i].Irp);
+            stripes[i].Irp = NULL;
+        }
+    }
+}
+
+static NTSTATUS scrub_raid56_start_read(device_extension* Vcb, chunk* c, scrub_context_raid56* context, scrub_context_raid56_stripe* stripes,
+                                        UINT64 stripe, ULONG read_stripes) {
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
+    UINT16 i;
+    
+    for (i = 0; i < c->chunk_item->num_stripes; i++) {
+        PIO_STACK_LOCATION IrpSp;
+
+        stripes[i].Irp = IoAllocateIrp(c->devices[i]->devobj->StackSize, FALSE);
+        
+        if (!stripes[i].Irp) {
+            ERR("IoAllocateIrp failed\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        IrpSp = IoGetNextIrpStackLocation(stripes[i].Irp);
+        IrpSp->MajorFunction = IRP_MJ_READ;
+        
+        if (c->devices[i]->devobj->Flags & DO_BUFFERED_IO) {
+            stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, read_stripes * c->chunk_item->stripe_length, ALLOC_TAG);
+            if (!stripes[i].Irp->AssociatedIrp.SystemBuffer) {
+                ERR("out of memory\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
+
+            stripes[i].Irp->UserBuffer = stripes[i].buf;
+        } else if (c->devices[i]->devobj->Flags & DO_DIRECT_IO) {
+            stripes[i].Irp->MdlAddress = IoAllocateMdl(stripes[i].buf, read_stripes * c->chunk_item->stripe_length, FALSE, FALSE, NULL);
+            if (!stripes[i].Irp->MdlAddress) {
+                ERR("IoAllocateMdl failed\n");
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            
+            MmProbeAndLockPages(stripes[i].Irp->MdlAddress, KernelMode, IoWriteAccess);
+        } else
+            stripes[i].Irp->UserBuffer = stripes[i].buf;
+        
+        stripes[i].offset = stripe * c->chunk_item->stripe_length;
+        stripes[i].rewrite = FALSE;
+
+        IrpSp->Parameters.Read.Length = read_stripes * c->chunk_item->stripe_length;
+        IrpSp->Parameters.Read.ByteOffset.QuadPart = cis[i].offset + stripes[i].offset;
+        
+        stripes[i].Irp->UserIosb = &stripes[i].iosb;
+        
+        IoSetCompletionRoutine(stripes[i].Irp, scrub_read_completion_raid56, &stripes[i], TRUE, TRUE, TRUE);
+    }
+    
+    // only one read is ever outstanding, so the event and counter can live in the shared context
+    context->stripes_left = c->chunk_item->num_stripes;
+    KeInitializeEvent(&context->Event, NotificationEvent, FALSE);
+    
+    for (i = 0; i < c->chunk_item->num_stripes; i++) {
+        IoCallDriver(c->devices[i]->devobj, stripes[i].Irp);
+        
+        Vcb->scrub.data_scrubbed += read_stripes * c->chunk_item->stripe_length;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, UINT64 stripe_start, UINT64 stripe_end) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
-    BOOL b;
+    BOOL b, pending = FALSE, locked = FALSE;
     UINT64 run_start, run_end, num_sectors, full_stripe_len, max_read, stripe;
-    ULONG arrlen, *allocarr, *csumarr, *treearr, num_parity_stripes = c->chunk_item->type & BLOCK_FLAG_RAID6 ? 2 : 1;
+    ULONG arrlen, errlen, *allocarr = NULL, *csumarr = NULL, *treearr = NULL, num_parity_stripes = c->chunk_item->type & BLOCK_FLAG_RAID6 ? 2 : 1;
+    ULONG read_stripes, j;
     scrub_context_raid56 context;
+    scrub_context_raid56_stripe* sets[2];
     UINT16 i;
+    int cur;
     CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
     
     TRACE("(%p, %p, %llx, %llx)\n", Vcb, c, stripe_start, stripe_end);
     
+    RtlZeroMemory(&context, sizeof(scrub_context_raid56));
+    sets[0] = sets[1] = NULL;
+    
     full_stripe_len = (c->chunk_item->num_stripes - num_parity_stripes) * c->chunk_item->stripe_length;
     run_start = c->offset + (stripe_start * full_stripe_len);
     run_end = c->offset + ((stripe_end + 1) * full_stripe_len);
     
+    max_read = min(1048576 / c->chunk_item->stripe_length, stripe_end - stripe_start + 1); // only process 1 MB of data at a time
+    
     searchkey.obj_id = run_start;
     searchkey.obj_type = TYPE_METADATA_ITEM;
     searchkey.offset = 0xffffffffffffffff;
@@ -2338,14 +2496,15 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
     allocarr = ExAllocatePoolWithTag(PagedPool, arrlen, ALLOC_TAG);
     if (!allocarr) {
         ERR("out of memory\n");
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
     }
     
     treearr = ExAllocatePoolWithTag(PagedPool, arrlen, ALLOC_TAG);
     if (!treearr) {
         ERR("out of memory\n");
-        ExFreePool(allocarr);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
     }
     
     RtlInitializeBitMap(&context.alloc, allocarr, num_sectors);
@@ -2354,22 +2513,21 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
     RtlInitializeBitMap(&context.is_tree, treearr, num_sectors);
     RtlClearAllBits(&context.is_tree);
     
-    context.parity_scratch = ExAllocatePoolWithTag(PagedPool, c->chunk_item->stripe_length, ALLOC_TAG);
+    // each full stripe in a read gets its own scratch space and error bitmaps, so that they can be checked in parallel
+    
+    context.parity_scratch = ExAllocatePoolWithTag(PagedPool, max_read * c->chunk_item->stripe_length, ALLOC_TAG);
     if (!context.parity_scratch) {
         ERR("out of memory\n");
-        ExFreePool(allocarr);
-        ExFreePool(treearr);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
     }
     
     if (c->chunk_item->type & BLOCK_FLAG_DATA) {
         csumarr = ExAllocatePoolWithTag(PagedPool, arrlen, ALLOC_TAG);
         if (!csumarr) {
             ERR("out of memory\n");
-            ExFreePool(allocarr);
-            ExFreePool(treearr);
-            ExFreePool(context.parity_scratch);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
         
         RtlInitializeBitMap(&context.has_csum, csumarr, num_sectors);
@@ -2378,31 +2536,40 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
         context.csum = ExAllocatePoolWithTag(PagedPool, num_sectors * sizeof(UINT32), ALLOC_TAG);
         if (!context.csum) {
             ERR("out of memory\n");
-            ExFreePool(allocarr);
-            ExFreePool(treearr);
-            ExFreePool(context.parity_scratch);
-            ExFreePool(csumarr);
-            return STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
     }
     
     if (c->chunk_item->type & BLOCK_FLAG_RAID6) {
-        context.parity_scratch2 = ExAllocatePoolWithTag(PagedPool, c->chunk_item->stripe_length, ALLOC_TAG);
+        context.parity_scratch2 = ExAllocatePoolWithTag(PagedPool, max_read * c->chunk_item->stripe_length, ALLOC_TAG);
         if (!context.parity_scratch2) {
             ERR("out of memory\n");
-            ExFreePool(allocarr);
-            ExFreePool(treearr);
-            ExFreePool(context.parity_scratch);
-            
-            if (c->chunk_item->type & BLOCK_FLAG_DATA) {
-                ExFreePool(csumarr);
-                ExFreePool(context.csum);
-            }
-            
-            return STATUS_INSUFFICIENT_RESOURCES;
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
     }
     
+    errlen = sector_align(((c->chunk_item->stripe_length / Vcb->superblock.sector_size) / 8) + 1, sizeof(ULONG));
+    
+    context.errors = ExAllocatePoolWithTag(PagedPool, sizeof(RTL_BITMAP) * max_read * c->chunk_item->num_stripes, ALLOC_TAG);
+    if (!context.errors) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+    
+    context.errorarr = ExAllocatePoolWithTag(PagedPool, errlen * max_read * c->chunk_item->num_stripes, ALLOC_TAG);
+    if (!context.errorarr) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+    
+    for (j = 0; j < max_read * c->chunk_item->num_stripes; j++) {
+        RtlInitializeBitMap(&context.errors[j], (ULONG*)((UINT8*)context.errorarr + (j * errlen)), c->chunk_item->stripe_length / Vcb->superblock.sector_size);
+    }
+    
     do {
         traverse_ptr next_tp;
         
@@ -2482,189 +2649,146 @@ static NTSTATUS scrub_chunk_raid56_stripe_run(device_extension* Vcb, chunk* c, U
             tp = next_tp;
     } while (b);
     
-    context.stripes = ExAllocatePoolWithTag(PagedPool, sizeof(scrub_context_raid56_stripe) * c->chunk_item->num_stripes, ALLOC_TAG);
-    if (!context.stripes) {
-        ERR("out of memory\n");
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        goto end;
-    }
-    
-    max_read = min(1048576 / c->chunk_item->stripe_length, stripe_end - stripe_start + 1); // only process 1 MB of data at a time
-    
-    for (i = 0; i < c->chunk_item->num_stripes; i++) {
-        context.stripes[i].buf = ExAllocatePoolWithTag(PagedPool, max_read * c->chunk_item->stripe_length, ALLOC_TAG);
-        if (!context.stripes[i].buf) {
-            UINT64 j;
-            
+    // Two sets of buffers, so that the next lot can be read while we're checking this one.
+    for (cur = 0; cur < 2; cur++) {
+        sets[cur] = ExAllocatePoolWithTag(PagedPool, sizeof(scrub_context_raid56_stripe) * c->chunk_item->num_stripes, ALLOC_TAG);
+        if (!sets[cur]) {
             ERR("out of memory\n");
-            
-            for (j = 0; j < i; j++) {
-                ExFreePool(context.stripes[j].buf);
-            }
-            ExFreePool(context.stripes);
-            
             Status = STATUS_INSUFFICIENT_RESOURCES;
             goto end;
         }
         
-        context.stripes[i].errorarr = ExAllocatePoolWithTag(PagedPool, sector_align(((c->chunk_item->stripe_length / Vcb->superblock.sector_size) / 8) + 1, sizeof(ULONG)), ALLOC_TAG);
-        if (!context.stripes[i].errorarr) {
-            UINT64 j;
-            
-            ERR("out of memory\n");
-            
-            ExFreePool(context.stripes[i].buf);
-            
-            for (j = 0; j < i; j++) {
-                ExFreePool(context.stripes[j].buf);
+        RtlZeroMemory(sets[cur], sizeof(scrub_context_raid56_stripe) * c->chunk_item->num_stripes);
+        
+        for (i = 0; i < c->chunk_item->num_stripes; i++) {
+            sets[cur][i].buf = ExAllocatePoolWithTag(PagedPool, max_read * c->chunk_item->stripe_length, ALLOC_TAG);
+            if (!sets[cur][i].buf) {
+                ERR("out of memory\n");
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
             }
-            ExFreePool(context.stripes);
             
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
+            sets[cur][i].context = &context;
         }
-        
-        RtlInitializeBitMap(&context.stripes[i].error, context.stripes[i].errorarr, c->chunk_item->stripe_length / Vcb->superblock.sector_size);
-        
-        context.stripes[i].context = &context;
-        context.stripes[i].rewrite = FALSE;
     }
     
+    cur = 0;
     stripe = stripe_start;
+    read_stripes = (ULONG)min(max_read, stripe_end + 1 - stripe);
     
     chunk_lock_range(Vcb, c, run_start, run_end - run_start);
+    locked = TRUE;
     
-    do {
-        ULONG read_stripes;
-        
-        if (max_read < stripe_end + 1 - stripe)
-            read_stripes = max_read;
-        else
-            read_stripes = stripe_end + 1 - stripe;
+    Status = scrub_raid56_start_read(Vcb, c, &context, sets[cur], stripe, read_stripes);
+    if (!NT_SUCCESS(Status)) {
+        ERR("scrub_raid56_start_read returned %08x\n", Status);
+        goto end;
+    }
+    
+    pending = TRUE;
+    
+    while (TRUE) {
+        UINT64 next_stripe = stripe + read_stripes;
+        ULONG next_read_stripes = 0;
         
-        context.stripes_left = c->chunk_item->num_stripes;
+        KeWaitForSingleObject(&context.Event, Executive, KernelMode, FALSE, NULL);
+        pending = FALSE;
         
-        // read megabyte by megabyte
+        // return an error if any of the stripes returned an error
         for (i = 0; i < c->chunk_item->num_stripes; i++) {
-            PIO_STACK_LOCATION IrpSp;
-
-            context.stripes[i].Irp = IoAllocateIrp(c->devices[i]->devobj->StackSize, FALSE);
-            
-            if (!context.stripes[i].Irp) {
-                ERR("IoAllocateIrp failed\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end2;
+            if (!NT_SUCCESS(sets[cur][i].iosb.Status)) {
+                Status = sets[cur][i].iosb.Status;
+                goto end;
             }
-            
-            IrpSp = IoGetNextIrpStackLocation(context.stripes[i].Irp);
-            IrpSp->MajorFunction = IRP_MJ_READ;
-            
-            if (c->devices[i]->devobj->Flags & DO_BUFFERED_IO) {
-                context.stripes[i].Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPool, read_stripes * c->chunk_item->stripe_length, ALLOC_TAG);
-                if (!context.stripes[i].Irp->AssociatedIrp.SystemBuffer) {
-                    ERR("out of memory\n");
-                    return STATUS_INSUFFICIENT_RESOURCES;
-                }
-
-                context.stripes[i].Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER | IRP_INPUT_OPERATION;
-
-                context.stripes[i].Irp->UserBuffer = context.stripes[i].buf;
-            } else if (c->devices[i]->devobj->Flags & DO_DIRECT_IO) {
-                context.stripes[i].Irp->MdlAddress = IoAllocateMdl(context.stripes[i].buf, read_stripes * c->chunk_item->stripe_length, FALSE, FALSE, NULL);
-                if (!context.stripes[i].Irp->MdlAddress) {
-                    ERR("IoAllocateMdl failed\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
-                
-                MmProbeAndLockPages(context.stripes[i].Irp->MdlAddress, KernelMode, IoWriteAccess);
-            } else
-                context.stripes[i].Irp->UserBuffer = context.stripes[i].buf;
-            
-            context.stripes[i].offset = stripe * c->chunk_item->stripe_length;
-
-            IrpSp->Parameters.Read.Length = read_stripes * c->chunk_item->stripe_length;
-            IrpSp->Parameters.Read.ByteOffset.QuadPart = cis[i].offset + context.stripes[i].offset;
-            
-            context.stripes[i].Irp->UserIosb = &context.stripes[i].iosb;
-            
-            IoSetCompletionRoutine(context.stripes[i].Irp, scrub_read_completion_raid56, &context.stripes[i], TRUE, TRUE, TRUE);
-            
-            Vcb->scrub.data_scrubbed += read_stripes * c->chunk_item->stripe_length;
-        }
-        
-        KeInitializeEvent(&context.Event, NotificationEvent, FALSE);
-        
-        for (i = 0; i < c->chunk_item->num_stripes; i++) {
-            IoCallDriver(c->devices[i]->devobj, context.stripes[i].Irp);
         }
         
-        KeWaitForSingleObject(&context.Event, Executive, KernelMode, FALSE, NULL);
+        scrub_raid56_free_irps(c, sets[cur]);
         
-        // return an error if any of the stripes returned an error
-        for (i = 0; i < c->chunk_item->num_stripes; i++) {
-            if (!NT_SUCCESS(context.stripes[i].iosb.Status)) {
-                Status = context.stripes[i].iosb.Status;
-                goto end2;
+        if (next_stripe <= stripe_end && !Vcb->scrub.stopping) {
+            next_read_stripes = (ULONG)min(max_read, stripe_end + 1 - next_stripe);
+            
+            Status = scrub_raid56_start_read(Vcb, c, &context, sets[1 - cur], next_stripe, next_read_stripes);
+            if (!NT_SUCCESS(Status)) {
+                ERR("scrub_raid56_start_read returned %08x\n", Status);
+                goto end;
             }
+            
+            pending = TRUE;
         }
         
-        if (c->chunk_item->type & BLOCK_FLAG_RAID6) {
-            for (i = 0; i < read_stripes; i++) {
-                scrub_raid6_stripe(Vcb, c, &context, stripe_start, stripe, i);
-            }
-        } else {
-            for (i = 0; i < read_stripes; i++) {
-                scrub_raid5_stripe(Vcb, c, &context, stripe_start, stripe, i);
-            }
+        context.stripes = sets[cur];
+        
+        Status = scrub_raid56_check(Vcb, c, &context, stripe_start, stripe, read_stripes);
+        if (!NT_SUCCESS(Status)) {
+            ERR("scrub_raid56_check returned %08x\n", Status);
+            goto end;
         }
-        stripe += read_stripes;
         
         for (i = 0; i < c->chunk_item->num_stripes; i++) {
-            if (context.stripes[i].Irp) {
-                if (c->devices[i]->devobj->Flags & DO_DIRECT_IO && context.stripes[i].Irp->MdlAddress) {
-                    MmUnlockPages(context.stripes[i].Irp->MdlAddress);
-                    IoFreeMdl(context.stripes[i].Irp->MdlAddress);
-                }
-                IoFreeIrp(context.stripes[i].Irp);
-                context.stripes[i].Irp = NULL;
+            if (sets[cur][i].rewrite) {
+                Status = write_data_phys(c->devices[i]->devobj, cis[i].offset + sets[cur][i].offset,
+                                         sets[cur][i].buf, read_stripes * c->chunk_item->stripe_length, FALSE);
                 
-                if (context.stripes[i].rewrite) {
-                    Status = write_data_phys(c->devices[i]->devobj, cis[i].offset + context.stripes[i].offset,
-                                             context.stripes[i].buf, read_stripes * c->chunk_item->stripe_length, FALSE);
-                    
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("write_data_phys returned %08x\n", Status);
-                        return Status;
-                    }
+                if (!NT_SUCCESS(Status)) {
+                    ERR("write_data_phys returned %08x\n", Status);
+                    goto end;
                 }
             }
         }
-    } while (stripe < stripe_end);
-    
-    chunk_unlock_range(Vcb, c, run_start, run_end - run_start);
+        
+        if (!pending)
+            break;
+        
+        stripe = next_stripe;
+        read_stripes = next_read_stripes;
+        cur = 1 - cur;
+    }
     
     Status = STATUS_SUCCESS;
     
-end2:
-    for (i = 0; i < c->chunk_item->num_stripes; i++) {
-        ExFreePool(context.stripes[i].buf);
-        ExFreePool(context.stripes[i].errorarr);
+end:
+    if (pending)
+        KeWaitForSingleObject(&context.Event, Executive, KernelMode, FALSE, NULL);
+    
+    if (locked)
+        chunk_unlock_range(Vcb, c, run_start, run_end - run_start);
+    
+    for (cur = 0; cur < 2; cur++) {
+        if (sets[cur]) {
+            scrub_raid56_free_irps(c, sets[cur]);
+            
+            for (i = 0; i < c->chunk_item->num_stripes; i++) {
+                if (sets[cur][i].buf)
+                    ExFreePool(sets[cur][i].buf);
+            }
+            
+            ExFreePool(sets[cur]);
+        }
     }
-    ExFreePool(context.stripes);
     
-end:
-    ExFreePool(treearr);
-    ExFreePool(allocarr);
-    ExFreePool(context.parity_scratch);
+    if (context.errorarr)
+        ExFreePool(context.errorarr);
     
-    if (c->chunk_item->type & BLOCK_FLAG_RAID6)
+    if (context.errors)
+        ExFreePool(context.errors);
+    
+    if (treearr)
+        ExFreePool(treearr);
+    
+    if (allocarr)
+        ExFreePool(allocarr);
+    
+    if (context.parity_scratch)
+        ExFreePool(context.parity_scratch);
+    
+    if (context.parity_scratch2)
         ExFreePool(context.parity_scratch2);
     
-    if (c->chunk_item->type & BLOCK_FLAG_DATA) {
+    if (csumarr)
         ExFreePool(csumarr);
+    
+    if (context.csum)
         ExFreePool(context.csum);
-    }
     
     return Status;
 }
@@ -2756,40 +2880,475 @@ static NTSTATUS scrub_chunk_raid56(device_extension* Vcb, chunk* c, UINT64* offs
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOOL* changed) {
+static NTSTATUS load_scrub_csums(device_extension* Vcb, scrub_item* item) {
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
-    BOOL b = FALSE, tree_run = FALSE;
-    ULONG type, num_extents = 0;
-    UINT64 total_data = 0, tree_run_start, tree_run_end;
-    
-    TRACE("chunk %llx\n", c->offset);
     
-    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    item->csum = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * item->size / Vcb->superblock.sector_size, ALLOC_TAG);
+    if (!item->csum) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
     
-    if (c->chunk_item->type & BLOCK_FLAG_DUPLICATE)
-        type = BLOCK_FLAG_DUPLICATE;
-    else if (c->chunk_item->type & BLOCK_FLAG_RAID0)
-        type = BLOCK_FLAG_RAID0;
-    else if (c->chunk_item->type & BLOCK_FLAG_RAID1)
-        type = BLOCK_FLAG_DUPLICATE;
-    else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
-        type = BLOCK_FLAG_RAID10;
-    else if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
-        Status = scrub_chunk_raid56(Vcb, c, offset, changed);
-        goto end;
-    } else if (c->chunk_item->type & BLOCK_FLAG_RAID6) {
-        Status = scrub_chunk_raid56(Vcb, c, offset, changed);
-        goto end;
-    } else // SINGLE
-        type = BLOCK_FLAG_DUPLICATE;
+    item->bmparr = ExAllocatePoolWithTag(PagedPool, sector_align(((item->size / Vcb->superblock.sector_size) >> 3) + 1, sizeof(ULONG)), ALLOC_TAG);
+    if (!item->bmparr) {
+        ERR("out of memory\n");
+        ExFreePool(item->csum);
+        item->csum = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+        
+    RtlInitializeBitMap(&item->bmp, item->bmparr, item->size / Vcb->superblock.sector_size);
+    RtlSetAllBits(&item->bmp); // 1 = no csum, 0 = csum
     
-    searchkey.obj_id = *offset;
-    searchkey.obj_type = TYPE_METADATA_ITEM;
-    searchkey.offset = 0xffffffffffffffff;
+    searchkey.obj_id = EXTENT_CSUM_ID;
+    searchkey.obj_type = TYPE_EXTENT_CSUM;
+    searchkey.offset = item->address;
     
-    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, NULL);
+    Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, NULL);
+    if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
+        ERR("find_item returned %08x\n", Status);
+        ExFreePool(item->csum);
+        ExFreePool(item->bmparr);
+        item->csum = NULL;
+        item->bmparr = NULL;
+        return Status;
+    }
+    
+    if (Status != STATUS_NOT_FOUND) {
+        do {
+            traverse_ptr next_tp;
+            
+            if (tp.item->key.obj_type == TYPE_EXTENT_CSUM) {
+                if (tp.item->key.offset >= item->address + item->size)
+                    break;
+                else if (tp.item->size >= sizeof(UINT32) && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)) >= item->address) {
+                    UINT64 cs = max(item->address, tp.item->key.offset);
+                    UINT64 ce = min(item->address + item->size, tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)));
+                    
+                    RtlCopyMemory(item->csum + ((cs - item->address) / Vcb->superblock.sector_size),
+                                  tp.item->data + ((cs - tp.item->key.offset) * sizeof(UINT32) / Vcb->superblock.sector_size),
+                                  (ce - cs) * sizeof(UINT32) / Vcb->superblock.sector_size);
+                    
+                    RtlClearBits(&item->bmp, (cs - item->address) / Vcb->superblock.sector_size, (ce - cs) / Vcb->superblock.sector_size);
+                    
+                    if (ce == item->address + item->size)
+                        break;
+                }
+            }
+            
+            if (find_next_item(Vcb, &tp, &next_tp, FALSE, NULL))
+                tp = next_tp;
+            else
+                break;
+        } while (TRUE);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static ULONG get_stripe_pieces(device_extension* Vcb, chunk* c, UINT16 stripe, scrub_item* items, ULONG num_items, UINT32 window, scrub_piece* pieces) {
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&c->chunk_item[1];
+    UINT64 stripe_length = c->chunk_item->stripe_length;
+    UINT16 ways, col;
+    ULONG i, num_pieces = 0;
+    
+    if (c->chunk_item->type & BLOCK_FLAG_RAID0) {
+        ways = c->chunk_item->num_stripes;
+        col = stripe;
+    } else if (c->chunk_item->type & BLOCK_FLAG_RAID10) {
+        UINT16 sub_stripes = max(c->chunk_item->sub_stripes, 1);
+        
+        ways = c->chunk_item->num_stripes / sub_stripes;
+        col = stripe / sub_stripes;
+    } else {
+        ways = 1;
+        col = 0;
+    }
+    
+    for (i = 0; i < num_items; i++) {
+        UINT64 pos = items[i].address - c->offset, end = pos + items[i].size;
+        
+        while (pos < end) {
+            UINT64 stripe_num, phys;
+            UINT32 len;
+            
+            if (ways == 1) {
+                stripe_num = 0;
+                phys = pos;
+                len = (UINT32)min(end - pos, window);
+            } else {
+                stripe_num = pos / stripe_length;
+                phys = ((stripe_num / ways) * stripe_length) + (pos % stripe_length);
+                len = (UINT32)min(min(end - pos, stripe_length - (pos % stripe_length)), window);
+            }
+            
+            if (stripe_num % ways == col) {
+                if (pieces) {
+                    pieces[num_pieces].phys = cis[stripe].offset + phys;
+                    pieces[num_pieces].address = c->offset + pos;
+                    pieces[num_pieces].length = len;
+                    pieces[num_pieces].item = i;
+                }
+                
+                num_pieces++;
+            }
+            
+            pos += len;
+        }
+    }
+    
+    return num_pieces;
+}
+
+static void verify_scrub_piece(device_extension* Vcb, scrub_item* item, scrub_piece* piece, UINT8* data, UINT32* csum) {
+    ULONG j;
+    
+    if (item->csum) {
+        ULONG first = (ULONG)((piece->address - item->address) / Vcb->superblock.sector_size);
+        ULONG sectors = piece->length / Vcb->superblock.sector_size;
+        
+        for (j = 0; j < sectors; j++) {
+            if (!RtlCheckBit(&item->bmp, first + j) && csum[j] != item->csum[first + j]) {
+                item->bad = TRUE;
+                break;
+            }
+        }
+    } else {
+        for (j = 0; j < piece->length / Vcb->superblock.node_size; j++) {
+            tree_header* th = (tree_header*)&data[j * Vcb->superblock.node_size];
+            UINT32 crc32 = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+            
+            if (crc32 != *((UINT32*)th->csum) || th->address != piece->address + UInt32x32To64(j, Vcb->superblock.node_size)) {
+                item->bad = TRUE;
+                break;
+            }
+        }
+    }
+}
+
+static NTSTATUS scrub_device_stripes(scrub_reader* sr) {
+    device_extension* Vcb = sr->Vcb;
+    chunk* c = sr->c;
+    NTSTATUS Status;
+    UINT16 i;
+    UINT8* buf;
+    UINT32* csum = NULL;
+    UINT32 window = SCRUB_WINDOW;
+    scrub_piece* pieces = NULL;
+    LARGE_INTEGER time1, time2, freq;
+    
+    buf = ExAllocatePoolWithTag(PagedPool, window, ALLOC_TAG);
+    if (!buf) {
+        // fall back to a smaller window rather than failing the scrub
+        window = SCRUB_UNIT;
+        
+        buf = ExAllocatePoolWithTag(PagedPool, window, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    
+    csum = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * window / Vcb->superblock.sector_size, ALLOC_TAG);
+    if (!csum) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+    
+    for (i = 0; i < c->chunk_item->num_stripes; i++) {
+        ULONG num_pieces, j, k;
+        
+        if (c->devices[i] != sr->dev)
+            continue;
+        
+        num_pieces = get_stripe_pieces(Vcb, c, i, sr->items, sr->num_items, window, NULL);
+        if (num_pieces == 0)
+            continue;
+        
+        pieces = ExAllocatePoolWithTag(PagedPool, sizeof(scrub_piece) * num_pieces, ALLOC_TAG);
+        if (!pieces) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
+        }
+        
+        get_stripe_pieces(Vcb, c, i, sr->items, sr->num_items, window, pieces);
+        
+        j = 0;
+        while (j < num_pieces && !Vcb->scrub.stopping) {
+            UINT64 start = pieces[j].phys, end = pieces[j].phys + pieces[j].length;
+            BOOL has_data = sr->items[pieces[j].item].csum ? TRUE : FALSE;
+            
+            // The pieces are in disk order, so take as many as fit in one read. Any gaps are read
+            // too, as keeping the device streaming is cheaper than seeking over them.
+            k = j + 1;
+            while (k < num_pieces && pieces[k].phys + pieces[k].length <= start + window) {
+                end = pieces[k].phys + pieces[k].length;
+                
+                if (sr->items[pieces[k].item].csum)
+                    has_data = TRUE;
+                
+                k++;
+            }
+            
+            time1 = KeQueryPerformanceCounter(&freq);
+            
+            Status = sync_read_phys(sr->dev->devobj, start, (ULONG)(end - start), buf, FALSE);
+            
+            time2 = KeQueryPerformanceCounter(NULL);
+            
+            sr->read_time += (time2.QuadPart - time1.QuadPart) * 10000000 / freq.QuadPart;
+            sr->data_read += end - start;
+            sr->num_reads++;
+            InterlockedExchangeAdd64((LONGLONG*)&Vcb->scrub.data_scrubbed, end - start);
+            
+            if (!NT_SUCCESS(Status)) {
+                WARN("sync_read_phys returned %08x\n", Status);
+                
+                // scrub_extent will try again, and report the error if it's still there
+                for (; j < k; j++) {
+                    sr->items[pieces[j].item].bad = TRUE;
+                }
+                
+                continue;
+            }
+            
+            // checksum the whole window in one go, so that it's spread over all the calc threads
+            if (has_data) {
+                Status = calc_csum(Vcb, buf, (UINT32)((end - start) / Vcb->superblock.sector_size), csum);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("calc_csum returned %08x\n", Status);
+                    goto end;
+                }
+            }
+            
+            for (; j < k; j++) {
+                UINT32 off = (UINT32)(pieces[j].phys - start);
+                
+                verify_scrub_piece(Vcb, &sr->items[pieces[j].item], &pieces[j], buf + off, &csum[off / Vcb->superblock.sector_size]);
+            }
+        }
+        
+        ExFreePool(pieces);
+        pieces = NULL;
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    if (pieces)
+        ExFreePool(pieces);
+    
+    if (csum)
+        ExFreePool(csum);
+    
+    ExFreePool(buf);
+    
+    return Status;
+}
+
+static void scrub_reader_thread(void* context) {
+    scrub_reader* sr = context;
+    
+    sr->Status = scrub_device_stripes(sr);
+    
+    KeSetEvent(&sr->finished, 0, FALSE);
+}
+
+static void add_scrub_device_stats(device_extension* Vcb, scrub_reader* readers, UINT16 num_readers) {
+    UINT16 i;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->scrub.stats_lock, TRUE);
+    
+    for (i = 0; i < num_readers; i++) {
+        scrub_device_stats* sds = NULL;
+        LIST_ENTRY* le = Vcb->scrub.devices.Flink;
+        
+        while (le != &Vcb->scrub.devices) {
+            scrub_device_stats* sds2 = CONTAINING_RECORD(le, scrub_device_stats, list_entry);
+            
+            if (sds2->dev_id == readers[i].dev->devitem.dev_id) {
+                sds = sds2;
+                break;
+            }
+            
+            le = le->Flink;
+        }
+        
+        if (!sds) {
+            sds = ExAllocatePoolWithTag(PagedPool, sizeof(scrub_device_stats), ALLOC_TAG);
+            if (!sds) {
+                ERR("out of memory\n");
+                break;
+            }
+            
+            sds->dev_id = readers[i].dev->devitem.dev_id;
+            sds->data_scrubbed = 0;
+            sds->read_time = 0;
+            sds->num_reads = 0;
+            
+            InsertTailList(&Vcb->scrub.devices, &sds->list_entry);
+        }
+        
+        sds->data_scrubbed += readers[i].data_read;
+        sds->read_time += readers[i].read_time;
+        sds->num_reads += readers[i].num_reads;
+    }
+    
+    ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+}
+
+static NTSTATUS scrub_items(device_extension* Vcb, chunk* c, ULONG type, scrub_item* items, ULONG num_items) {
+    NTSTATUS Status;
+    scrub_reader* readers;
+    UINT16 i, j, num_readers = 0;
+    ULONG k;
+    
+    if (num_items == 0)
+        return STATUS_SUCCESS;
+    
+    readers = ExAllocatePoolWithTag(NonPagedPool, sizeof(scrub_reader) * c->chunk_item->num_stripes, ALLOC_TAG);
+    if (!readers) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    // one reader per device - DUP chunks have both their stripes on the same one
+    for (i = 0; i < c->chunk_item->num_stripes; i++) {
+        BOOL found = FALSE;
+        
+        if (!c->devices[i] || !c->devices[i]->devobj)
+            continue;
+        
+        for (j = 0; j < num_readers; j++) {
+            if (readers[j].dev == c->devices[i]) {
+                found = TRUE;
+                break;
+            }
+        }
+        
+        if (found)
+            continue;
+        
+        readers[num_readers].Vcb = Vcb;
+        readers[num_readers].c = c;
+        readers[num_readers].dev = c->devices[i];
+        readers[num_readers].items = items;
+        readers[num_readers].num_items = num_items;
+        readers[num_readers].thread = NULL;
+        readers[num_readers].Status = STATUS_SUCCESS;
+        readers[num_readers].data_read = 0;
+        readers[num_readers].read_time = 0;
+        readers[num_readers].num_reads = 0;
+        KeInitializeEvent(&readers[num_readers].finished, NotificationEvent, FALSE);
+        
+        num_readers++;
+    }
+    
+    if (num_readers == 1)
+        readers[0].Status = scrub_device_stripes(&readers[0]);
+    else {
+        for (j = 0; j < num_readers; j++) {
+            Status = PsCreateSystemThread(&readers[j].thread, 0, NULL, NULL, NULL, scrub_reader_thread, &readers[j]);
+            if (!NT_SUCCESS(Status)) {
+                WARN("PsCreateSystemThread returned %08x\n", Status);
+                readers[j].thread = NULL;
+                readers[j].Status = scrub_device_stripes(&readers[j]);
+            }
+        }
+        
+        for (j = 0; j < num_readers; j++) {
+            if (readers[j].thread) {
+                KeWaitForSingleObject(&readers[j].finished, Executive, KernelMode, FALSE, NULL);
+                ZwClose(readers[j].thread);
+            }
+        }
+    }
+    
+    add_scrub_device_stats(Vcb, readers, num_readers);
+    
+    for (j = 0; j < num_readers; j++) {
+        if (!NT_SUCCESS(readers[j].Status)) {
+            ERR("scrub_device_stripes returned %08x\n", readers[j].Status);
+            Status = readers[j].Status;
+            goto end;
+        }
+    }
+    
+    // Anything which failed goes through scrub_extent, which reads all the copies
+    // together so that it can log the error and repair from a good one.
+    for (k = 0; k < num_items && !Vcb->scrub.stopping; k++) {
+        if (!items[k].bad)
+            continue;
+        
+        if (items[k].csum) {
+            Status = scrub_data_extent(Vcb, c, items[k].address, type, items[k].csum, &items[k].bmp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("scrub_data_extent returned %08x\n", Status);
+                goto end;
+            }
+        } else {
+            Status = scrub_extent(Vcb, c, type, items[k].address, items[k].size, NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("scrub_extent returned %08x\n", Status);
+                goto end;
+            }
+        }
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    ExFreePool(readers);
+    
+    return Status;
+}
+
+static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOOL* changed) {
+    NTSTATUS Status;
+    KEY searchkey;
+    traverse_ptr tp;
+    BOOL b = FALSE;
+    ULONG type, i, num_items = 0;
+    UINT64 total_data = 0;
+    scrub_item* items = NULL;
+    
+    TRACE("chunk %llx\n", c->offset);
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    
+    if (c->chunk_item->type & BLOCK_FLAG_DUPLICATE)
+        type = BLOCK_FLAG_DUPLICATE;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID0)
+        type = BLOCK_FLAG_RAID0;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID1)
+        type = BLOCK_FLAG_DUPLICATE;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID10)
+        type = BLOCK_FLAG_RAID10;
+    else if (c->chunk_item->type & BLOCK_FLAG_RAID5) {
+        Status = scrub_chunk_raid56(Vcb, c, offset, changed);
+        goto end;
+    } else if (c->chunk_item->type & BLOCK_FLAG_RAID6) {
+        Status = scrub_chunk_raid56(Vcb, c, offset, changed);
+        goto end;
+    } else // SINGLE
+        type = BLOCK_FLAG_DUPLICATE;
+    
+    items = ExAllocatePoolWithTag(PagedPool, sizeof(scrub_item) * SCRUB_MAX_ITEMS, ALLOC_TAG);
+    if (!items) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto end;
+    }
+    
+    searchkey.obj_id = *offset;
+    searchkey.obj_type = TYPE_METADATA_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
+    
+    Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE, NULL);
     if (!NT_SUCCESS(Status)) {
         ERR("error - find_item returned %08x\n", Status);
         goto end;
@@ -2804,9 +3363,6 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOO
         if (tp.item->key.obj_id >= *offset && (tp.item->key.obj_type == TYPE_EXTENT_ITEM || tp.item->key.obj_type == TYPE_METADATA_ITEM)) {
             UINT64 size = tp.item->key.obj_type == TYPE_METADATA_ITEM ? Vcb->superblock.node_size : tp.item->key.offset;
             BOOL is_tree;
-            UINT32* csum = NULL;
-            RTL_BITMAP bmp;
-            ULONG* bmparr = NULL;
             
             TRACE("%llx\n", tp.item->key.obj_id);
             
@@ -2833,113 +3389,44 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOO
                 goto end;
             }
             
-            // load csum
-            if (!is_tree) {
-                traverse_ptr tp2;
-                
-                csum = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * size / Vcb->superblock.sector_size, ALLOC_TAG);
-                if (!csum) {
-                    ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
-                
-                bmparr = ExAllocatePoolWithTag(PagedPool, sector_align(((size / Vcb->superblock.sector_size) >> 3) + 1, sizeof(ULONG)), ALLOC_TAG);
-                if (!bmparr) {
-                    ERR("out of memory\n");
-                    ExFreePool(csum);
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
+            if (is_tree) {
+                // merge runs of adjacent tree blocks
+                if (num_items > 0 && !items[num_items - 1].csum && items[num_items - 1].address + items[num_items - 1].size == tp.item->key.obj_id)
+                    items[num_items - 1].size += size;
+                else {
+                    items[num_items].address = tp.item->key.obj_id;
+                    items[num_items].size = size;
+                    items[num_items].csum = NULL;
+                    items[num_items].bmparr = NULL;
+                    items[num_items].bad = FALSE;
+                    num_items++;
                 }
-                    
-                RtlInitializeBitMap(&bmp, bmparr, size / Vcb->superblock.sector_size);
-                RtlSetAllBits(&bmp); // 1 = no csum, 0 = csum
-                
-                searchkey.obj_id = EXTENT_CSUM_ID;
-                searchkey.obj_type = TYPE_EXTENT_CSUM;
-                searchkey.offset = tp.item->key.obj_id;
+            } else {
+                items[num_items].address = tp.item->key.obj_id;
+                items[num_items].size = size;
+                items[num_items].bad = FALSE;
                 
-                Status = find_item(Vcb, Vcb->checksum_root, &tp2, &searchkey, FALSE, NULL);
-                if (!NT_SUCCESS(Status) && Status != STATUS_NOT_FOUND) {
-                    ERR("find_item returned %08x\n", Status);
-                    ExFreePool(csum);
-                    ExFreePool(bmparr);
+                Status = load_scrub_csums(Vcb, &items[num_items]);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("load_scrub_csums returned %08x\n", Status);
                     goto end;
                 }
                 
-                if (Status != STATUS_NOT_FOUND) {
-                    do {
-                        traverse_ptr next_tp2;
-                        
-                        if (tp2.item->key.obj_type == TYPE_EXTENT_CSUM) {
-                            if (tp2.item->key.offset >= tp.item->key.obj_id + size)
-                                break;
-                            else if (tp2.item->size >= sizeof(UINT32) && tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / sizeof(UINT32)) >= tp.item->key.obj_id) {
-                                UINT64 cs = max(tp.item->key.obj_id, tp2.item->key.offset);
-                                UINT64 ce = min(tp.item->key.obj_id + size, tp2.item->key.offset + (tp2.item->size * Vcb->superblock.sector_size / sizeof(UINT32)));
-                                
-                                RtlCopyMemory(csum + ((cs - tp.item->key.obj_id) / Vcb->superblock.sector_size),
-                                              tp2.item->data + ((cs - tp2.item->key.offset) * sizeof(UINT32) / Vcb->superblock.sector_size),
-                                              (ce - cs) * sizeof(UINT32) / Vcb->superblock.sector_size);
-                                
-                                RtlClearBits(&bmp, (cs - tp.item->key.obj_id) / Vcb->superblock.sector_size, (ce - cs) / Vcb->superblock.sector_size);
-                                
-                                if (ce == tp.item->key.obj_id + size)
-                                    break;
-                            }
-                        }
-                        
-                        if (find_next_item(Vcb, &tp2, &next_tp2, FALSE, NULL))
-                            tp2 = next_tp2;
-                        else
-                            break;
-                    } while (TRUE);
-                }
-            }
-            
-            if (tree_run) {
-                if (!is_tree || tp.item->key.obj_id > tree_run_end) {
-                    Status = scrub_extent(Vcb, c, type, tree_run_start, tree_run_end - tree_run_start, NULL);
-                    if (!NT_SUCCESS(Status)) {
-                        ERR("scrub_extent returned %08x\n", Status);
-                        goto end;
-                    }
-                    
-                    if (!is_tree)
-                        tree_run = FALSE;
-                    else {
-                        tree_run_start = tp.item->key.obj_id;
-                        tree_run_end = tp.item->key.obj_id + Vcb->superblock.node_size;
-                    }
+                // nothing to check if the extent is nodatasum
+                if (RtlAreBitsSet(&items[num_items].bmp, 0, (ULONG)(size / Vcb->superblock.sector_size))) {
+                    ExFreePool(items[num_items].csum);
+                    ExFreePool(items[num_items].bmparr);
                 } else
-                    tree_run_end = tp.item->key.obj_id + Vcb->superblock.node_size;
-            } else if (is_tree) {
-                tree_run = TRUE;
-                tree_run_start = tp.item->key.obj_id;
-                tree_run_end = tp.item->key.obj_id + Vcb->superblock.node_size;
-            }
-            
-            if (!is_tree) {
-                Status = scrub_data_extent(Vcb, c, tp.item->key.obj_id, type, csum, &bmp);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("scrub_data_extent returned %08x\n", Status);
-                    goto end;
-                }
-            }
-            
-            if (!is_tree) {
-                ExFreePool(csum);
-                ExFreePool(bmparr);
+                    num_items++;
             }
             
             *offset = tp.item->key.obj_id + size;
             *changed = TRUE;
             
             total_data += size;
-            num_extents++;
             
             // only do so much at a time
-            if (num_extents >= 64 || total_data >= 0x8000000) // 128 MB
+            if (num_items >= SCRUB_MAX_ITEMS || total_data >= 0x8000000) // 128 MB
                 break;
         }
         
@@ -2949,17 +3436,26 @@ static NTSTATUS scrub_chunk(device_extension* Vcb, chunk* c, UINT64* offset, BOO
             tp = next_tp;
     } while (b);
     
-    if (tree_run) {
-        Status = scrub_extent(Vcb, c, type, tree_run_start, tree_run_end - tree_run_start, NULL);
-        if (!NT_SUCCESS(Status)) {
-            ERR("scrub_extent returned %08x\n", Status);
-            goto end;
-        }
+    Status = scrub_items(Vcb, c, type, items, num_items);
+    if (!NT_SUCCESS(Status)) {
+        ERR("scrub_items returned %08x\n", Status);
+        goto end;
     }
     
     Status = STATUS_SUCCESS;
     
 end:
+    if (items) {
+        for (i = 0; i < num_items; i++) {
+            if (items[i].csum) {
+                ExFreePool(items[i].csum);
+                ExFreePool(items[i].bmparr);
+            }
+        }
+        
+        ExFreePool(items);
+    }
+    
     ExReleaseResourceLite(&Vcb->tree_lock);
     
     return Status;
@@ -3008,6 +3504,11 @@ static void scrub_thread(void* context) {
         ExFreePool(err);
     }
     
+    while (!IsListEmpty(&Vcb->scrub.devices)) {
+        scrub_device_stats* sds = CONTAINING_RECORD(RemoveHeadList(&Vcb->scrub.devices), scrub_device_stats, list_entry);
+        ExFreePool(sds);
+    }
+    
     ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
     
     le = Vcb->chunks.Flink;
@@ -3035,7 +3536,7 @@ static void scrub_thread(void* context) {
     
     while (!IsListEmpty(&chunks)) {
         chunk* c = CONTAINING_RECORD(RemoveHeadList(&chunks), chunk, list_entry_balance);
-        UINT64 offset = c->offset;
+        UINT64 offset = c->offset, scrubbed;
         BOOL changed;
         
         c->reloc = TRUE;
@@ -3045,6 +3546,7 @@ static void scrub_thread(void* context) {
         if (!Vcb->scrub.stopping) {
             do {
                 changed = FALSE;
+                scrubbed = Vcb->scrub.data_scrubbed;
                 
                 Status = scrub_chunk(Vcb, c, &offset, &changed);
                 if (!NT_SUCCESS(Status)) {
@@ -3054,6 +3556,8 @@ static void scrub_thread(void* context) {
                     break;
                 }
                 
+                throttle_background_io(Vcb, Vcb->scrub.data_scrubbed - scrubbed, &Vcb->scrub.stopping);
+                
                 if (offset == c->offset + c->chunk_item->size || Vcb->scrub.stopping)
                     break;
                 
@@ -3223,6 +3727,59 @@ end:
     return Status;
 }
 
+NTSTATUS query_scrub_devices(device_extension* Vcb, KPROCESSOR_MODE processor_mode, void* data, ULONG length) {
+    btrfs_query_scrub_devices* bqsd = (btrfs_query_scrub_devices*)data;
+    btrfs_scrub_device* bsd;
+    ULONG len;
+    NTSTATUS Status;
+    LIST_ENTRY* le;
+    
+    if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_MANAGE_VOLUME_PRIVILEGE), processor_mode))
+        return STATUS_PRIVILEGE_NOT_HELD;
+    
+    if (!data || length < offsetof(btrfs_query_scrub_devices, devices))
+        return STATUS_BUFFER_TOO_SMALL;
+    
+    ExAcquireResourceSharedLite(&Vcb->scrub.stats_lock, TRUE);
+    
+    bqsd->num_devices = 0;
+    
+    le = Vcb->scrub.devices.Flink;
+    while (le != &Vcb->scrub.devices) {
+        bqsd->num_devices++;
+        le = le->Flink;
+    }
+    
+    len = length - offsetof(btrfs_query_scrub_devices, devices);
+    bsd = bqsd->devices;
+    
+    le = Vcb->scrub.devices.Flink;
+    while (le != &Vcb->scrub.devices) {
+        scrub_device_stats* sds = CONTAINING_RECORD(le, scrub_device_stats, list_entry);
+        
+        if (len < sizeof(btrfs_scrub_device)) {
+            Status = STATUS_BUFFER_OVERFLOW;
+            goto end;
+        }
+        
+        bsd->dev_id = sds->dev_id;
+        bsd->data_scrubbed = sds->data_scrubbed;
+        bsd->duration = sds->read_time;
+        bsd->num_reads = sds->num_reads;
+        
+        bsd++;
+        len -= sizeof(btrfs_scrub_device);
+        le = le->Flink;
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    ExReleaseResourceLite(&Vcb->scrub.stats_lock);
+    
+    return Status;
+}
+
 NTSTATUS pause_scrub(device_extension* Vcb, KPROCESSOR_MODE processor_mode) {
     LARGE_INTEGER time;
     
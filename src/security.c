@@ -51,6 +51,7 @@ static dacl def_dacls[] = {
 };
 
 extern LIST_ENTRY uid_map_list;
+extern LIST_ENTRY gid_map_list;
 
 // UINT32 STDCALL get_uid() {
 //     PACCESS_TOKEN at = PsReferencePrimaryToken(PsGetCurrentProcess());
@@ -118,14 +119,36 @@ extern LIST_ENTRY uid_map_list;
 //     return uid;
 // }
 
-void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
+// Both tables are built once from the registry in DriverEntry, so lookups don't need locking.
+static LIST_ENTRY uid_map_sid_hash[MAPPING_HASH_BUCKETS];
+static LIST_ENTRY uid_map_uid_hash[MAPPING_HASH_BUCKETS];
+static LIST_ENTRY gid_map_sid_hash[MAPPING_HASH_BUCKETS];
+static LIST_ENTRY gid_map_gid_hash[MAPPING_HASH_BUCKETS];
+
+void init_mappings() {
+    ULONG i;
+    
+    InitializeListHead(&uid_map_list);
+    InitializeListHead(&gid_map_list);
+    
+    for (i = 0; i < MAPPING_HASH_BUCKETS; i++) {
+        InitializeListHead(&uid_map_sid_hash[i]);
+        InitializeListHead(&uid_map_uid_hash[i]);
+        InitializeListHead(&gid_map_sid_hash[i]);
+        InitializeListHead(&gid_map_gid_hash[i]);
+    }
+}
+
+static __inline UINT32 sid_hash(PSID sid) {
+    return calc_crc32c(0xffffffff, (UINT8*)sid, RtlLengthSid(sid));
+}
+
+static sid_header* parse_sid_string(WCHAR* sidstring, ULONG sidstringlength) {
     unsigned int i, np;
     UINT8 numdashes;
     UINT64 val;
     ULONG sidsize;
     sid_header* sid;
-    uid_map* um;
-//     char s[255];
     
     if (sidstringlength < 4 ||
         sidstring[0] != 'S' ||
@@ -133,7 +156,7 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
         sidstring[2] != '1' ||
         sidstring[3] != '-') {
         ERR("invalid SID\n");
-        return;
+        return NULL;
     }
     
     sidstring = &sidstring[4];
@@ -151,7 +174,7 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
     sid = ExAllocatePoolWithTag(PagedPool, sidsize, ALLOC_TAG);
     if (!sid) {
         ERR("out of memory\n");
-        return;
+        return NULL;
     }
     
     sid->revision = 0x01;
@@ -195,9 +218,17 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
             break;
     }
     
-//     sid_to_string(sid, s);
+    return sid;
+}
+
+void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
+    sid_header* sid;
+    uid_map* um;
+    
+    sid = parse_sid_string(sidstring, sidstringlength);
+    if (!sid)
+        return;
     
-//     TRACE("%s\n", s);
     um = ExAllocatePoolWithTag(PagedPool, sizeof(uid_map), ALLOC_TAG);
     if (!um) {
         ERR("out of memory\n");
@@ -207,19 +238,48 @@ void add_user_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 uid) {
     
     um->sid = sid;
     um->uid = uid;
+    um->sid_hash = sid_hash(sid);
     
     InsertTailList(&uid_map_list, &um->listentry);
+    InsertTailList(&uid_map_sid_hash[um->sid_hash % MAPPING_HASH_BUCKETS], &um->listentry_sid);
+    InsertTailList(&uid_map_uid_hash[uid % MAPPING_HASH_BUCKETS], &um->listentry_id);
+}
+
+void add_group_mapping(WCHAR* sidstring, ULONG sidstringlength, UINT32 gid) {
+    sid_header* sid;
+    gid_map* gm;
+    
+    sid = parse_sid_string(sidstring, sidstringlength);
+    if (!sid)
+        return;
+    
+    gm = ExAllocatePoolWithTag(PagedPool, sizeof(gid_map), ALLOC_TAG);
+    if (!gm) {
+        ERR("out of memory\n");
+        ExFreePool(sid);
+        return;
+    }
+    
+    gm->sid = sid;
+    gm->gid = gid;
+    gm->sid_hash = sid_hash(sid);
+    
+    InsertTailList(&gid_map_list, &gm->listentry);
+    InsertTailList(&gid_map_sid_hash[gm->sid_hash % MAPPING_HASH_BUCKETS], &gm->listentry_sid);
+    InsertTailList(&gid_map_gid_hash[gid % MAPPING_HASH_BUCKETS], &gm->listentry_id);
 }
 
 void uid_to_sid(UINT32 uid, PSID* sid) {
-    LIST_ENTRY* le;
+    LIST_ENTRY *le, *bucket;
     uid_map* um;
     sid_header* sh;
     UCHAR els;
     
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        um = CONTAINING_RECORD(le, uid_map, listentry);
+    bucket = &uid_map_uid_hash[uid % MAPPING_HASH_BUCKETS];
+    
+    le = bucket->Flink;
+    while (le != bucket) {
+        um = CONTAINING_RECORD(le, uid_map, listentry_id);
         
         if (um->uid == uid) {
             *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(um->sid), ALLOC_TAG);
@@ -286,15 +346,18 @@ void uid_to_sid(UINT32 uid, PSID* sid) {
 }
 
 UINT32 sid_to_uid(PSID sid) {
-    LIST_ENTRY* le;
+    LIST_ENTRY *le, *bucket;
     uid_map* um;
     sid_header* sh = sid;
+    UINT32 hash = sid_hash(sid);
+    
+    bucket = &uid_map_sid_hash[hash % MAPPING_HASH_BUCKETS];
 
-    le = uid_map_list.Flink;
-    while (le != &uid_map_list) {
-        um = CONTAINING_RECORD(le, uid_map, listentry);
+    le = bucket->Flink;
+    while (le != bucket) {
+        um = CONTAINING_RECORD(le, uid_map, listentry_sid);
         
-        if (RtlEqualSid(sid, um->sid))
+        if (um->sid_hash == hash && RtlEqualSid(sid, um->sid))
             return um->uid;
         
         le = le->Flink;
@@ -312,10 +375,30 @@ UINT32 sid_to_uid(PSID sid) {
 }
 
 static void gid_to_sid(UINT32 gid, PSID* sid) {
+    LIST_ENTRY *le, *bucket;
+    gid_map* gm;
     sid_header* sh;
     UCHAR els;
     
-    // FIXME - do this properly?
+    bucket = &gid_map_gid_hash[gid % MAPPING_HASH_BUCKETS];
+    
+    le = bucket->Flink;
+    while (le != bucket) {
+        gm = CONTAINING_RECORD(le, gid_map, listentry_id);
+        
+        if (gm->gid == gid) {
+            *sid = ExAllocatePoolWithTag(PagedPool, RtlLengthSid(gm->sid), ALLOC_TAG);
+            if (!*sid) {
+                ERR("out of memory\n");
+                return;
+            }
+            
+            RtlCopyMemory(*sid, gm->sid, RtlLengthSid(gm->sid));
+            return;
+        }
+        
+        le = le->Flink;
+    }
     
     // fallback to S-1-22-2-X, Samba's SID scheme
     els = 2;
@@ -342,6 +425,32 @@ static void gid_to_sid(UINT32 gid, PSID* sid) {
     *sid = sh;
 }
 
+static UINT32 sid_to_gid(PSID sid) {
+    LIST_ENTRY *le, *bucket;
+    gid_map* gm;
+    sid_header* sh = sid;
+    UINT32 hash = sid_hash(sid);
+    
+    bucket = &gid_map_sid_hash[hash % MAPPING_HASH_BUCKETS];
+
+    le = bucket->Flink;
+    while (le != bucket) {
+        gm = CONTAINING_RECORD(le, gid_map, listentry_sid);
+        
+        if (gm->sid_hash == hash && RtlEqualSid(sid, gm->sid))
+            return gm->gid;
+        
+        le = le->Flink;
+    }
+    
+    // Samba's SID scheme: S-1-22-2-X
+    if (sh->revision == 1 && sh->elements == 2 && sh->auth[0] == 0 && sh->auth[1] == 0 && sh->auth[2] == 0 && sh->auth[3] == 0 &&
+        sh->auth[4] == 0 && sh->auth[5] == 22 && sh->nums[0] == 2)
+        return sh->nums[1];
+
+    return GID_NOBODY;
+}
+
 static ACL* load_default_acl() {
     ULONG size;
     ACL* acl;
@@ -822,6 +931,7 @@ static NTSTATUS STDCALL set_file_security(device_extension* Vcb, PFILE_OBJECT Fi
     ccb* ccb = FileObject->FsContext2;
     file_ref* fileref = ccb ? ccb->fileref : NULL;
     SECURITY_DESCRIPTOR* oldsd;
+    BOOL oldsd_shared;
     LARGE_INTEGER time;
     BTRFS_TIME now;
     
@@ -847,6 +957,7 @@ static NTSTATUS STDCALL set_file_security(device_extension* Vcb, PFILE_OBJECT Fi
     }
      
     oldsd = fcb->sd;
+    oldsd_shared = fcb->sd_shared;
     
     Status = SeSetSecurityDescriptorInfo(NULL, &flags, sd, (void**)&fcb->sd, PagedPool, IoGetFileObjectGenericMapping());
     
@@ -855,7 +966,10 @@ static NTSTATUS STDCALL set_file_security(device_extension* Vcb, PFILE_OBJECT Fi
         goto end;
     }
     
-    ExFreePool(oldsd);
+    free_sd(Vcb, oldsd, oldsd_shared);
+    
+    fcb->sd_shared = FALSE;
+    fcb_share_sd(fcb);
     
     KeQuerySystemTime(&time);
     win_time_to_unix(time, &now);
@@ -881,6 +995,21 @@ static NTSTATUS STDCALL set_file_security(device_extension* Vcb, PFILE_OBJECT Fi
         fcb->inode_item.st_uid = sid_to_uid(owner);
     }
     
+    if (flags & GROUP_SECURITY_INFORMATION) {
+        PSID group;
+        BOOLEAN defaulted;
+        
+        Status = RtlGetGroupSecurityDescriptor(sd, &group, &defaulted);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("RtlGetGroupSecurityDescriptor returned %08x\n", Status);
+            goto end;
+        }
+        
+        if (group)
+            fcb->inode_item.st_gid = sid_to_gid(group);
+    }
+    
     fcb->sd_dirty = TRUE;
     fcb->inode_item_changed = TRUE;
     
@@ -976,7 +1105,7 @@ end:
 
 NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as) {
     NTSTATUS Status;
-    PSID owner;
+    PSID owner, group;
     BOOLEAN defaulted;
     
     Status = SeAssignSecurityEx(parfileref ? parfileref->fcb->sd : NULL, as->SecurityDescriptor, (void**)&fcb->sd, NULL, fcb->type == BTRFS_TYPE_DIRECTORY,
@@ -995,5 +1124,118 @@ NTSTATUS fcb_get_new_sd(fcb* fcb, file_ref* parfileref, ACCESS_STATE* as) {
         fcb->inode_item.st_uid = sid_to_uid(owner);
     }
     
+    Status = RtlGetGroupSecurityDescriptor(fcb->sd, &group, &defaulted);
+    if (!NT_SUCCESS(Status)) {
+        ERR("RtlGetGroupSecurityDescriptor returned %08x\n", Status);
+    } else if (group) {
+        fcb->inode_item.st_gid = sid_to_gid(group);
+    }
+    
+    fcb_share_sd(fcb);
+    
     return STATUS_SUCCESS;
 }
+
+void init_sd_cache(device_extension* Vcb) {
+    ULONG i;
+    
+    for (i = 0; i < SD_CACHE_BUCKETS; i++) {
+        InitializeListHead(&Vcb->sd_cache[i]);
+    }
+    
+    ExInitializeResourceLite(&Vcb->sd_cache_lock);
+}
+
+// Security descriptors are nearly always inherited, so most volumes only have
+// a handful of distinct ones. Rather than each fcb having its own copy, we
+// replace fcb->sd with a refcounted entry in a per-volume table. Shared
+// descriptors must never be modified in place - anything which changes the
+// SD needs to free the old one with free_sd and then call this again.
+void fcb_share_sd(fcb* fcb) {
+    device_extension* Vcb = fcb->Vcb;
+    ULONG length;
+    UINT32 hash;
+    LIST_ENTRY *bucket, *le;
+    sd_cache_entry* sce;
+    
+    if (!fcb->sd || fcb->sd_shared)
+        return;
+    
+    length = RtlLengthSecurityDescriptor(fcb->sd);
+    if (length == 0)
+        return;
+    
+    hash = calc_crc32c(0xffffffff, (UINT8*)fcb->sd, length);
+    bucket = &Vcb->sd_cache[hash % SD_CACHE_BUCKETS];
+    
+    ExAcquireResourceExclusiveLite(&Vcb->sd_cache_lock, TRUE);
+    
+    le = bucket->Flink;
+    while (le != bucket) {
+        sce = CONTAINING_RECORD(le, sd_cache_entry, list_entry);
+        
+        if (sce->hash == hash && sce->length == length && RtlCompareMemory(sce->data, fcb->sd, length) == length) {
+            sce->refcount++;
+            
+            Vcb->counters.sd_cache_hits++;
+            Vcb->counters.sd_cache_saved += length;
+            
+            goto end;
+        }
+        
+        le = le->Flink;
+    }
+    
+    sce = ExAllocatePoolWithTag(PagedPool, offsetof(sd_cache_entry, data[0]) + length, ALLOC_TAG);
+    if (!sce) {
+        ERR("out of memory\n");
+        ExReleaseResourceLite(&Vcb->sd_cache_lock);
+        return;
+    }
+    
+    sce->hash = hash;
+    sce->length = length;
+    sce->refcount = 1;
+    RtlCopyMemory(sce->data, fcb->sd, length);
+    
+    InsertTailList(bucket, &sce->list_entry);
+    
+    Vcb->counters.sd_cache_misses++;
+    Vcb->counters.sd_cache_entries++;
+    Vcb->counters.sd_cache_size += length;
+    
+end:
+    ExReleaseResourceLite(&Vcb->sd_cache_lock);
+    
+    ExFreePool(fcb->sd);
+    
+    fcb->sd = (SECURITY_DESCRIPTOR*)sce->data;
+    fcb->sd_shared = TRUE;
+}
+
+void free_sd(device_extension* Vcb, SECURITY_DESCRIPTOR* sd, BOOL shared) {
+    sd_cache_entry* sce;
+    
+    if (!shared) {
+        ExFreePool(sd);
+        return;
+    }
+    
+    sce = CONTAINING_RECORD(sd, sd_cache_entry, data);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->sd_cache_lock, TRUE);
+    
+    sce->refcount--;
+    
+    if (sce->refcount == 0) {
+        RemoveEntryList(&sce->list_entry);
+        
+        Vcb->counters.sd_cache_entries--;
+        Vcb->counters.sd_cache_size -= sce->length;
+        
+        ExFreePool(sce);
+    } else
+        Vcb->counters.sd_cache_saved -= sce->length;
+    
+    ExReleaseResourceLite(&Vcb->sd_cache_lock);
+}
@@ -47,6 +47,12 @@ NTSTATUS STDCALL load_tree(device_extension* Vcb, UINT64 addr, root* r, tree** p
     
     th = (tree_header*)buf;
     
+    if (th->level >= BTRFS_MAX_LEVEL) {
+        ERR("tree at %llx has invalid level %u\n", addr, th->level);
+        ExFreePool(buf);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
     t = ExAllocatePoolWithTag(PagedPool, sizeof(tree), ALLOC_TAG);
     if (!t) {
         ERR("out of memory\n");
@@ -241,6 +247,9 @@ static tree* free_tree2(tree* t) {
     InterlockedDecrement(&t->Vcb->open_trees);
     RemoveEntryList(&t->list_entry);
     
+    if (t->write)
+        RemoveEntryList(&t->list_entry_dirty);
+    
     if (r) {
         r->treeholder.tree = NULL;
 //             ExReleaseResourceLite(&r->nonpaged->load_tree_lock);
@@ -322,6 +331,36 @@ tree* STDCALL free_tree(tree* t) {
     return ret;
 }
 
+void mark_tree_dirty(tree* t) {
+    if (t->write)
+        return;
+    
+    t->write = TRUE;
+    InsertTailList(&t->Vcb->dirty_trees[t->header.level], &t->list_entry_dirty);
+}
+
+void set_tree_level(tree* t, UINT8 level) {
+    if (t->write) {
+        RemoveEntryList(&t->list_entry_dirty);
+        InsertTailList(&t->Vcb->dirty_trees[level], &t->list_entry_dirty);
+    }
+    
+    t->header.level = level;
+}
+
+void clear_dirty_trees(device_extension* Vcb) {
+    UINT8 level;
+    
+    for (level = 0; level < BTRFS_MAX_LEVEL; level++) {
+        while (!IsListEmpty(&Vcb->dirty_trees[level])) {
+            LIST_ENTRY* le = RemoveHeadList(&Vcb->dirty_trees[level]);
+            tree* t = CONTAINING_RECORD(le, tree, list_entry_dirty);
+            
+            t->write = FALSE;
+        }
+    }
+}
+
 static __inline tree_data* first_item(tree* t) {
     LIST_ENTRY* le = t->itemlist.Flink;
     
@@ -893,7 +932,7 @@ NTSTATUS STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id,
 //     ERR("size now %x\n", tp.tree->size);
     
     if (!tp.tree->write) {
-        tp.tree->write = TRUE;
+        mark_tree_dirty(tp.tree);
         Vcb->need_write = TRUE;
     }
     
@@ -955,7 +994,7 @@ NTSTATUS STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp) {
     tp->item->ignore = TRUE;
     
     if (!tp->tree->write) {
-        tp->tree->write = TRUE;
+        mark_tree_dirty(tp->tree);
         Vcb->need_write = TRUE;
     }
     
@@ -1076,9 +1115,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                     ExAcquireResourceExclusiveLite(&rs->chunk->lock, TRUE);
                 
                 if (ri->type == ROLLBACK_ADD_SPACE)
-                    space_list_subtract2(Vcb, rs->list, rs->list_size, rs->address, rs->length, NULL);
+                    space_list_subtract2(Vcb, rs->list, rs->tree, rs->address, rs->length, NULL);
                 else
-                    space_list_add2(Vcb, rs->list, rs->list_size, rs->address, rs->length, NULL);
+                    space_list_add2(Vcb, rs->list, rs->tree, rs->address, rs->length, NULL);
                 
                 if (rs->chunk) {
                     LIST_ENTRY* le2 = le->Blink;
@@ -1092,9 +1131,9 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
                             
                             if (rs2->chunk == rs->chunk) {
                                 if (ri2->type == ROLLBACK_ADD_SPACE)
-                                    space_list_subtract2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
+                                    space_list_subtract2(Vcb, rs2->list, rs2->tree, rs2->address, rs2->length, NULL);
                                 else
-                                    space_list_add2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
+                                    space_list_add2(Vcb, rs2->list, rs2->tree, rs2->address, rs2->length, NULL);
                                 
                                 ExFreePool(rs2);
                                 RemoveEntryList(&ri2->list_entry);
@@ -1488,7 +1527,7 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
                                 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
                             
                             break;
@@ -1573,7 +1612,7 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
                                 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
                             
                             break;
@@ -1665,7 +1704,7 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
                                 
                                 t->header.num_items++;
                                 t->size += newlen + sizeof(leaf_node);
-                                t->write = TRUE;
+                                mark_tree_dirty(t);
                             }
                             
                             break;
@@ -1696,7 +1735,7 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
         
             t->header.num_items--;
             t->size -= sizeof(leaf_node) + td->size;
-            t->write = TRUE;
+            mark_tree_dirty(t);
         }
 
         if (newtd) {
@@ -1712,9 +1751,48 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
     return FALSE;
 }
 
+static BOOL key_in_tree(tree* t, const KEY* searchkey) {
+    KEY tree_end;
+    BOOL no_end;
+    
+    if (!t->parent)
+        return TRUE;
+    
+    if (keycmp(*searchkey, t->paritem->key) == -1)
+        return FALSE;
+    
+    find_tree_end(t, &tree_end, &no_end);
+    
+    return no_end || keycmp(*searchkey, tree_end) == -1;
+}
+
+// Batch items are sorted, so the next key will usually be close to where the last one went. Rather than
+// descending from the top each time, we start from the lowest ancestor of the last leaf that covers the key.
+static NTSTATUS find_item_from_cursor(device_extension* Vcb, root* r, tree* cursor, traverse_ptr* tp, const KEY* searchkey, PIRP Irp) {
+    NTSTATUS Status;
+    
+    if (cursor) {
+        tree* t = cursor;
+        
+        while (t->parent && !key_in_tree(t, searchkey)) {
+            t = t->parent;
+        }
+        
+        if (t->parent) {
+            Status = find_item_in_tree(Vcb, t, tp, searchkey, FALSE, 0, Irp);
+            
+            if (NT_SUCCESS(Status))
+                return Status;
+        }
+    }
+    
+    return find_item(Vcb, r, tp, searchkey, FALSE, Irp);
+}
+
 static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP Irp) {
     LIST_ENTRY* le;
     NTSTATUS Status;
+    tree* cursor = NULL;
     
     TRACE("root: %llx\n", br->r->id);
     
@@ -1732,7 +1810,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
         
         TRACE("(%llx,%x,%llx)\n", bi->key.obj_id, bi->key.obj_type, bi->key.offset);
         
-        Status = find_item(Vcb, br->r, &tp, &bi->key, FALSE, Irp);
+        Status = find_item_from_cursor(Vcb, br->r, cursor, &tp, &bi->key, Irp);
         if (!NT_SUCCESS(Status)) { // FIXME - handle STATUS_NOT_FOUND
             ERR("find_item returned %08x\n", Status);
             return;
@@ -1750,7 +1828,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
                     tp.item->ignore = TRUE;
                     tp.tree->header.num_items--;
                     tp.tree->size -= tp.item->size + sizeof(leaf_node);
-                    tp.tree->write = TRUE;
+                    mark_tree_dirty(tp.tree);
                 }
                 
                 le2 = tp.item->list_entry.Flink;
@@ -1762,7 +1840,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
                             td->ignore = TRUE;
                             tp.tree->header.num_items--;
                             tp.tree->size -= td->size + sizeof(leaf_node);
-                            tp.tree->write = TRUE;
+                            mark_tree_dirty(tp.tree);
                         }
                     } else {
                         ended = TRUE;
@@ -1791,7 +1869,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
                                 td->ignore = TRUE;
                                 tp.tree->header.num_items--;
                                 tp.tree->size -= td->size + sizeof(leaf_node);
-                                tp.tree->write = TRUE;
+                                mark_tree_dirty(tp.tree);
                             }
                         } else {
                             ended = TRUE;
@@ -1851,7 +1929,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
             if (!ignore && td) {
                 tp.tree->header.num_items++;
                 tp.tree->size += bi->datalen + sizeof(leaf_node);
-                tp.tree->write = TRUE;
+                mark_tree_dirty(tp.tree);
                 
                 listhead = &td->list_entry;
             } else {
@@ -1954,6 +2032,8 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
             }
         }
         
+        cursor = tp.tree;
+        
         le = le->Flink;
     }
     
@@ -52,7 +52,6 @@ extern tCcCopyWriteEx CcCopyWriteEx;
 extern BOOL diskacc;
 
 BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address) {
-    LIST_ENTRY* le;
     space* s;
     
     TRACE("(%p, %llx, %llx, %p)\n", Vcb, c->offset, length, address);
@@ -69,32 +68,9 @@ BOOL find_data_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length,
         }
     }
     
-    if (IsListEmpty(&c->space_size))
-        return FALSE;
-    
-    le = c->space_size.Flink;
-    while (le != &c->space_size) {
-        s = CONTAINING_RECORD(le, space, list_entry_size);
-        
-        if (s->size == length) {
-            *address = s->address;
-            return TRUE;
-        } else if (s->size < length) {
-            if (le == c->space_size.Flink)
-                return FALSE;
-            
-            s = CONTAINING_RECORD(le->Blink, space, list_entry_size);
-            
-            *address = s->address;
-            return TRUE;
-        }
-        
-        le = le->Flink;
-    }
-    
-    s = CONTAINING_RECORD(c->space_size.Blink, space, list_entry_size);
+    s = space_tree_find_size(&c->space_tree, length);
     
-    if (s->size > length) {
+    if (s) {
         *address = s->address;
         return TRUE;
     }
@@ -568,6 +544,9 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     c->offset = logaddr;
     c->used = c->oldused = 0;
     c->cache = c->old_cache = NULL;
+    c->cache_image = NULL;
+    c->cache_image_len = 0;
+    c->cache_image_inode = 0;
     c->readonly = FALSE;
     c->reloc = FALSE;
     c->last_alloc_set = FALSE;
@@ -575,7 +554,8 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     c->cache_loaded = TRUE;
     
     InitializeListHead(&c->space);
-    InitializeListHead(&c->space_size);
+    c->space_tree.root = NULL;
+    c->space_tree.root_size = NULL;
     InitializeListHead(&c->deleting);
     InitializeListHead(&c->changed_extents);
     
@@ -595,7 +575,7 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     s->address = c->offset;
     s->size = c->chunk_item->size;
     InsertTailList(&c->space, &s->list_entry);
-    InsertTailList(&c->space_size, &s->list_entry_size);
+    space_tree_insert(&c->space_tree, s);
     
     protect_superblocks(Vcb, c);
     
@@ -2445,10 +2425,360 @@ void free_write_data_stripes(write_data_context* wtc) {
     }
 }
 
+static void update_delalloc_accounting(fcb* fcb, UINT64 old_size) {
+    device_extension* Vcb = fcb->Vcb;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->delalloc_lock, TRUE);
+    
+    Vcb->delalloc_size = Vcb->delalloc_size - old_size + fcb->delalloc_size;
+    
+    if (IsListEmpty(&fcb->delalloc)) {
+        if (fcb->list_entry_delalloc.Flink) {
+            RemoveEntryList(&fcb->list_entry_delalloc);
+            fcb->list_entry_delalloc.Flink = NULL;
+        }
+    } else if (!fcb->list_entry_delalloc.Flink)
+        InsertTailList(&Vcb->delalloc_fcbs, &fcb->list_entry_delalloc);
+    
+    ExReleaseResourceLite(&Vcb->delalloc_lock);
+}
+
+// must be called with delalloc_lock held exclusively
+static NTSTATUS trim_delalloc(fcb* fcb, UINT64 start, UINT64 end) {
+    LIST_ENTRY* le = fcb->delalloc.Flink;
+    
+    while (le != &fcb->delalloc) {
+        LIST_ENTRY* le2 = le->Flink;
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start >= end)
+            break;
+        
+        if (dr->start + dr->length > start) {
+            if (dr->start >= start && dr->start + dr->length <= end) { // range entirely covered
+                fcb->delalloc_size -= dr->length;
+                
+                RemoveEntryList(&dr->list_entry);
+                ExFreePool(dr->data);
+                ExFreePool(dr);
+            } else if (dr->start >= start) { // beginning of range covered
+                UINT64 cut = end - dr->start;
+                
+                RtlMoveMemory(dr->data, dr->data + cut, dr->length - cut);
+                
+                dr->start = end;
+                dr->length -= cut;
+                fcb->delalloc_size -= cut;
+            } else if (dr->start + dr->length <= end) { // end of range covered
+                UINT64 cut = dr->start + dr->length - start;
+                
+                dr->length -= cut;
+                fcb->delalloc_size -= cut;
+            } else { // middle of range covered
+                delalloc_range* dr2 = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+                
+                if (!dr2) {
+                    ERR("out of memory\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                
+                dr2->start = end;
+                dr2->length = dr->start + dr->length - end;
+                dr2->data = ExAllocatePoolWithTag(PagedPool, dr2->length, ALLOC_TAG);
+                
+                if (!dr2->data) {
+                    ERR("out of memory\n");
+                    ExFreePool(dr2);
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                
+                RtlCopyMemory(dr2->data, dr->data + end - dr->start, dr2->length);
+                
+                dr->length = start - dr->start;
+                fcb->delalloc_size -= end - start;
+                
+                InsertHeadList(&dr->list_entry, &dr2->list_entry);
+                
+                break;
+            }
+        }
+        
+        le = le2;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+// Called when a range is about to be overwritten or excised, so that we don't later write stale data over it.
+static NTSTATUS discard_delalloc(fcb* fcb, UINT64 start, UINT64 end) {
+    NTSTATUS Status;
+    UINT64 old_size;
+    
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+    
+    ExAcquireResourceExclusiveLite(&fcb->nonpaged->delalloc_lock, TRUE);
+    
+    old_size = fcb->delalloc_size;
+    
+    Status = trim_delalloc(fcb, start, end);
+    if (!NT_SUCCESS(Status))
+        ERR("trim_delalloc returned %08x\n", Status);
+    
+    update_delalloc_accounting(fcb, old_size);
+    
+    ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+    
+    return Status;
+}
+
+void read_delalloc(fcb* fcb, UINT8* data, UINT64 start, UINT64 length) {
+    LIST_ENTRY* le;
+    
+    ExAcquireResourceSharedLite(&fcb->nonpaged->delalloc_lock, TRUE);
+    
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start >= start + length)
+            break;
+        
+        if (dr->start + dr->length > start) {
+            UINT64 s = max(dr->start, start);
+            UINT64 e = min(dr->start + dr->length, start + length);
+            
+            RtlCopyMemory(data + s - start, dr->data + s - dr->start, e - s);
+        }
+        
+        le = le->Flink;
+    }
+    
+    ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+}
+
+// Each range gets its own rollback list, which is cleared as soon as it's been written - the range's
+// data is freed at that point, so rolling back the extents afterwards would lose it.
+NTSTATUS flush_delalloc(fcb* fcb, PIRP Irp) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY ranges, rollback;
+    UINT64 old_size, eof;
+    
+    ExAcquireResourceExclusiveLite(&fcb->nonpaged->delalloc_lock, TRUE);
+    
+    if (IsListEmpty(&fcb->delalloc)) {
+        ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+        return STATUS_SUCCESS;
+    }
+    
+    // Take the ranges off the fcb before we start, so that do_write_file doesn't discard them.
+    
+    InitializeListHead(&ranges);
+    
+    while (!IsListEmpty(&fcb->delalloc)) {
+        InsertTailList(&ranges, RemoveHeadList(&fcb->delalloc));
+    }
+    
+    old_size = fcb->delalloc_size;
+    fcb->delalloc_size = 0;
+    
+    update_delalloc_accounting(fcb, old_size);
+    
+    eof = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
+    
+    while (!IsListEmpty(&ranges)) {
+        delalloc_range* dr = CONTAINING_RECORD(ranges.Flink, delalloc_range, list_entry);
+        LIST_ENTRY* le = dr->list_entry.Flink;
+        UINT64 end = dr->start + dr->length;
+        UINT8* data = dr->data;
+        ULONG i, num_ranges = 1;
+        
+        // merge ranges which follow on from each other, so they get written as a single extent
+        while (le != &ranges) {
+            delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+            
+            if (dr2->start != end || end + dr2->length - dr->start > MAX_EXTENT_SIZE)
+                break;
+            
+            end += dr2->length;
+            num_ranges++;
+            
+            le = le->Flink;
+        }
+        
+        if (num_ranges > 1) {
+            data = ExAllocatePoolWithTag(PagedPool, end - dr->start, ALLOC_TAG);
+            
+            if (data) {
+                le = &dr->list_entry;
+                
+                for (i = 0; i < num_ranges; i++) {
+                    delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+                    
+                    RtlCopyMemory(data + dr2->start - dr->start, dr2->data, dr2->length);
+                    
+                    le = le->Flink;
+                }
+            } else {
+                WARN("out of memory, writing delayed ranges separately\n");
+                data = dr->data;
+                end = dr->start + dr->length;
+                num_ranges = 1;
+            }
+        }
+        
+        if (end > eof)
+            end = eof;
+        
+        if (!fcb->deleted && end > dr->start) {
+            InitializeListHead(&rollback);
+            
+            Status = do_write_file(fcb, dr->start, end, data, Irp, FALSE, 0, &rollback);
+            
+            if (NT_SUCCESS(Status))
+                clear_rollback(fcb->Vcb, &rollback);
+            else {
+                ERR("do_write_file returned %08x\n", Status);
+                do_rollback(fcb->Vcb, &rollback);
+            }
+        }
+        
+        if (data != dr->data)
+            ExFreePool(data);
+        
+        if (!NT_SUCCESS(Status))
+            break;
+        
+        for (i = 0; i < num_ranges; i++) {
+            delalloc_range* dr2 = CONTAINING_RECORD(RemoveHeadList(&ranges), delalloc_range, list_entry);
+            
+            ExFreePool(dr2->data);
+            ExFreePool(dr2);
+        }
+    }
+    
+    // put back whatever we didn't manage to write
+    if (!IsListEmpty(&ranges)) {
+        while (!IsListEmpty(&ranges)) {
+            delalloc_range* dr = CONTAINING_RECORD(RemoveHeadList(&ranges), delalloc_range, list_entry);
+            
+            InsertTailList(&fcb->delalloc, &dr->list_entry);
+            fcb->delalloc_size += dr->length;
+        }
+        
+        update_delalloc_accounting(fcb, 0);
+    }
+    
+    ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+    
+    return Status;
+}
+
+NTSTATUS flush_all_delalloc(device_extension* Vcb, PIRP Irp) {
+    NTSTATUS Status;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->delalloc_lock, TRUE);
+    
+    while (!IsListEmpty(&Vcb->delalloc_fcbs)) {
+        fcb* fcb = CONTAINING_RECORD(Vcb->delalloc_fcbs.Flink, struct _fcb, list_entry_delalloc);
+        
+        ExReleaseResourceLite(&Vcb->delalloc_lock);
+        
+        ExAcquireResourceExclusiveLite(fcb->Header.Resource, TRUE);
+        
+        Status = flush_delalloc(fcb, Irp);
+        
+        ExReleaseResourceLite(fcb->Header.Resource);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_delalloc returned %08x\n", Status);
+            return Status;
+        }
+        
+        ExAcquireResourceExclusiveLite(&Vcb->delalloc_lock, TRUE);
+    }
+    
+    ExReleaseResourceLite(&Vcb->delalloc_lock);
+    
+    return STATUS_SUCCESS;
+}
+
+// Takes ownership of data, even on failure.
+static NTSTATUS queue_delalloc(fcb* fcb, UINT64 start, UINT64 length, UINT8* data, PIRP Irp) {
+    NTSTATUS Status;
+    delalloc_range* dr;
+    LIST_ENTRY* le;
+    UINT64 old_size;
+    BOOL flush;
+    
+    dr = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+    if (!dr) {
+        ERR("out of memory\n");
+        ExFreePool(data);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    dr->start = start;
+    dr->length = length;
+    dr->data = data;
+    
+    ExAcquireResourceExclusiveLite(&fcb->nonpaged->delalloc_lock, TRUE);
+    
+    old_size = fcb->delalloc_size;
+    
+    Status = trim_delalloc(fcb, start, start + length);
+    if (!NT_SUCCESS(Status)) {
+        ERR("trim_delalloc returned %08x\n", Status);
+        update_delalloc_accounting(fcb, old_size);
+        ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+        ExFreePool(dr);
+        ExFreePool(data);
+        return Status;
+    }
+    
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr2 = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr2->start > start)
+            break;
+        
+        le = le->Flink;
+    }
+    
+    InsertTailList(le, &dr->list_entry);
+    fcb->delalloc_size += length;
+    
+    update_delalloc_accounting(fcb, old_size);
+    
+    // write it out now if we've got a whole extent's worth, or if we're holding on to too much memory
+    flush = fcb->delalloc_size >= MAX_EXTENT_SIZE || fcb->Vcb->delalloc_size >= DELALLOC_LIMIT;
+    
+    ExReleaseResourceLite(&fcb->nonpaged->delalloc_lock);
+    
+    mark_fcb_dirty(fcb);
+    
+    if (flush) {
+        Status = flush_delalloc(fcb, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("flush_delalloc returned %08x\n", Status);
+            return Status;
+        }
+    }
+    
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 end_data, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     LIST_ENTRY* le;
     
+    Status = discard_delalloc(fcb, start_data, end_data);
+    if (!NT_SUCCESS(Status)) {
+        ERR("discard_delalloc returned %08x\n", Status);
+        return Status;
+    }
+    
     le = fcb->extents.Flink;
 
     while (le != &fcb->extents) {
@@ -3019,37 +3349,13 @@ NTSTATUS calc_csum(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* c
     return STATUS_SUCCESS;
 }
 
-BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
-                         PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size, BOOL file_write, UINT32 irp_offset) {
-    UINT64 address;
+static BOOL add_data_extent(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 address, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
+                            LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size, BOOL from_cluster) {
     NTSTATUS Status;
     EXTENT_DATA* ed;
     EXTENT_DATA2* ed2;
     ULONG edsize = sizeof(EXTENT_DATA) - 1 + sizeof(EXTENT_DATA2);
     UINT32* csum = NULL;
-// #ifdef DEBUG_PARANOID
-//     traverse_ptr tp;
-//     KEY searchkey;
-// #endif
-    
-    TRACE("(%p, (%llx, %llx), %llx, %llx, %llx, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
-    
-    if (!find_data_address_in_chunk(Vcb, c, length, &address))
-        return FALSE;
-    
-// #ifdef DEBUG_PARANOID
-//     searchkey.obj_id = address;
-//     searchkey.obj_type = TYPE_EXTENT_ITEM;
-//     searchkey.offset = 0xffffffffffffffff;
-//     
-//     Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE);
-//     if (!NT_SUCCESS(Status)) {
-//         ERR("error - find_item returned %08x\n", Status);
-//     } else if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
-//         ERR("address %llx already allocated\n", address);
-//         int3;
-//     }
-// #endif
     
     // add extent data to inode
     ed = ExAllocatePoolWithTag(PagedPool, edsize, ALLOC_TAG);
@@ -3093,8 +3399,17 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
         return FALSE;
     }
     
-    c->used += length;
-    space_list_subtract(Vcb, c, FALSE, address, length, rollback);
+    // Space from an allocation cluster has already been taken out of the chunk's free space,
+    // so all we need the chunk lock for here is the usage figure.
+    if (from_cluster) {
+        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        
+        c->used += length;
+        add_rollback_space(rollback, FALSE, &c->space, &c->space_tree, address, length, c);
+    } else {
+        c->used += length;
+        space_list_subtract(Vcb, c, FALSE, address, length, rollback);
+    }
     
     fcb->inode_item.st_blocks += decoded_size;
     
@@ -3108,6 +3423,43 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     
     ExReleaseResourceLite(&c->changed_extents_lock);
     
+    if (from_cluster)
+        ExReleaseResourceLite(&c->lock);
+
+    return TRUE;
+}
+
+BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start_data, UINT64 length, BOOL prealloc, void* data,
+                         PIRP Irp, LIST_ENTRY* rollback, UINT8 compression, UINT64 decoded_size, BOOL file_write, UINT32 irp_offset) {
+    UINT64 address;
+    NTSTATUS Status;
+// #ifdef DEBUG_PARANOID
+//     traverse_ptr tp;
+//     KEY searchkey;
+// #endif
+    
+    TRACE("(%p, (%llx, %llx), %llx, %llx, %llx, %u, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, rollback);
+    
+    if (!find_data_address_in_chunk(Vcb, c, length, &address))
+        return FALSE;
+    
+// #ifdef DEBUG_PARANOID
+//     searchkey.obj_id = address;
+//     searchkey.obj_type = TYPE_EXTENT_ITEM;
+//     searchkey.offset = 0xffffffffffffffff;
+//     
+//     Status = find_item(Vcb, Vcb->extent_root, &tp, &searchkey, FALSE);
+//     if (!NT_SUCCESS(Status)) {
+//         ERR("error - find_item returned %08x\n", Status);
+//     } else if (tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+//         ERR("address %llx already allocated\n", address);
+//         int3;
+//     }
+// #endif
+    
+    if (!add_data_extent(Vcb, fcb, c, address, start_data, length, prealloc, data, rollback, compression, decoded_size, FALSE))
+        return FALSE;
+    
     ExReleaseResourceLite(&c->lock);
       
     if (data) {
@@ -3119,6 +3471,167 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     return TRUE;
 }
 
+NTSTATUS init_alloc_clusters(device_extension* Vcb) {
+    ULONG i;
+    
+    Vcb->num_clusters = KeQueryActiveProcessorCount(NULL);
+    
+    Vcb->clusters = ExAllocatePoolWithTag(NonPagedPool, sizeof(alloc_cluster) * Vcb->num_clusters, ALLOC_TAG);
+    if (!Vcb->clusters) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(Vcb->clusters, sizeof(alloc_cluster) * Vcb->num_clusters);
+    
+    for (i = 0; i < Vcb->num_clusters; i++) {
+        ExInitializeResourceLite(&Vcb->clusters[i].lock);
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static void release_alloc_cluster(device_extension* Vcb, alloc_cluster* ac) {
+    if (!ac->c)
+        return;
+    
+    if (ac->length > 0) {
+        ExAcquireResourceExclusiveLite(&ac->c->lock, TRUE);
+        space_list_add(Vcb, ac->c, FALSE, ac->address, ac->length, NULL);
+        ExReleaseResourceLite(&ac->c->lock);
+    }
+    
+    ac->c = NULL;
+    ac->address = ac->length = 0;
+}
+
+// Called at the start of each commit, so that the space we've reserved but not used doesn't
+// get written to the free space cache as allocated.
+void release_alloc_clusters(device_extension* Vcb) {
+    ULONG i;
+    
+    for (i = 0; i < Vcb->num_clusters; i++) {
+        ExAcquireResourceExclusiveLite(&Vcb->clusters[i].lock, TRUE);
+        release_alloc_cluster(Vcb, &Vcb->clusters[i]);
+        ExReleaseResourceLite(&Vcb->clusters[i].lock);
+    }
+}
+
+void free_alloc_clusters(device_extension* Vcb) {
+    ULONG i;
+    
+    if (!Vcb->clusters)
+        return;
+    
+    release_alloc_clusters(Vcb);
+    
+    for (i = 0; i < Vcb->num_clusters; i++) {
+        ExDeleteResourceLite(&Vcb->clusters[i].lock);
+    }
+    
+    ExFreePool(Vcb->clusters);
+    Vcb->clusters = NULL;
+}
+
+static BOOL refill_alloc_cluster(device_extension* Vcb, alloc_cluster* ac, UINT64 length) {
+    LIST_ENTRY* le;
+    
+    release_alloc_cluster(Vcb, ac);
+    
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+    
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+        
+        // don't hold up the writer by loading free space here - leave that to insert_extent
+        if (!c->readonly && !c->reloc && c->cache_loaded && c->chunk_item->type == Vcb->data_flags && (c->chunk_item->size - c->used) >= length) {
+            space* s;
+            
+            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+            
+            s = space_tree_find_size(&c->space_tree, ALLOC_CLUSTER_SIZE);
+            
+            if (!s)
+                s = space_tree_find_size(&c->space_tree, length);
+            
+            if (s) {
+                ac->c = c;
+                ac->address = s->address;
+                ac->length = min(s->size, ALLOC_CLUSTER_SIZE);
+                
+                space_list_subtract(Vcb, c, FALSE, ac->address, ac->length, NULL);
+                
+                ExReleaseResourceLite(&c->lock);
+                ExReleaseResourceLite(&Vcb->chunk_lock);
+                
+                return TRUE;
+            }
+            
+            ExReleaseResourceLite(&c->lock);
+        }
+        
+        le = le->Flink;
+    }
+    
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+    
+    return FALSE;
+}
+
+// Each processor has a region of a data chunk reserved for itself, which it hands out sequentially.
+// This means that writers on different CPUs don't contend on chunk_lock or the chunk's free space,
+// and don't interleave their extents.
+BOOL insert_extent_cluster(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data, PIRP Irp, LIST_ENTRY* rollback,
+                           UINT8 compression, UINT64 decoded_size, BOOL file_write, UINT32 irp_offset) {
+    alloc_cluster* ac;
+    chunk* c;
+    UINT64 address;
+    NTSTATUS Status;
+    
+    // Don't use the clusters while committing - they've already been released at this point, and
+    // anything we reserved now would be written to the free space cache as allocated.
+    if (!Vcb->clusters || length > ALLOC_CLUSTER_SIZE || ExIsResourceAcquiredExclusiveLite(&Vcb->tree_lock))
+        return FALSE;
+    
+    ac = &Vcb->clusters[KeGetCurrentProcessorNumber() % Vcb->num_clusters];
+    
+    ExAcquireResourceExclusiveLite(&ac->lock, TRUE);
+    
+    if (!ac->c || ac->length < length || ac->c->reloc || ac->c->readonly || ac->c->chunk_item->type != Vcb->data_flags) {
+        if (!refill_alloc_cluster(Vcb, ac, length)) {
+            ExReleaseResourceLite(&ac->lock);
+            return FALSE;
+        }
+    }
+    
+    c = ac->c;
+    address = ac->address;
+    
+    ac->address += length;
+    ac->length -= length;
+    
+    ExReleaseResourceLite(&ac->lock);
+    
+    TRACE("(%p, (%llx, %llx), %llx, %llx, %llx)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length);
+    
+    if (!add_data_extent(Vcb, fcb, c, address, start_data, length, FALSE, data, rollback, compression, decoded_size, TRUE)) {
+        ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+        space_list_add(Vcb, c, FALSE, address, length, NULL);
+        ExReleaseResourceLite(&c->lock);
+        
+        return FALSE;
+    }
+    
+    if (data) {
+        Status = write_data_complete(Vcb, address, data, length, Irp, NULL, file_write, irp_offset);
+        if (!NT_SUCCESS(Status))
+            ERR("write_data_complete returned %08x\n", Status);
+    }
+    
+    return TRUE;
+}
+
 static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data,
                             PIRP Irp, UINT64* written, BOOL file_write, UINT32 irp_offset, LIST_ENTRY* rollback) {
     BOOL success = FALSE;
@@ -3234,14 +3747,17 @@ static NTSTATUS insert_prealloc_extent(fcb* fcb, UINT64 start, UINT64 length, LI
     
     do {
         UINT64 extlen = min(MAX_EXTENT_SIZE, length);
+        BOOL skip_unloaded;
         
         ExAcquireResourceSharedLite(&fcb->Vcb->chunk_lock, TRUE);
         
+        skip_unloaded = fcb->Vcb->space_thread_running;
+        
         le = fcb->Vcb->chunks.Flink;
         while (le != &fcb->Vcb->chunks) {
             c = CONTAINING_RECORD(le, chunk, list_entry);
             
-            if (!c->readonly && !c->reloc) {
+            if (!c->readonly && !c->reloc && (c->cache_loaded || !skip_unloaded)) {
                 ExAcquireResourceExclusiveLite(&c->lock, TRUE);
                 
                 if (c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= extlen) {
@@ -3255,6 +3771,11 @@ static NTSTATUS insert_prealloc_extent(fcb* fcb, UINT64 start, UINT64 length, LI
             }
 
             le = le->Flink;
+            
+            if (le == &fcb->Vcb->chunks && skip_unloaded) {
+                skip_unloaded = FALSE;
+                le = fcb->Vcb->chunks.Flink;
+            }
         }
         
         ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
@@ -3323,18 +3844,33 @@ static NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data
     
     while (written < orig_length) {
         UINT64 newlen = min(length, MAX_EXTENT_SIZE);
-        BOOL done = FALSE;
+        BOOL done = FALSE, skip_unloaded;
+        
+        if (insert_extent_cluster(Vcb, fcb, start_data, newlen, data, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen, file_write, irp_offset)) {
+            written += newlen;
+            
+            if (written == orig_length)
+                return STATUS_SUCCESS;
+            
+            start_data += newlen;
+            length -= newlen;
+            data = &((UINT8*)data)[newlen];
+            continue;
+        }
         
         // Rather than necessarily writing the whole extent at once, we deal with it in blocks of 128 MB.
-        // First, see if we can write the extent part to an existing chunk.
+        // First, see if we can write the extent part to an existing chunk. While the space loader
+        // is still running, we try the chunks it's already done before waiting on any of the others.
         
         ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
         
+        skip_unloaded = Vcb->space_thread_running;
+        
         le = Vcb->chunks.Flink;
         while (le != &Vcb->chunks) {
             c = CONTAINING_RECORD(le, chunk, list_entry);
             
-            if (!c->readonly && !c->reloc) {
+            if (!c->readonly && !c->reloc && (c->cache_loaded || !skip_unloaded)) {
                 ExAcquireResourceExclusiveLite(&c->lock, TRUE);
                 
                 if (c->chunk_item->type == flags && (c->chunk_item->size - c->used) >= newlen &&
@@ -3356,6 +3892,11 @@ static NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data
             }
 
             le = le->Flink;
+            
+            if (le == &Vcb->chunks && skip_unloaded) {
+                skip_unloaded = FALSE;
+                le = Vcb->chunks.Flink;
+            }
         }
         
         ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
@@ -4032,6 +4573,12 @@ NTSTATUS do_write_file(fcb* fcb, UINT64 start, UINT64 end_data, void* data, PIRP
     UINT64 last_off;
 #endif
     
+    Status = discard_delalloc(fcb, start, end_data);
+    if (!NT_SUCCESS(Status)) {
+        ERR("discard_delalloc returned %08x\n", Status);
+        return Status;
+    }
+    
     last_cow_start = 0;
     
     le = fcb->extents.Flink;
@@ -4225,7 +4772,7 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
     INODE_ITEM* origii;
     BOOL changed_length = FALSE/*, lazy_writer = FALSE, write_eof = FALSE*/;
     NTSTATUS Status;
-    LARGE_INTEGER time;
+    LARGE_INTEGER time, io_time, io_freq;
     BTRFS_TIME now;
     fcb* fcb;
     ccb* ccb;
@@ -4556,7 +5103,27 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             }
             
             ExFreePool(data);
+        } else if (paging_io && !pagefile && Vcb->options.delalloc && !(fcb->inode_item.flags & BTRFS_INODE_NODATACOW)) {
+            // Hang on to the data until the next flush, so that consecutive writes end up in the same extent.
+            if (no_buf) {
+                data = ExAllocatePoolWithTag(PagedPool, end_data - start_data, ALLOC_TAG);
+                if (!data) {
+                    ERR("out of memory\n");
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    goto end;
+                }
+                
+                RtlCopyMemory(data, buf, end_data - start_data);
+            }
+            
+            Status = queue_delalloc(fcb, start_data, end_data - start_data, data, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("queue_delalloc returned %08x\n", Status);
+                goto end;
+            }
         } else {
+            io_time = KeQueryPerformanceCounter(&io_freq);
+            
             if (write_irp && Irp->MdlAddress) {
                 BOOL locked = Irp->MdlAddress->MdlFlags & MDL_PAGES_LOCKED;
                 
@@ -4570,6 +5137,8 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             } else
                 Status = do_write_file(fcb, start_data, end_data, data, Irp, FALSE, 0, rollback);
             
+            update_foreground_latency(Vcb, io_time, io_freq);
+            
             if (!NT_SUCCESS(Status)) {
                 ERR("do_write_file returned %08x\n", Status);
                 ExFreePool(data);